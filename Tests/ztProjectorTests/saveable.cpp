@@ -0,0 +1,171 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+
+#include <ztSaveable.h>
+#include <ztProjector.h>
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace ztProjectorTests
+{
+
+	using std::vector;
+	using std::string;
+	using zt::Image;
+
+	// Opens a temporary file for writing and reading back.
+	static FILE* temporary_file()
+	{
+		FILE* f = nullptr;
+		Assert::AreEqual(0, (int)tmpfile_s(&f));
+		return f;
+	}
+
+	TEST_CLASS(saveable)
+	{
+	public:
+
+		TEST_METHOD(saveable_round_trip)
+		{
+			vector<float> floats{ 1.5f, -2.0f, 3.25f };
+			vector<double> doubles{ 1e-300, 2.0, -3.0 };
+			vector<int> empty;
+			vector<bool> bools{ true, false, true, true };
+			vector<vector<float>> nested{ { 1.0f }, {}, { 2.0f, 3.0f } };
+			std::map<int, vector<double>> map{ { 1, { 1.0 } }, { 7, { 2.0, 3.0 } } };
+			string text = "some text";
+
+			FILE* f = temporary_file();
+			zt::file_write(floats, f);
+			zt::file_write(doubles, f);
+			zt::file_write(empty, f);
+			zt::file_write(bools, f);
+			zt::file_write(nested, f);
+			zt::file_write(map, f);
+			zt::file_write(text, f);
+			rewind(f);
+
+			vector<float> floats2;
+			vector<double> doubles2;
+			vector<int> empty2{ 5 };
+			vector<bool> bools2;
+			vector<vector<float>> nested2;
+			std::map<int, vector<double>> map2;
+			string text2;
+			zt::file_read(floats2, f);
+			zt::file_read(doubles2, f);
+			zt::file_read(empty2, f);
+			zt::file_read(bools2, f);
+			zt::file_read(nested2, f);
+			zt::file_read(map2, f);
+			zt::file_read(text2, f);
+			fclose(f);
+
+			Assert::IsTrue(floats == floats2);
+			Assert::IsTrue(doubles == doubles2);
+			Assert::IsTrue(empty == empty2);
+			Assert::IsTrue(bools == bools2);
+			Assert::IsTrue(nested == nested2);
+			Assert::IsTrue(map == map2);
+			Assert::AreEqual(text, text2);
+		}
+
+		TEST_METHOD(saveable_element_layout)
+		{
+			// bulk writes give the bytes of element by element writes: the count and then the elements
+			vector<float> floats{ 1.0f, 2.0f };
+			FILE* f = temporary_file();
+			zt::file_write(floats, f);
+			rewind(f);
+			int count = 0;
+			float a = 0, b = 0;
+			zt::file_read(count, f);
+			zt::file_read(a, f);
+			zt::file_read(b, f);
+			fclose(f);
+			Assert::AreEqual(2, count);
+			Assert::AreEqual(1.0f, a);
+			Assert::AreEqual(2.0f, b);
+		}
+
+		TEST_METHOD(saveable_truncated)
+		{
+			vector<float> floats(100, 1.0f);
+			FILE* f = temporary_file();
+			zt::file_write(static_cast<int>(floats.size() * 2), f); // claims more elements than follow
+			zt::file_write(floats, f);
+			rewind(f);
+			vector<float> read;
+			Assert::ExpectException<std::runtime_error>([&]{ zt::file_read(read, f); });
+			fclose(f);
+		}
+
+		TEST_METHOD(saveable_projector_file)
+		{
+			const int dim = 4;
+			vector<Image> patches;
+			for (int p = 0; p < 24; ++p){
+				vector<unsigned char> img(12);
+				for (auto& i : img) i = static_cast<unsigned char>(rand() % 256);
+				patches.push_back(zt::make_image(2, 2, 3, img));
+			}
+			zt::Projector proj{ dim, patches, true };
+
+			char name[L_tmpnam_s];
+			Assert::AreEqual(0, (int)tmpnam_s(name));
+			proj.saveToFile(name);
+			zt::Projector loaded(name);
+			remove(name);
+
+			Assert::IsTrue(proj.fingerprint() == loaded.fingerprint());
+			Assert::IsTrue(proj.get_proj_mat() == loaded.get_proj_mat());
+		}
+
+		TEST_METHOD(saveable_legacy_file)
+		{
+			// files written before the header are read as version 0
+			FILE* f = temporary_file();
+			zt::saveName("Projector", f);
+			rewind(f);
+			Assert::AreEqual(0, zt::readFileHeader(f));
+			string name;
+			zt::file_read(name, f);
+			Assert::AreEqual(string("Projector"), name);
+			rewind(f);
+			zt::saveFileHeader(f);
+			rewind(f);
+			Assert::AreEqual(zt::file_format_version, zt::readFileHeader(f));
+			fclose(f);
+		}
+
+		TEST_METHOD(saveable_load_throughput)
+		{
+			// about the size of the projection matrix and covariance of a large patch
+			vector<float> floats(8 << 20);
+			for (size_t i = 0; i < floats.size(); i++) floats[i] = static_cast<float>(i);
+			FILE* f = temporary_file();
+			zt::file_write(floats, f);
+			rewind(f);
+			vector<float> read;
+			auto start = std::chrono::steady_clock::now();
+			zt::file_read(read, f);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			fclose(f);
+			Assert::IsTrue(floats == read);
+
+			double megabytes = floats.size() * sizeof(float) / double(1 << 20);
+			char message[128];
+			sprintf_s(message, "read %.0f MB in %.3f s\n", megabytes, seconds);
+			// logged rather than asserted, as the time depends on the machine; an element by element read takes several seconds
+			Logger::WriteMessage(message);
+		}
+
+	};
+}
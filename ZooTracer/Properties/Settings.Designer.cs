@@ -119,6 +119,18 @@ namespace ZooTracer.Properties {
             }
         }
         
+        [global::System.Configuration.UserScopedSettingAttribute()]
+        [global::System.Diagnostics.DebuggerNonUserCodeAttribute()]
+        [global::System.Configuration.DefaultSettingValueAttribute("0")]
+        public double max_speed {
+            get {
+                return ((double)(this["max_speed"]));
+            }
+            set {
+                this["max_speed"] = value;
+            }
+        }
+        
         [global::System.Configuration.UserScopedSettingAttribute()]
         [global::System.Diagnostics.DebuggerNonUserCodeAttribute()]
         [global::System.Configuration.DefaultSettingValueAttribute("10")]
@@ -178,5 +190,17 @@ namespace ZooTracer.Properties {
                 this["index_accuracy"] = value;
             }
         }
+        
+        [global::System.Configuration.UserScopedSettingAttribute()]
+        [global::System.Diagnostics.DebuggerNonUserCodeAttribute()]
+        [global::System.Configuration.DefaultSettingValueAttribute("0")]
+        public int index_memory_budget_mb {
+            get {
+                return ((int)(this["index_memory_budget_mb"]));
+            }
+            set {
+                this["index_memory_budget_mb"] = value;
+            }
+        }
     }
 }
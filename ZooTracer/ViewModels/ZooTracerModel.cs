@@ -106,7 +106,7 @@ namespace ZooTracer
             {
                 myPcaTask = startPcaAsync();
             }
-            else if (a.PropertyName == "index_accuracy")
+            else if (a.PropertyName == "index_accuracy" || a.PropertyName == "index_memory_budget_mb")
             {
                 var t = myPcaTask;
                 if (t != null)
@@ -204,6 +204,7 @@ namespace ZooTracer
                                                 else if (parts[1] == "max_matches_per_frame") Settings.Default.max_matches_per_frame = int.Parse(parts[3]);
                                                 else if (parts[1] == "matches_appearance_threshold") Settings.Default.matches_appearance_threshold = double.Parse(parts[3]);
                                                 else if (parts[1] == "index_accuracy") Settings.Default.index_accuracy = int.Parse(parts[3]);
+                                                else if (parts[1] == "max_speed") Settings.Default.max_speed = double.Parse(parts[3]);
                                             }
                                         }
                                         Settings.Default.PropertyChanged += settingsChangedHandler;
@@ -221,8 +222,10 @@ namespace ZooTracer
                                                 {
                                                     foreach (var kp in kps)
                                                     {
-                                                        var x = (int)Math.Round(kp.Item1 - 0.5 * patch_size);
-                                                        var y = (int)Math.Round(kp.Item2 - 0.5 * patch_size);
+                                                        // traces are saved in video coordinates
+                                                        var c = myVideo.ToFrame(new Point(kp.Item1, kp.Item2));
+                                                        var x = (int)Math.Round(c.X - 0.5 * patch_size);
+                                                        var y = (int)Math.Round(c.Y - 0.5 * patch_size);
                                                         var image = myVideo.getPatch(kp.Item3, new Int32Rect(x, y, patch_size, patch_size));
                                                         var descriptor = pca.getFeatures(kp.Item3, x, y, patch_size, v);
                                                         doSetKeyPoint(x, y, kp.Item3, image, descriptor, trace, models);
@@ -269,7 +272,12 @@ namespace ZooTracer
                         {
                             var loc = trace.GetTracePoint(i);
                             if (loc == null) f.WriteLine(",,{0}", trace.IsForceOccluded(i) ? 2 : 0);
-                            else f.WriteLine("{1},{2},{0}", trace.IsFixed(i) ? 1 : 0, loc.x + 0.5 * patch_size, loc.y + 0.5 * patch_size);
+                            else
+                            {
+                                // the centre of the patch in pixels of the video, which differ from those of cropped or scaled down frames
+                                var c = myVideo.ToVideo(new Point(loc.x + 0.5 * patch_size, loc.y + 0.5 * patch_size));
+                                f.WriteLine("{1},{2},{0}", trace.IsFixed(i) ? 1 : 0, c.X, c.Y);
+                            }
                         }
                         f.WriteLine(@"
 ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
@@ -277,8 +285,8 @@ ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
 2,B,y,System.Double,1,,frame
 3,C,code,System.Int16,1,,frame
 
-{13}
-{14}{0}
+{14}
+{15}{0}
 0,lambda_d,System.Double,{1}
 0,lambda_u,System.Double,{2}
 0,lambda_o,System.Double,{3}
@@ -291,6 +299,7 @@ ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
 0,max_matches_per_frame,System.Double,{10}
 0,matches_appearance_threshold,System.Double,{11}
 0,index_accuracy,System.Double,{12}
+0,max_speed,System.Double,{13}
 ",
                         Settings.Default.videofilepath,
                         Settings.Default.lambda_d,
@@ -305,6 +314,7 @@ ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
                         Settings.Default.max_matches_per_frame,
                         Settings.Default.matches_appearance_threshold,
                         Settings.Default.index_accuracy,
+                        Settings.Default.max_speed,
                         traceMetaHeader, traceMetaStart);
                     }
                 WriteLine("Wrote the trace to " + fileName);
@@ -426,7 +436,8 @@ ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
                 Settings.Default.lambda_d,
                 Settings.Default.lambda_u,
                 Settings.Default.lambda_o,
-                Settings.Default.max_occlusion_duration);
+                Settings.Default.max_occlusion_duration,
+                Settings.Default.max_speed);
             trace.Subscribe(new ztWpf.Trace.ProgressHandler((i, j) =>
             {
                 var app = Application.Current;
@@ -445,7 +456,8 @@ ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
                 Settings.Default.lambda_d,
                 Settings.Default.lambda_u,
                 Settings.Default.lambda_o,
-                Settings.Default.max_occlusion_duration);
+                Settings.Default.max_occlusion_duration,
+                Settings.Default.max_speed);
         }
 
         private async Task stopTraceAsync(ztWpf.Trace trace)
@@ -462,7 +474,11 @@ ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
             int workers = 2;
             int.TryParse(Environment.GetEnvironmentVariable("NUMBER_OF_PROCESSORS"), out workers);
             workers = Math.Max(1, workers - 1);
-            var index = new ztWpf.KDTreeSource(myVideo, pca, Settings.Default.index_accuracy, workers, getPcaFolderPath());
+            // with a memory budget only the trees around the frames in use are kept, loaded ahead as the user scrubs
+            int budget = Settings.Default.index_memory_budget_mb;
+            var index = budget > 0
+                ? new ztWpf.KDTreeSource(myVideo, pca, Settings.Default.index_accuracy, workers, getPcaFolderPath(), ztWpf.IndexType.Float, budget)
+                : new ztWpf.KDTreeSource(myVideo, pca, Settings.Default.index_accuracy, workers, getPcaFolderPath());
             myTrace = startTrace(index);
             index.Subscribe(progressHandlerKDTreeSource);
             return index;
@@ -631,6 +647,9 @@ ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
             }
         }
 
+        // The number of frames to load trees for ahead of the current frame when it changes.
+        private const int scrubPrefetchFrames = 30;
+
         /// <summary>
         /// Gets or sets current video frame number.
         /// </summary>
@@ -644,6 +663,10 @@ ID,Column,Variable Name,Data Type,Rank,Missing Value,Dimensions
             {
                 if (IsOpen && value != myFrameNo)
                 {
+                    // load the trees of the frames the user is scrubbing towards; without a memory budget all trees stay in memory
+                    var index = myKDTreeSource;
+                    if (index != null && Settings.Default.index_memory_budget_mb > 0)
+                        index.Prefetch(value, value > myFrameNo ? value + scrubPrefetchFrames : value - scrubPrefetchFrames);
                     myFrameNo = value;
                     NotifyPropertyChanged("CurrentFrameNumber");
                     myVideo.writeFrame(myFrameImageSource, value);
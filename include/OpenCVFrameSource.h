@@ -1,6 +1,7 @@
 #pragma once
 
-#include "ztImage.h"
+#include "ztFrameSource.h"
+#include <future>
 #include <string>
 
 namespace zt{
@@ -10,16 +11,59 @@ namespace zt{
 		short height;
 	};
 
-	class OpenCVFrameSource{
+	// A video file decoded with OpenCV. Decoded frames are kept up to cache_bytes, the least recently used
+	// dropped first. Frames are decoded into the buffers of released frames when there are any.
+	class OpenCVFrameSource : public FrameSource{
 	public:
-		OpenCVFrameSource(std::string);
+		static const int default_frame_buffers = 2;
+
+		struct cache_statistics{
+			long long hits;			// frames found decoded
+			long long misses;		// frames decoded or waited for
+			long long evictions;	// frames dropped to stay within the budget
+			size_t bytes;			// pixel memory of the cached frames
+			int frames;				// the number of cached frames
+		};
+
+		// With several decoders the video is opened that many times and frames are decoded in parallel,
+		// each decoder reading on through its own part of the video; see requestFrame.
+		// Opening counts the frames by decoding to the end, which takes seconds for large files. A fast open
+		// takes the count kept next to the video by an earlier opening, or else the count the container gives
+		// while the frames are counted in the background; numFrames may then change once.
+		OpenCVFrameSource(std::string, size_t cache_bytes = default_cache_bytes, int decoders = 1, bool fast_open = false);
 		~OpenCVFrameSource();
-		int frameWidth() const;
-		int frameHeight() const;
-		int numFrames() const;
-		double framesPerSecond() const;
-		std::string fourCC() const;
-		Image getFrame(int frameNo) const;
+		int frameWidth() const override;
+		int frameHeight() const override;
+		int numFrames() const override;
+		// False until the background count of a fast open is done.
+		bool frameCountVerified() const override;
+		// Waits for the background count of a fast open.
+		int verifiedNumFrames() const override;
+		// The handler is called from the counting thread.
+		void subscribeFrameCount(FrameCountHandler) override;
+		double framesPerSecond() const override;
+		std::string fourCC() const override;
+		// Frames requested in order are read on from the decoder; a seek, which decodes from the preceding
+		// key frame, is only made for a frame behind the last one or far ahead of it. The key frames of MP4,
+		// QuickTime and AVI files are read from the container on the first opening and kept next to the video
+		// in "<video>.keyframes"; with them a seek goes to the key frame and decodes a known number of frames.
+		Image getFrame(int frameNo) const override;
+		// A decoder pool decodes frames requested from several parts of the video at once, and each part
+		// is best requested in order.
+		std::future<Image> requestFrame(int frameNo) const override;
+		// The range goes to the decoder that reads on to its first frame, as a request for a single frame does,
+		// in requests of a few dozen frames, each decoded through by one decoder; frames requested meanwhile
+		// are decoded between them. Cached frames of the range are handed over as found.
+		void getFrames(int first, int last, const FrameHandler& handler) const override;
+		int numDecoders() const override;
+		bool randomAccess() const override { return false; }
+		decode_statistics statistics() const override;
+		void reserveFrameBuffers(int buffers) override;
+		// That of the video file, without decoding.
+		unsigned long long fingerprint() const override;
+		cache_statistics cacheStatistics() const;
+		// Changes the cache budget, dropping frames over it. The last frame decoded is always kept.
+		void setCacheBytes(size_t cache_bytes);
 	private:
 		class implementation; std::unique_ptr<implementation> impl;
 	};
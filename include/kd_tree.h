@@ -96,9 +96,25 @@ public:
 	/// Load from file <param name="filename"/>
 	void load(std::string const& filename);
 
-	/// Load from file <param name="file"/>
+	/// Load from file <param name="file"/>. Reads the original, the aligned and the compressed layout.
 	void load(FILE * file);
 
+	/// Save to file <param name="file"/> in the aligned layout: a fixed binary header followed by the arrays,
+	/// each on a cache line boundary and the index and point arrays on page boundaries, so that
+	/// <see>attach</see> can use a mapped file in place.
+	void save_aligned(FILE * file);
+
+	/// Save to file <param name="file"/> in the compressed layout: the index and point arrays are coded
+	/// losslessly in blocks that <see>load</see> decodes in parallel. The tree cannot be attached.
+	void save_compressed(FILE * file);
+
+	/// Use a tree saved by <see>save_aligned</see> in place, typically from a memory mapped file.
+	/// <param name="data">The first byte written by <see>save_aligned</see>.</param>
+	/// <param name="size">The number of bytes available from <paramref name="data"/>.</param>
+	/// Nothing is copied and the memory must outlive the tree. Returns false if the data are not
+	/// in the aligned layout or not suitably aligned; the tree is then empty.
+	bool attach(char const* data, size_t size);
+
 	/// Get our pointer to the points.  
 	/// Remember that they are owned by the caller, unless the tree was loaded from file.
 	value_type* get_points();
@@ -0,0 +1,212 @@
+#pragma once
+
+#include "ztImage.h"
+#include "ztPatch.h"
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+
+namespace zt{
+
+	// The frames of a video, of a folder of numbered images or of a raw frame file, by index from 0.
+	// Frames can be taken from several threads.
+	class FrameSource{
+	public:
+		// Decoder counters since the source was opened.
+		struct decode_statistics{
+			long long frames_decoded;	// frames returned by the decoder
+			long long frames_skipped;	// frames decoded and dropped to reach a later frame without a seek
+			long long seeks;
+			long long buffers_allocated;	// frames decoded into new memory rather than the buffer of a released frame
+			double decode_seconds;		// in the decoder, seeks included
+			double decode_fps() const { return decode_seconds > 0 ? frames_decoded / decode_seconds : 0; }
+		};
+
+		// Sources that keep decoded frames keep them up to this many bytes by default.
+		static const size_t default_cache_bytes = size_t(256) << 20;
+
+		// Opens a folder as an ImageSequenceFrameSource, a file written by RawFrameSource::write as a RawFrameSource
+		// and any other file as an OpenCVFrameSource. The number of decoders is that of an OpenCVFrameSource pool
+		// or, if greater than 1, the number of images of a folder decoded at once. Fails as the source does.
+		static std::unique_ptr<FrameSource> open(const std::string& path, int decoders = 1, bool fast_open = false);
+
+		FrameSource(){}
+		virtual ~FrameSource() {}
+		FrameSource(const FrameSource&) = delete;
+		FrameSource& operator = (const FrameSource&) = delete;
+
+		virtual int frameWidth() const = 0;
+		virtual int frameHeight() const = 0;
+		virtual int numFrames() const = 0;
+		virtual double framesPerSecond() const = 0;
+		virtual std::string fourCC() const { return std::string(); }
+
+		// Sources whose frame count is only estimated at first count the frames in the background.
+		virtual bool frameCountVerified() const { return true; }
+		// Waits for the frame count to be verified. Sources of trees, whose files depend on the count, take this.
+		virtual int verifiedNumFrames() const { return numFrames(); }
+		// Called with the frame count once it is verified, at once if it is. The handler replaces the current
+		// one and can be a nullptr. It may be called from another thread.
+		using FrameCountHandler = void(__stdcall *)(int);
+		virtual void subscribeFrameCount(FrameCountHandler handler) { if (handler != nullptr) handler(numFrames()); }
+
+		// Throws for a frame that cannot be read.
+		virtual Image getFrame(int frameNo) const = 0;
+		// Like getFrame without waiting, with the exception in the future. Frames are got at once unless
+		// the source decodes in the background.
+		virtual std::future<Image> requestFrame(int frameNo) const;
+		// Called with each frame of a range in order, from the thread that decodes it. A handler that waits
+		// holds up the decoding; one that returns false ends the range.
+		using FrameHandler = std::function<bool(int frameNo, Image frame)>;
+		// Gives the frames from first up to but not including last to the handler and returns once they are
+		// handed over. Sources that decode in order stream the range from one decoder in a single request;
+		// others request frames ahead, as many at once as they decode. Throws for a frame that cannot be read,
+		// after the frames before it are handed over, and passes on the exceptions of the handler.
+		virtual void getFrames(int first, int last, const FrameHandler& handler) const;
+		// The number of frames decoded at once.
+		virtual int numDecoders() const { return 1; }
+		// False if frames decode faster in order than at random, as those of compressed video do; frames
+		// requested at once are then best taken from separate parts of it, one decoder each.
+		virtual bool randomAccess() const { return true; }
+		virtual decode_statistics statistics() const { return decode_statistics{}; }
+		// Keeps at least this many buffers of released frames for new ones, so that a pipeline that holds
+		// that many frames at once decodes without allocating. Sources that do not decode into buffers of
+		// their own ignore it.
+		virtual void reserveFrameBuffers(int buffers) {}
+
+		// The frames of sources that crop or scale down the frames of another are a part of the video at
+		// another scale: the point (x, y) of a frame is the point (x * videoScale + videoOffset.x, y * videoScale
+		// + videoOffset.y) of the original video. Locations found in the frames are reported in the video.
+		virtual int videoScale() const { return 1; }
+		virtual Patch videoOffset() const { return Patch(0, 0); }
+		// The pixel of the video at the top left of a pixel of the frames, and the pixel of the frames that
+		// covers a pixel of the video.
+		Patch videoLocation(Patch frame_location) const;
+		Patch frameLocation(Patch video_location) const;
+
+		// Tells the video apart from others for the files made of its frames, as trees are: the same wherever
+		// the video is and whatever decodes it. Sources of a file take the fingerprint of the file; the default
+		// hashes the frame size and count and the first few frames, decoded in order.
+		virtual unsigned long long fingerprint() const;
+		// The size of a file, its first 64 KB and 4 KB at a few dozen places spread over the rest, hashed.
+		// Throws if the file cannot be read.
+		static unsigned long long fileFingerprint(const std::string& path);
+	};
+
+	// The images of a folder, in the order of their names with numbers compared by value, so that "frame2.png"
+	// comes before "frame10.png". PNG, JPEG, BMP and TIFF files are taken. All images must be of the size of
+	// the first one. Frames are decoded in parallel, as many at once as there are decoders, and the decoded
+	// frames are kept up to cache_bytes.
+	class ImageSequenceFrameSource : public FrameSource{
+	public:
+		// With 0 decoders there are as many as processors. A folder without images has no frames.
+		ImageSequenceFrameSource(std::string folder_path, double fps = 25, size_t cache_bytes = default_cache_bytes, int decoders = 0);
+		~ImageSequenceFrameSource();
+		int frameWidth() const override;
+		int frameHeight() const override;
+		int numFrames() const override;
+		double framesPerSecond() const override;
+		// The file of a frame.
+		std::string fileName(int frameNo) const;
+		Image getFrame(int frameNo) const override;
+		std::future<Image> requestFrame(int frameNo) const override;
+		int numDecoders() const override;
+		decode_statistics statistics() const override;
+	private:
+		class implementation; std::unique_ptr<implementation> impl;
+	};
+
+	// Frames stored undecoded in one file, a header of raw_header_bytes and then the pixel rows of every frame
+	// without padding, 8 bits a channel. The file is mapped into memory and the frames are images of the
+	// mapping, so that getting a frame neither copies nor decodes anything; a frame is read from the disc
+	// when its pixels are first used. The images keep the mapping open when they outlive the source.
+	// The whole file is mapped at once, which takes a 64 bit process for files of gigabytes.
+	class RawFrameSource : public FrameSource{
+	public:
+		static const int raw_header_bytes = 4096;
+
+		// Throws if the file cannot be mapped or is not a raw frame file.
+		explicit RawFrameSource(const std::string& fileName);
+		~RawFrameSource();
+		int frameWidth() const override;
+		int frameHeight() const override;
+		int numFrames() const override;
+		double framesPerSecond() const override;
+		int numChannels() const;
+		Image getFrame(int frameNo) const override;
+		unsigned long long fingerprint() const override;
+
+		// Whether the file starts with the header of a raw frame file.
+		static bool isRawFile(const std::string& fileName);
+		// Writes the frames of a source into a raw frame file, replacing it. Throws if a frame cannot be
+		// read or written; the file is left incomplete then.
+		static void write(const FrameSource& source, const std::string& fileName);
+	private:
+		class implementation; std::unique_ptr<implementation> impl;
+	};
+
+	// The frames of another source cropped to a region and scaled down by an integer factor, each pixel the
+	// mean of factor x factor pixels. Trees, projections and patches of the reduced frames take that many times
+	// fewer pixels; the frames of the other source are still decoded and cached in full.
+	class ReducedFrameSource : public FrameSource{
+	public:
+		// A width or height of 0 reaches to the edge of the frame. The region is clipped to the frame and to
+		// whole blocks of factor x factor pixels. Throws if nothing is left of it.
+		ReducedFrameSource(std::unique_ptr<FrameSource> source, int x, int y, int width, int height, int factor);
+		~ReducedFrameSource();
+		int frameWidth() const override;
+		int frameHeight() const override;
+		int numFrames() const override;
+		double framesPerSecond() const override;
+		std::string fourCC() const override;
+		bool frameCountVerified() const override;
+		int verifiedNumFrames() const override;
+		void subscribeFrameCount(FrameCountHandler) override;
+		Image getFrame(int frameNo) const override;
+		// The frame is reduced by the thread that gets it from the future.
+		std::future<Image> requestFrame(int frameNo) const override;
+		// The frames are reduced by the thread that decodes them.
+		void getFrames(int first, int last, const FrameHandler& handler) const override;
+		int numDecoders() const override;
+		bool randomAccess() const override;
+		decode_statistics statistics() const override;
+		void reserveFrameBuffers(int buffers) override;
+		int videoScale() const override;
+		Patch videoOffset() const override;
+		// That of the other source with the region and the factor.
+		unsigned long long fingerprint() const override;
+	private:
+		class implementation; std::unique_ptr<implementation> impl;
+	};
+
+	// Frames of a source for a viewer that steps or scrubs through them. The frames asked for are taken as the
+	// position of the viewer, and the frames it steps to next are decoded in the background and kept, so that
+	// a step in the direction and by the number of frames of the step before finds its frame decoded. A move
+	// of more than max_step frames is a jump, after which the frames are read ahead one at a time in the same
+	// direction. Every move ends the reading ahead for the position before once the frame being decoded is
+	// done, so that the frame of a jump waits for one frame at most.
+	class FrameReadAhead{
+	public:
+		static const int default_frames_ahead = 8;
+		static const int max_step = 50;
+
+		struct statistics{
+			long long hits;			// frames asked for that were decoded already
+			long long misses;
+			long long frames_read;	// frames decoded ahead
+		};
+
+		// The source must outlive the read-ahead.
+		explicit FrameReadAhead(FrameSource& source, int frames_ahead = default_frames_ahead);
+		~FrameReadAhead();
+		FrameReadAhead(const FrameReadAhead&) = delete;
+		FrameReadAhead& operator = (const FrameReadAhead&) = delete;
+
+		// The frame of the source. Asking for the frame of the position again, as for a patch of it, moves nothing.
+		Image getFrame(int frameNo);
+		statistics readAheadStatistics() const;
+	private:
+		class implementation; std::unique_ptr<implementation> impl;
+	};
+}
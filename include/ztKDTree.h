@@ -4,7 +4,7 @@
 #include <ztImage.h>
 #include <ztPatch.h>
 #include <ztProjector.h>
-#include <OpenCVFrameSource.h>
+#include <ztFrameSource.h>
 
 #include <kd_tree.h>
 #include <memory>
@@ -18,24 +18,42 @@ namespace zt{
 	// Patch offset (x,y) and  dissimilarity with the pattern
 	using Match = std::tuple<int, int, double, std::vector<float>>;
 
+	// The way a search tree stores descriptors.
+	enum class IndexType {
+		Float,		// Descriptors are stored as floats.
+		Quantised,	// Descriptors are quantised to bytes using the projector eigenvalues. Takes about 4 times less memory.
+		ProductQuantised,	// Inverted lists of product-quantised residuals, about 8 bytes per grid point. Distances are approximate, see KDTree::rerank.
+		Forest,		// Float descriptors searched by several randomised trees. Better recall at low approximation ratios.
+		BruteForce	// Float descriptors scanned exhaustively with SIMD. Exact, faster than a tree on small frames, and scans only the neighbourhood for location constrained queries.
+	};
+
+	class index_engine;
+	class mapped_file;
+
 	// Holds a search tree for a video frame. 
 	class KDTree : public Saveable
 	{
 	private:
-		std::unique_ptr<kd_tree_float> kd_ptr;
-		std::unique_ptr<std::vector<float>> features; // when built from data kd will point to data in the vector.
+		std::unique_ptr<index_engine> engine; // The search structure, see IndexType.
 		int h_steps = 0;	// The number of steps in horizontal direction.
 		int step;		// The number of pixels to step horizontally and vertically.
 
+		Match to_match(int index, double distance, std::vector<float>& descriptor) const;
+		void loadHeader(FILE *);
+		void loadMapped(FILE *, std::shared_ptr<const mapped_file>);
 
 	public:
 		KDTree(
 			Image frame,				// A video frame.
 			const Projector& projector,	// Projector for the video.
-			int pixel_step				// The number of pixels to step horizontally and vertically. Translates into the precision of nearest match coordinates.
+			int pixel_step,				// The number of pixels to step horizontally and vertically. Translates into the precision of nearest match coordinates.
+			IndexType index_type = IndexType::Float	// Descriptor storage.
 			);
-		KDTree(std::string fileName);
-		~KDTree(){}
+		KDTree(std::string fileName);	// Loads a saved tree. Float kd-trees are used in place from the memory mapped file.
+		// Loads a tree written by saveToFile at the current position of the source, such as a tree in a pack of trees.
+		// If the mapping of the same file is not null, float kd-trees are used in place from it.
+		KDTree(FILE* source, std::shared_ptr<const mapped_file> mapping);
+		~KDTree();
 
 		std::vector<Match> getMatches(
 			const std::vector<float>& descriptor,	// The pattern to match
@@ -43,8 +61,44 @@ namespace zt{
 			double approx_ratio = 0.3				// An approximation Ratio of 1.0 finds the exact nearst neighbours. Lower values are less accurate but faster.
 			) const;
 
+		// Matches no farther than radius pixels from a predicted patch offset, such as the location in a nearby key frame.
+		// IndexType::BruteForce scans only that part of the frame. Other index types filter a wider search
+		// of the whole frame and may return fewer matches.
+		std::vector<Match> getMatches(
+			const std::vector<float>& descriptor,	// The pattern to match
+			int num_matches,						// The number of nearest matches to find
+			double approx_ratio,					// See above.
+			Patch center,							// The predicted patch offset.
+			double radius							// The search radius in pixels.
+			) const;
+
+		// Matches for several descriptors at once. Engines that scan all the points (IndexType::BruteForce) do it in one pass.
+		std::vector<std::vector<Match>> getMatches(
+			const std::vector<std::vector<float>>& descriptors,	// The patterns to match
+			int num_matches,						// The number of nearest matches to find for each pattern
+			double approx_ratio = 0.3				// See above.
+			) const;
+
+		IndexType indexType() const;
+
+		// Approximate bytes held by the tree, for budgeting tree caches.
+		size_t memorySize() const;
+
+		// Recomputes match descriptors and distances by projecting the patches from the frame and sorts the matches.
+		// Use with approximate indexes: ask getMatches for a few times more matches than needed and keep the best after reranking.
+		static void rerank(
+			std::vector<Match>& matches,			// Candidate matches to reorder.
+			const std::vector<float>& descriptor,	// The pattern to match.
+			Image frame,							// The video frame the matches were found in.
+			const Projector& projector,				// Projector for the video.
+			int num_matches							// The number of matches to keep.
+			);
+
 		std::string name() const { return "KDTree"; }
 		void saveTo(FILE *) const;
+		// Like saveTo, but kd-trees are compressed without loss; kdbench reports the ratio for a video.
+		// Loading decodes them in parallel and float trees are no longer used in place.
+		void saveCompressedTo(FILE *) const;
 		void loadFrom(FILE *);
 		static std::string extension() { return ".kdt"; }
 	};
@@ -52,6 +106,7 @@ namespace zt{
 	// An abstraction to somehow retrieve a tree related to a particular video frame.
 	// The trees may become available upon the object construction or produced later in a background job.
 	// You cannot copy a KDTreeSource. Use references or shared pointers instead.
+	// The sources that make trees of a video wait for its frame count if it is not verified yet, see FrameSource.
 	class KDTreeSource{
 	protected:
 		KDTreeSource(){}
@@ -60,7 +115,8 @@ namespace zt{
 		KDTreeSource(const KDTreeSource&) = delete;
 		KDTreeSource& operator = (const KDTreeSource&) = delete;
 
-		// Synchronously get the tree. May block the thread until the tree is ready.
+		// Synchronously get the tree. May block the thread until the tree is ready. A source that finds a ready
+		// tree damaged may return nullptr for it while it builds the tree again.
 		virtual std::shared_ptr<KDTree> operator [] (FrameIndex) const = 0;
 
 		// Asynchronously check if the tree is ready.
@@ -71,6 +127,10 @@ namespace zt{
 		virtual void subscribe(ProgressHandler) = 0;
 
 		virtual int num_frames() const = 0;
+
+		// Hint that the trees of frames first to last will be asked for soon, in that order; last may be less than first.
+		// A new hint replaces the previous one. Sources that keep all the trees in memory ignore it.
+		virtual void prefetch(FrameIndex first, FrameIndex last) const {}
 	};
 
 	// an implementation that generates trees in background threads, saves/loads them to files and keeps the trees in memory.
@@ -78,7 +138,13 @@ namespace zt{
 		public zt::KDTreeSource
 	{
 	public:
-		FileKDTreeSource(OpenCVFrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, std::string folder_path);
+		// Built trees are saved by a background writer; workers wait for it only when max_pending_writes trees are queued.
+		// With compress_files the trees are saved compressed, see KDTree::saveCompressedTo: smaller files for long
+		// videos, but float kd-trees are decoded into memory instead of being used from the mapped files.
+		// A video opened with several decoders has its parts built at once; progress, the number of leading
+		// frames ready, then follows the first part. The folder is for the trees of this video only: trees of
+		// another key found there are removed.
+		FileKDTreeSource(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, std::string folder_path, IndexType index_type = IndexType::Float, int max_pending_writes = 16, bool compress_files = false);
 		~FileKDTreeSource() override;
 
 		// Synchronously get the tree. May block the thread until the tree is ready.
@@ -91,6 +157,21 @@ namespace zt{
 		void subscribe(ProgressHandler) override;
 
 		int num_frames() const override;
+
+		// Progress of saving the built trees, complements the progress notifications.
+		struct WriteProgress{
+			int written;				// Trees saved so far.
+			int pending;				// Trees built and waiting to be saved.
+			double write_seconds;		// Time spent saving.
+			double overlapped_seconds;	// Part of write_seconds during which workers were building trees.
+		};
+		WriteProgress write_progress() const;
+
+		// Trees are kept in one pack of files per video, projector, pixel step and index type, see tree_pack.h;
+		// trees that do not match them are rebuilt. Moves trees saved one file per frame by earlier versions
+		// into the pack of the video and the projector, which is only right if the files were made with them,
+		// and returns the number of trees moved.
+		static int pack(FrameSource& video, const Projector& projector, std::string folder_path, int pixel_step, IndexType index_type, bool remove_files);
 	private:
 		class implementation;
 		std::unique_ptr<implementation> impl;
@@ -101,7 +182,7 @@ namespace zt{
 		public zt::KDTreeSource
 	{
 	public:
-		SimpleKDTreeSource(OpenCVFrameSource& video, const Projector& projector, int pixel_step, int number_of_workers);
+		SimpleKDTreeSource(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, IndexType index_type = IndexType::Float);
 		~SimpleKDTreeSource() override;
 
 		// Synchronously get the tree. May block the thread until the tree is ready.
@@ -119,6 +200,44 @@ namespace zt{
 		std::unique_ptr<implementation> impl;
 	};
 
+	// an implementation that generates trees in background threads and saves them like FileKDTreeSource,
+	// but keeps at most memory_budget bytes of trees in memory. The least recently used trees are dropped
+	// and loaded again from the files when asked for. Trees in use by callers stay alive regardless.
+	class CachedKDTreeSource :
+		public zt::KDTreeSource
+	{
+	public:
+		CachedKDTreeSource(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, std::string folder_path, size_t memory_budget, IndexType index_type = IndexType::Float);
+		~CachedKDTreeSource() override;
+
+		// Synchronously get the tree. Loads the tree if it was dropped and may block the thread until the tree is built.
+		// A tree that fails to load is handed to the workers to build again; nullptr is returned for it and it is
+		// not ready until then. The tree of a frame that fails to build is never ready.
+		std::shared_ptr<KDTree> operator [] (FrameIndex) const override;
 
+		// Loads dropped trees in a background agent, staying up to half the budget ahead of the trees asked for.
+		void prefetch(FrameIndex first, FrameIndex last) const override;
+
+		// Asynchronously check if the tree is built, that is it can be obtained without building.
+		bool is_ready(FrameIndex) const override;
+
+		// Subscribe progress notifications. the handler replaces current subscription and can be a nullptr to cancel notifications.
+		void subscribe(ProgressHandler) override;
+
+		int num_frames() const override;
+
+		struct CacheStats{
+			long long hits;			// Trees found in memory.
+			long long misses;		// Trees loaded or waited for.
+			long long evictions;	// Trees dropped to stay within the budget.
+			long long prefetches;	// Trees loaded ahead by prefetch.
+			size_t bytes;			// Memory held by the cached trees.
+			int trees;				// The number of cached trees.
+		};
+		CacheStats cache_stats() const;
+	private:
+		class implementation;
+		std::unique_ptr<implementation> impl;
+	};
 
 }
\ No newline at end of file
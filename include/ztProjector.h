@@ -61,7 +61,7 @@ namespace zt
 		// Returns the size of each pixel in chars.
 		int pixelSize() const { return static_cast<int>(pixel_size); }
 
-		float get_eigenvalue(int i){ return eigenvalues[i]/data_count; }
+		float get_eigenvalue(int i) const { return eigenvalues[i]/data_count; }
 		std::vector<float> get_proj_mat(){ return proj; }
 
 		// static std::string extension; // cause windows "__dllonexit" initialization bug
@@ -70,6 +70,9 @@ namespace zt
 		// Use data_count to tell whether the projector needs recalculating.
 		bool ready(){ return data_count != 0; }
 
+		// A hash of everything that affects projections, to tell whether saved descriptors came from this projector.
+		unsigned long long fingerprint() const;
+
 		// saveable implementation
 		void saveTo(FILE *) const;
 		void loadFrom(FILE *);
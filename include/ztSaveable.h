@@ -1,7 +1,9 @@
 #pragma once
 
 #include <cstdio>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <map>
 
@@ -25,32 +27,69 @@ namespace zt {
 	void file_write(std::string const & s, FILE * f);
 	void file_read(std::string & s, FILE * f);
 
-	template <class T> void file_read(T & d, FILE * f){ d.saveTo(f); }
-	template <class T> void file_write(T const & d, FILE * f){ d.loadFrom(f); }
+	template <class T> void file_read(T & d, FILE * f){ d.loadFrom(f); }
+	template <class T> void file_write(T const & d, FILE * f){ d.saveTo(f); }
 	template <class T> std::string get_name_of(T const & d){ return d.name(); }
 
 	//template <class T> void file_read(std::shared_ptr<T> & d, FILE * f);
 	//template <class T> void file_write(std::shared_ptr<T> const & d, FILE * f);
 
+	// Containers of containers find each other.
+	template <class T> void file_read(std::vector<T> & v, FILE * f);
+	template <class T> void file_write(std::vector<T> const & v, FILE * f);
+	template <class U, class V> void file_read(std::map<U, V> & m, FILE * f);
+	template <class U, class V> void file_write(std::map<U, V> const & m, FILE * f);
+
+	// Raw bytes of count elements, throws at the end of the file.
+	void file_read_bytes(void * data, size_t element_size, size_t count, FILE * f);
+	void file_write_bytes(void const * data, size_t element_size, size_t count, FILE * f);
+
+	// Vectors of plain values are read and written in one call, others element by element.
+	// Both ways give the same bytes: the element count and then the elements.
+	template <class T> struct is_bulk_serialisable : std::integral_constant<bool,
+		std::is_trivially_copyable<T>::value && !std::is_same<T, bool>::value> {};
+
+	template <class T> void file_read_elements(std::vector<T> & v, FILE * f, std::true_type){
+		if (!v.empty()) file_read_bytes(v.data(), sizeof(T), v.size(), f);
+	}
+	template <class T> void file_read_elements(std::vector<T> & v, FILE * f, std::false_type){
+		for (size_t i = 0; i < v.size(); ++i)
+		{
+			file_read(v[i], f);
+		}
+	}
+	inline void file_read_elements(std::vector<bool> & v, FILE * f, std::false_type){
+		for (size_t i = 0; i < v.size(); ++i)
+		{
+			bool element;
+			file_read(element, f);
+			v[i] = element;
+		}
+	}
+	template <class T> void file_write_elements(std::vector<T> const & v, FILE * f, std::true_type){
+		if (!v.empty()) file_write_bytes(v.data(), sizeof(T), v.size(), f);
+	}
+	template <class T> void file_write_elements(std::vector<T> const & v, FILE * f, std::false_type){
+		for (auto i = v.begin(); i != v.end(); ++i)
+		{
+			file_write(static_cast<T const &>(*i), f);
+		}
+	}
+
 	template <class T> void file_read(std::vector<T> & v, FILE * f){
 		int count = 0;
 		file_read(count, f);
+		if (count < 0) throw std::runtime_error("Negative element count in file.");
 		v.resize(count);
-		for (int i = 0; i < count; ++i)
-		{
-			file_read(v[i], f);
-		}
+		file_read_elements(v, f, is_bulk_serialisable<T>());
 	}
 
 	template <class T> void file_write(std::vector<T> const & v, FILE * f){
 		file_write(static_cast<int>(v.size()), f);
-		for (std::vector<T>::const_iterator i = v.begin(); i != v.end(); ++i)
-		{
-			file_write(*i, f);
-		}
+		file_write_elements(v, f, is_bulk_serialisable<T>());
 	}
 
-	template <class U, class V> void file_read(std::map<U, V> & m, FILE * target){
+	template <class U, class V> void file_read(std::map<U, V> & m, FILE * f){
 		m.clear();
 		int count = 0;
 		file_read(count, f);
@@ -62,9 +101,9 @@ namespace zt {
 		}
 	}
 
-	template <class U, class V> void file_write(std::map<U, V> const & m, FILE * target){
+	template <class U, class V> void file_write(std::map<U, V> const & m, FILE * f){
 		file_write(static_cast<int>(m.size()), f);
-		std::map<U, V>::const_iterator it = m.begin();
+		auto it = m.begin();
 		for (; it != m.end(); ++it)
 		{
 			file_write(it->first, f);
@@ -75,8 +114,15 @@ namespace zt {
 	void saveName(std::string const & name, FILE * target);
 	void checkName(std::string const & name, FILE * source);
 
+	// Files written by Saveable::saveToFile start with the line "zt_saveable <version>", files of earlier versions
+	// with the name. Reads the header if there is one and returns the version, 0 if there is none.
+	// Throws for versions newer than file_format_version.
+	const int file_format_version = 1;
+	void saveFileHeader(FILE * target);
+	int readFileHeader(FILE * source);
+
 	template <class T> std::string get_name_of(std::vector<T> const & v){
-		return v.size() == 0 ? "" : get_name_of(c[0]) + "Vector";
+		return v.size() == 0 ? "" : get_name_of(v[0]) + "Vector";
 	}
 
 	template <class U, class V> std::string get_name_of(std::map<U, V> const &){
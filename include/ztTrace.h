@@ -68,8 +68,13 @@ namespace zt{
 
 		// Number of frames
 		int max_occlusion_duration() const{ return _max_occlusion_duration; }
-		TraceParameters(int num_matches, double match_ratio, int max_matches_per_frame, double appearance_threshold, double λ_d, double λ_u, double λ_o, int max_occlusion_duration)
-			:_num_matches(num_matches), _match_ratio(match_ratio), _max_matches_per_frame(max_matches_per_frame), _appearance_threshold(appearance_threshold), _lambda_d(λ_d), _lambda_u(λ_u), _lambda_o(λ_o), _max_occlusion_duration(max_occlusion_duration){}
+
+		// The largest expected motion in pixels per frame. Matches are searched within this distance
+		// per frame from the key frame location. Zero searches whole frames.
+		double max_speed() const{ return _max_speed; }
+
+		TraceParameters(int num_matches, double match_ratio, int max_matches_per_frame, double appearance_threshold, double λ_d, double λ_u, double λ_o, int max_occlusion_duration, double max_speed = 0.0)
+			:_num_matches(num_matches), _match_ratio(match_ratio), _max_matches_per_frame(max_matches_per_frame), _appearance_threshold(appearance_threshold), _lambda_d(λ_d), _lambda_u(λ_u), _lambda_o(λ_o), _max_occlusion_duration(max_occlusion_duration), _max_speed(max_speed){}
 	private:
 		int _num_matches;
 		double _match_ratio;
@@ -79,6 +84,7 @@ namespace zt{
 		double _lambda_u;
 		double _lambda_o;
 		int _max_occlusion_duration;
+		double _max_speed;
 	};
 
 }
\ No newline at end of file
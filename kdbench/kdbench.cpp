@@ -0,0 +1,198 @@
+//	Stand alone search tree benchmark.
+//	Inputs via command line:
+//		video file name.
+//	    projector file.
+//		[number of frames] - default: 5, equally spaced over the video
+//		[number of queries] - per frame, default: 200
+//		[pixel skip] - default: 3
+//
+//	Outputs.
+//		Recall of the 10 nearest matches and the average query time for a single kd-tree
+//		and for a kd-forest at several approximation ratios, and the time of an exhaustive scan.
+//		The size of the saved float and quantised kd-trees, plain and compressed, and their load times.
+//
+//	Description.
+//		For each selected frame build the indexes, take random patches from the next frame
+//		as queries and compare the matches found with the exact nearest neighbours found by
+//		the brute force index. The trees are saved to temporary files and loaded back as
+//		from a pack of trees.
+
+#include <ztFrameSource.h>
+#include <ztProjector.h>
+#include <ztKDTree.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <utility>
+
+using namespace zt;
+using namespace std;
+
+static const int num_matches = 10;
+static const double ratios[] = { 0.05, 0.1, 0.2, 0.3, 0.5, 1.0 };
+static const int num_ratios = sizeof(ratios) / sizeof(ratios[0]);
+
+static int usage()
+{
+	cerr << "Usage kdbench VideoFile|ImageFolder|RawFile ProjectorFile [frames=5] [queries=200] [pixel skip=3]" << std::endl;
+	return 1;
+}
+
+// The size and load time of the trees saved by one of the save functions of KDTree.
+struct storage{
+	double bytes = 0;
+	double load_seconds = 0;
+};
+
+static void measure(const KDTree& tree, void (KDTree::*save)(FILE*) const, storage& result)
+{
+	FILE* f = nullptr;
+	if (tmpfile_s(&f) != 0)
+		throw std::runtime_error("Failed to open a temporary file.");
+	saveName(tree.name(), f);
+	(tree.*save)(f);
+	fflush(f);
+	result.bytes += ftell(f);
+	rewind(f);
+	clock_t start = clock();
+	KDTree loaded(f, nullptr);
+	result.load_seconds += double(clock() - start) / CLOCKS_PER_SEC;
+	fclose(f);
+}
+
+static set<pair<int, int>> positions(const vector<Match>& matches)
+{
+	set<pair<int, int>> result;
+	for (auto& m : matches)
+		result.insert(make_pair(get<0>(m), get<1>(m)));
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3 || argc > 6)
+		return usage();
+	string videoFile = argv[1];
+	string projectorFile = argv[2];
+	int frames = argc > 3 ? atoi(argv[3]) : 5;
+	int queries = argc > 4 ? atoi(argv[4]) : 200;
+	int pixel_skip = argc > 5 ? atoi(argv[5]) : 3;
+	if (frames < 1 || queries < 1 || pixel_skip < 1)
+		return usage();
+
+	auto source = FrameSource::open(videoFile);
+	FrameSource& vh = *source;
+	if (vh.numFrames() < 2)
+	{
+		cerr << "Failed to open video file:" << videoFile << std::endl;
+		return 1;
+	}
+
+	try{
+		Projector proj(projectorFile);
+		const IndexType types[] = { IndexType::Float, IndexType::Forest };
+		const char* names[] = { "kd-tree", "kd-forest" };
+		double hits[2][num_ratios] = {};
+		double seconds[2][num_ratios] = {};
+		double build_seconds[2] = {};
+		double exact_seconds = 0, exact_batch_seconds = 0, exact_build_seconds = 0;
+		int total_queries = 0;
+		const IndexType saved_types[] = { IndexType::Float, IndexType::Quantised };
+		const char* saved_names[] = { "kd-tree", "quantised" };
+		storage plain[2], compressed[2];
+		srand(1);
+
+		for (int fi = 0; fi < frames; fi++)
+		{
+			int frameNo = static_cast<int>((vh.numFrames() - 1) * (long long)fi / frames);
+			Image frame = vh.getFrame(frameNo);
+			Image next = vh.getFrame(frameNo + 1);
+			cout << "frame " << frameNo << endl;
+
+			// queries and their exact answers
+			clock_t start = clock();
+			KDTree exact(frame, proj, pixel_skip, IndexType::BruteForce);
+			exact_build_seconds += double(clock() - start) / CLOCKS_PER_SEC;
+			vector<vector<float>> descriptors(queries);
+			for (int q = 0; q < queries; q++){
+				int x = rand() % (next->width() - proj.patchWidth() + 1);
+				int y = rand() % (next->height() - proj.patchHeight() + 1);
+				descriptors[q] = proj.project(next->subImage(x, y, proj.patchWidth(), proj.patchHeight()));
+			}
+			start = clock();
+			vector<set<pair<int, int>>> truth(queries);
+			for (int q = 0; q < queries; q++)
+				truth[q] = positions(exact.getMatches(descriptors[q], num_matches, 1.0));
+			exact_seconds += double(clock() - start) / CLOCKS_PER_SEC;
+			start = clock();
+			exact.getMatches(descriptors, num_matches, 1.0);
+			exact_batch_seconds += double(clock() - start) / CLOCKS_PER_SEC;
+			total_queries += queries;
+
+			for (int t = 0; t < 2; t++){
+				start = clock();
+				KDTree tree(frame, proj, pixel_skip, types[t]);
+				build_seconds[t] += double(clock() - start) / CLOCKS_PER_SEC;
+				for (int r = 0; r < num_ratios; r++){
+					start = clock();
+					vector<vector<Match>> found(queries);
+					for (int q = 0; q < queries; q++)
+						found[q] = tree.getMatches(descriptors[q], num_matches, ratios[r]);
+					seconds[t][r] += double(clock() - start) / CLOCKS_PER_SEC;
+					for (int q = 0; q < queries; q++)
+					for (auto& m : found[q])
+						if (truth[q].count(make_pair(get<0>(m), get<1>(m))) > 0) hits[t][r]++;
+				}
+			}
+
+			for (int t = 0; t < 2; t++){
+				KDTree tree(frame, proj, pixel_skip, saved_types[t]);
+				measure(tree, &KDTree::saveTo, plain[t]);
+				measure(tree, &KDTree::saveCompressedTo, compressed[t]);
+			}
+		}
+
+		printf("\n%-10s %8s %12s %12s\n", "index", "ratio", "recall@10", "us/query");
+		for (int t = 0; t < 2; t++){
+			for (int r = 0; r < num_ratios; r++)
+				printf("%-10s %8.2f %12.3f %12.1f\n", names[t], ratios[r],
+					hits[t][r] / (double(total_queries) * num_matches), 1e6 * seconds[t][r] / total_queries);
+			printf("%-10s build %.2f s per frame\n", names[t], build_seconds[t] / frames);
+		}
+		printf("%-10s %8s %12.3f %12.1f\n", "brute", "-", 1.0, 1e6 * exact_seconds / total_queries);
+		printf("%-10s %8s %12.3f %12.1f\n", "brute", "batch", 1.0, 1e6 * exact_batch_seconds / total_queries);
+		printf("%-10s build %.2f s per frame\n", "brute", exact_build_seconds / frames);
+
+		const double mb = 1 << 20;
+		printf("\n%-10s %10s %10s %8s %12s %12s\n", "saved", "MB/frame", "z MB/frame", "ratio", "load MB/s", "z load MB/s");
+		for (int t = 0; t < 2; t++)
+			printf("%-10s %10.2f %10.2f %8.2f %12.0f %12.0f\n", saved_names[t],
+				plain[t].bytes / mb / frames, compressed[t].bytes / mb / frames, plain[t].bytes / compressed[t].bytes,
+				plain[t].bytes / mb / max(plain[t].load_seconds, 1e-6), plain[t].bytes / mb / max(compressed[t].load_seconds, 1e-6));
+
+		// frames decoded in order and released at once, as the tree sources take them; without the pool
+		// every frame would be allocated
+		int run = min(vh.numFrames(), 300);
+		auto before = vh.statistics();
+		for (int i = 0; i < run; i++) vh.getFrame(i);
+		auto after = vh.statistics();
+		long long decoded = after.frames_decoded - before.frames_decoded;
+		double decode_seconds = after.decode_seconds - before.decode_seconds;
+		printf("\ndecoding %lld frames in order: %.0f fps, %lld frame buffers allocated\n", decoded,
+			decode_seconds > 0 ? decoded / decode_seconds : 0.0, after.buffers_allocated - before.buffers_allocated);
+	}
+	catch (const std::exception & e) {
+		cerr << "std::exception:" << e.what() << endl;
+		return 1;
+	}
+	catch (...) {
+		cerr << "other exception:" << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+//	Converts search trees saved one file per frame into a tree pack.
+//	Inputs via command line:
+//		video file name.
+//		projector file - the projector the trees were built with.
+//		kd-tree folder - where the trees of the video are stored.
+//		[pixel skip] - default: 3
+//		[index type] - float, quantised, pq, forest or bruteforce, default: float
+//		[-remove] - delete the per-frame files once they are in the pack.
+//
+//	Outputs.
+//		<pixel skip>-<key>.kdp and <pixel skip>-<key>.kdx in the folder (with a type letter after the pixel skip
+//		for types other than float), the files FileKDTreeSource reads for the video and the projector.
+//
+//	Description.
+//		Packs are keyed by the video and the projector, so FileKDTreeSource does not use per-frame files
+//		whose origin it cannot tell. Use this tool to keep trees built by earlier versions.
+
+#include <ztFrameSource.h>
+#include <ztProjector.h>
+#include <ztKDTree.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace zt;
+using namespace std;
+
+static int usage()
+{
+	cerr << "Usage kdpack VideoFile|ImageFolder|RawFile ProjectorFile KDTreeFolder [pixel skip=3] [float|quantised|pq|forest|bruteforce] [-remove]" << std::endl;
+	return 1;
+}
+
+static bool parse_index_type(const char* name, IndexType& type)
+{
+	const char* names[] = { "float", "quantised", "pq", "forest", "bruteforce" };
+	const IndexType types[] = { IndexType::Float, IndexType::Quantised, IndexType::ProductQuantised, IndexType::Forest, IndexType::BruteForce };
+	for (int i = 0; i < 5; i++)
+		if (strcmp(name, names[i]) == 0) return type = types[i], true;
+	return false;
+}
+
+int main(int argc, char** argv)
+{
+	bool remove_files = argc > 4 && strcmp(argv[argc - 1], "-remove") == 0;
+	if (remove_files) argc--;
+	if (argc < 4 || argc > 6)
+		return usage();
+	string folder = argv[3];
+	int pixel_skip = argc > 4 ? atoi(argv[4]) : 3;
+	IndexType type = IndexType::Float;
+	if (pixel_skip < 1 || (argc > 5 && !parse_index_type(argv[5], type)))
+		return usage();
+
+	auto source = FrameSource::open(argv[1]);
+	FrameSource& vh = *source;
+	if (vh.numFrames() <= 0)
+	{
+		cerr << "Failed to open video file:" << argv[1] << std::endl;
+		return 1;
+	}
+
+	try{
+		Projector proj(argv[2]);
+		int count = FileKDTreeSource::pack(vh, proj, folder, pixel_skip, type, remove_files);
+		cout << "packed " << count << " trees" << endl;
+	}
+	catch (const std::exception & e) {
+		cerr << "std::exception:" << e.what() << endl;
+		return 1;
+	}
+	catch (...) {
+		cerr << "other exception:" << endl;
+		return 1;
+	}
+	return 0;
+}
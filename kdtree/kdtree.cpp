@@ -26,7 +26,7 @@
 //#include <stdlib.h>
 //#include <crtdbg.h>
 
-#include <OpenCVFrameSource.h>
+#include <ztFrameSource.h>
 #include <ztProjector.h>
 #include <ztKDTree.h>
 
@@ -51,7 +51,7 @@ static int pixel_skip = 3;
 
 static int usage()
 {
-	cerr << "Usage GenerateKDTrees VideoFile [projectorFile] [start frame] [end frame] [pixel skip=3] [saveDirectory] " << std::endl;
+	cerr << "Usage GenerateKDTrees VideoFile|ImageFolder|RawFile [projectorFile] [start frame] [end frame] [pixel skip=3] [saveDirectory] " << std::endl;
 	return 1;
 }
 
@@ -120,7 +120,8 @@ int main(int argc, char** argv)
 	if (!parse_command_line(argc, argv))
 		return usage();
 
-	OpenCVFrameSource vh(videoFile);
+	auto source = FrameSource::open(videoFile);
+	FrameSource& vh = *source;
 	if (vh.numFrames()>0)
 	{
 		startFrame = (startFrame <= 0 || startFrame > vh.numFrames()) ? 1 : startFrame;
@@ -32,7 +32,7 @@
 
 #include <opencv/cv.h>
 
-#include <OpenCVFrameSource.h>
+#include <ztFrameSource.h>
 #include <ztProjector.h>
 #include <ztImage.h>
 
@@ -53,7 +53,7 @@ static string saveFile = "";
 
 static int  usage()
 {
-	cout << "Usage GenereateProjector VideoFile [outputDimensions=16] [patch size=21] [num samples=10000] [start frame=1] [end frame=last frame] [saveFile] " << std::endl;
+	cout << "Usage GenereateProjector VideoFile|ImageFolder|RawFile [outputDimensions=16] [patch size=21] [num samples=10000] [start frame=1] [end frame=last frame] [saveFile] " << std::endl;
 	return 1;
 }
 
@@ -123,7 +123,8 @@ int main(int argc, char** argv)
 	if (!parse_command_line(argc, argv))
 		return usage();
 
-	OpenCVFrameSource vh(videoFile);
+	auto source = FrameSource::open(videoFile);
+	FrameSource& vh = *source;
 	if (vh.numFrames()>0)
 	{
 		startFrame = (startFrame <= 0 || startFrame > vh.numFrames()) ? 1 : startFrame;
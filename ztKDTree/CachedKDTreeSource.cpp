@@ -0,0 +1,433 @@
+#include <ztKDTree.h>
+#include "tree_pack.h"
+#include <ztLog.h>
+#include <bounded_queue.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sstream>
+#include <future>
+#include <chrono>
+#include <agents.h>
+
+using std::tuple;
+using std::get;
+using std::vector;
+using std::shared_ptr;
+using std::make_shared;
+using std::ostringstream;
+using std::shared_future;
+using std::promise;
+using std::chrono::duration;
+using concurrency::agent;
+using std::string;
+
+// an implementation that generates trees in background threads, saves them to a tree pack and keeps the recently used ones in memory.
+namespace zt{
+	class CachedKDTreeSource::implementation : public agent
+	{
+	public:
+		using FrameMsg = tuple<Image, FrameIndex>;
+		using WriteMsg = tuple<shared_ptr<KDTree>, FrameIndex>;
+		implementation(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, string folder_path, size_t memory_budget, IndexType index_type);
+		~implementation();
+		shared_ptr<KDTree> get_tree(FrameIndex idx);
+		void prefetch(FrameIndex first, FrameIndex last);
+		bool is_ready(FrameIndex idx) const;
+		void subscribe(KDTreeSource::ProgressHandler handler){ if (!_stopping){ _subscription = handler; handler(_complete_count); } }
+		int num_frames() const { return static_cast<int>(_built.size()); }
+		CacheStats cache_stats() const;
+	private:
+		struct entry{
+			shared_ptr<KDTree> tree;
+			size_t bytes;
+			std::list<FrameIndex>::iterator position; // in _lru
+			bool prefetched; // loaded ahead and not asked for yet
+		};
+
+		// Adds a tree as the most recently used one and drops the least recently used trees over the budget.
+		void insert(FrameIndex idx, shared_ptr<KDTree> tree, bool prefetched = false);
+		// Marks a prefetched entry used. The caller holds _cache_lock.
+		void use_locked(entry& e);
+		// Loads the tree from the pack, or takes it from the trees waiting to be saved. A tree that fails to load is handed to the workers to build again and
+		// is not ready until then; nullptr is returned for it.
+		shared_ptr<KDTree> load(FrameIndex idx);
+		// The caller holds _cache_lock.
+		bool is_ready_locked(FrameIndex idx) const;
+
+		vector<promise<void>> _promises; // set when the tree is built and saved; never set if the build fails
+		vector<shared_future<void>> _built;
+		bool _stopping;
+		void run() override;
+		FrameSource& _video;
+		const Projector& _projector;
+		int _pixel_step;
+		IndexType _index_type;
+
+		// Hands the trees it builds to the writer, which holds up to number_of_workers of them outside the memory budget.
+		class KDtreeFactoryAgent : public agent{
+		public:
+			KDtreeFactoryAgent(bounded_queue<FrameMsg>& source, implementation& owner, const Projector& projector, int pixel_step, IndexType index_type) :_source(source), _owner(owner), _projector(projector), _pixel_step(pixel_step), _index_type(index_type){ start(); }
+			void run() override;
+		private:
+			bounded_queue<FrameMsg>& _source;
+			implementation& _owner;
+			const Projector& _projector;
+			int _pixel_step;
+			IndexType _index_type;
+		};
+
+		// Loads the trees of the prefetch range one by one while the prefetched trees not asked for yet take
+		// less than half the budget, so that it neither runs away from the reader nor evicts its own loads.
+		class PrefetchAgent : public agent{
+		public:
+			PrefetchAgent(implementation& owner) :_owner(owner){ start(); }
+			void run() override;
+		private:
+			implementation& _owner;
+		};
+
+		// Appends built trees to the pack so that the workers never wait for the disc, unless the writes fall
+		// number_of_workers trees behind. Writes whatever has queued up meanwhile in one go.
+		class TreeWriterAgent : public agent{
+		public:
+			TreeWriterAgent(implementation& owner) :_owner(owner){ start(); }
+			void run() override;
+		private:
+			implementation& _owner;
+		};
+
+		bounded_queue<FrameMsg> _frame_queue;
+		bounded_queue<WriteMsg> _write_queue;
+		// Frames whose trees failed to load, decoded by this agent and built by the workers; -1 stops the agent.
+		concurrency::unbounded_buffer<FrameIndex> _rebuilds;
+		// Decodes a frame of _rebuilds and queues it for the workers.
+		void rebuild(FrameIndex idx);
+		vector<shared_ptr<KDtreeFactoryAgent>> _workers;
+		shared_ptr<PrefetchAgent> _prefetcher;
+		shared_ptr<TreeWriterAgent> _writer;
+		KDTreeSource::ProgressHandler _subscription;
+		FrameIndex _complete_count;
+		tree_pack::key _key;
+		tree_pack _pack;
+
+		size_t _budget;
+		mutable std::mutex _cache_lock;
+		std::list<FrameIndex> _lru; // the most recently used first
+		std::unordered_map<FrameIndex, entry> _cache;
+		std::unordered_set<FrameIndex> _rebuilding; // trees handed to the workers after they failed to load
+		std::unordered_map<FrameIndex, shared_ptr<KDTree>> _unwritten; // built trees queued for the pack
+		size_t _bytes;
+		long long _hits;
+		long long _misses;
+		long long _evictions;
+		long long _prefetches;
+
+		// The rest of the prefetch range, _prefetch_next == _prefetch_end when there is nothing to load.
+		FrameIndex _prefetch_next;
+		FrameIndex _prefetch_end;
+		size_t _ahead_bytes; // prefetched trees not asked for yet
+		bool _prefetch_stopping;
+		std::condition_variable _prefetch_wake;
+	};
+}
+using namespace zt;
+
+CachedKDTreeSource::CachedKDTreeSource(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, string folder_path, size_t memory_budget, IndexType index_type)
+: impl(new implementation(video, projector, pixel_step, number_of_workers, folder_path, memory_budget, index_type)){}
+CachedKDTreeSource::~CachedKDTreeSource() {}
+shared_ptr<KDTree> CachedKDTreeSource::operator [] (FrameIndex idx) const { return impl->get_tree(idx); }
+
+bool CachedKDTreeSource::is_ready(FrameIndex idx) const { return impl->is_ready(idx); }
+int CachedKDTreeSource::num_frames() const { return impl->num_frames(); }
+void CachedKDTreeSource::subscribe(ProgressHandler handler) { impl->subscribe(handler); }
+CachedKDTreeSource::CacheStats CachedKDTreeSource::cache_stats() const { return impl->cache_stats(); }
+void CachedKDTreeSource::prefetch(FrameIndex first, FrameIndex last) const { impl->prefetch(first, last); }
+
+
+CachedKDTreeSource::implementation::implementation(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, std::string folder_path, size_t memory_budget, IndexType index_type)
+: _video(video), _projector(projector), _pixel_step(pixel_step), _index_type(index_type), _frame_queue(number_of_workers), _write_queue(std::max(1, number_of_workers)), _stopping(false), _subscription(nullptr), _complete_count(0),
+_key(tree_pack::make_key(video, projector, pixel_step, index_type)), _pack(tree_pack::base_path(folder_path, _key), _key), _budget(memory_budget), _bytes(0), _hits(0), _misses(0), _evictions(0), _prefetches(0),
+_prefetch_next(0), _prefetch_end(0), _ahead_bytes(0), _prefetch_stopping(false) {
+	int len = video.verifiedNumFrames();
+	for (int i = 0; i < len; i++){
+		_promises.push_back(promise<void>{});
+		_built.push_back(_promises[_promises.size() - 1].get_future().share());
+		if (_pack.contains(i)) _promises[i].set_value(); // loaded when asked for
+	}
+	// frames queued for the workers and being made into trees, and the frame being read
+	video.reserveFrameBuffers(2 * number_of_workers + 1);
+	for (int w = 0; w < number_of_workers; w++){
+		_workers.push_back(make_shared<KDtreeFactoryAgent>(_frame_queue, *this, projector, pixel_step, index_type));
+	}
+	_writer = make_shared<TreeWriterAgent>(*this);
+	_prefetcher = make_shared<PrefetchAgent>(*this);
+	start();
+}
+
+CachedKDTreeSource::implementation::~implementation(){
+	_stopping = true;
+	_subscription = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(_cache_lock);
+		_prefetch_stopping = true;
+	}
+	_prefetch_wake.notify_all();
+	wait(&(*_prefetcher));
+	concurrency::send(_rebuilds, FrameIndex(-1));
+	wait(this);
+	CacheStats stats = cache_stats();
+	ostringstream s; s << "kd-tree cache destroyed: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions << " evictions, "
+		<< stats.prefetches << " prefetches.";
+	Log::write(s.str());
+}
+
+shared_ptr<KDTree> CachedKDTreeSource::implementation::get_tree(FrameIndex idx){
+	{
+		std::lock_guard<std::mutex> lock(_cache_lock);
+		auto it = _cache.find(idx);
+		if (it != _cache.end()){
+			_hits += 1;
+			_lru.splice(_lru.begin(), _lru, it->second.position);
+			use_locked(it->second);
+			return it->second.tree;
+		}
+		_misses += 1;
+	}
+	_built[idx].wait(); // for the build
+	{
+		// a tree just built is in the cache
+		std::lock_guard<std::mutex> lock(_cache_lock);
+		auto it = _cache.find(idx);
+		if (it != _cache.end()){
+			use_locked(it->second);
+			return it->second.tree;
+		}
+		if (_rebuilding.count(idx) > 0) return nullptr;
+	}
+	auto tree = load(idx);
+	if (tree) insert(idx, tree);
+	return tree;
+}
+
+shared_ptr<KDTree> CachedKDTreeSource::implementation::load(FrameIndex idx){
+	{
+		// evicted before it was saved
+		std::lock_guard<std::mutex> lock(_cache_lock);
+		auto it = _unwritten.find(idx);
+		if (it != _unwritten.end()) return it->second;
+	}
+	try{
+		return _pack.load(idx);
+	}
+	catch (std::exception e){
+		// left by a crash or damaged; the pack has dropped it
+		ostringstream s; s << "rebuilding kd-tree " << idx << ": " << e.what();
+		Log::write(s.str());
+	}
+	{
+		std::lock_guard<std::mutex> lock(_cache_lock);
+		if (!_rebuilding.insert(idx).second) return nullptr; // handed over already
+	}
+	concurrency::send(_rebuilds, idx);
+	return nullptr;
+}
+
+bool CachedKDTreeSource::implementation::is_ready(FrameIndex idx) const {
+	std::lock_guard<std::mutex> lock(_cache_lock);
+	return is_ready_locked(idx);
+}
+
+bool CachedKDTreeSource::implementation::is_ready_locked(FrameIndex idx) const {
+	return _built[idx].wait_for(duration<int>::zero()) == std::future_status::ready && _rebuilding.count(idx) == 0;
+}
+
+void CachedKDTreeSource::implementation::insert(FrameIndex idx, shared_ptr<KDTree> tree, bool prefetched){
+	size_t bytes = tree->memorySize();
+	std::lock_guard<std::mutex> lock(_cache_lock);
+	auto it = _cache.find(idx);
+	if (it != _cache.end()){
+		_lru.splice(_lru.begin(), _lru, it->second.position);
+		return;
+	}
+	_lru.push_front(idx);
+	_cache[idx] = entry{ tree, bytes, _lru.begin(), prefetched };
+	_bytes += bytes;
+	if (prefetched){
+		_ahead_bytes += bytes;
+		_prefetches += 1;
+	}
+	while (_bytes > _budget && _lru.size() > 1){
+		auto last = _cache.find(_lru.back());
+		use_locked(last->second);
+		_bytes -= last->second.bytes;
+		_cache.erase(last);
+		_lru.pop_back();
+		_evictions += 1;
+	}
+}
+
+void CachedKDTreeSource::implementation::use_locked(entry& e){
+	if (!e.prefetched) return;
+	e.prefetched = false;
+	_ahead_bytes -= e.bytes;
+	_prefetch_wake.notify_all();
+}
+
+void CachedKDTreeSource::implementation::prefetch(FrameIndex first, FrameIndex last){
+	int len = num_frames();
+	if (len == 0) return;
+	first = std::max(0, std::min(first, len - 1));
+	last = std::max(0, std::min(last, len - 1));
+	std::lock_guard<std::mutex> lock(_cache_lock);
+	_prefetch_next = first;
+	_prefetch_end = last >= first ? last + 1 : last - 1;
+	_prefetch_wake.notify_all();
+}
+
+CachedKDTreeSource::CacheStats CachedKDTreeSource::implementation::cache_stats() const {
+	std::lock_guard<std::mutex> lock(_cache_lock);
+	return CacheStats{ _hits, _misses, _evictions, _prefetches, _bytes, static_cast<int>(_cache.size()) };
+}
+
+void CachedKDTreeSource::implementation::PrefetchAgent::run() {
+	implementation& o = _owner;
+	std::unique_lock<std::mutex> lock(o._cache_lock);
+	while (true){
+		o._prefetch_wake.wait(lock, [&o]{ return o._prefetch_stopping || (o._prefetch_next != o._prefetch_end && o._ahead_bytes < o._budget / 2); });
+		if (o._prefetch_stopping) break;
+		FrameIndex idx = o._prefetch_next;
+		o._prefetch_next += o._prefetch_end > idx ? 1 : -1;
+		if (o._cache.count(idx) > 0 || !o.is_ready_locked(idx) || !o._pack.contains(idx)) continue; // cached, or not built yet
+		lock.unlock();
+		auto tree = o.load(idx);
+		if (tree) o.insert(idx, tree, true);
+		lock.lock();
+	}
+	lock.unlock();
+	done();
+}
+
+void CachedKDTreeSource::implementation::run() {
+	KDTreeSource::ProgressHandler notify;
+	FrameIndex failed;
+	for (FrameIndex i = 0; i < _video.numFrames() && !_stopping; i++){
+		while (concurrency::try_receive(_rebuilds, failed))
+			if (failed >= 0) rebuild(failed);
+		if (is_ready(i)) continue;
+		try{
+			_frame_queue.enqueue(FrameMsg{ _video.getFrame(i), i });
+			FrameIndex prev_count = _complete_count;
+			while (_complete_count < _built.size() && is_ready(_complete_count)) _complete_count += 1;
+			notify = _subscription;
+			if (notify != nullptr && _complete_count>prev_count) notify(_complete_count);
+		}
+		catch (std::exception e){
+			ostringstream s; s << "Exception in kd-tree agent, frame index=" << i << ": " << e.what();
+			Log::write(s.str());
+		}
+	}
+	if (!_stopping){
+		_complete_count = static_cast<FrameIndex>(_built.size());
+		notify = _subscription;
+		if (notify != nullptr) notify(_complete_count);
+	}
+	// the workers stay for the trees that fail to load later
+	while (!_stopping){
+		failed = concurrency::receive(_rebuilds);
+		if (failed < 0) break;
+		rebuild(failed);
+	}
+	// stop all workers
+	if (_stopping) {
+		FrameMsg buf;
+		while (_frame_queue.try_dequeue(buf));
+	}
+	for (size_t i = 0; i < _workers.size(); i++)
+		_frame_queue.enqueue(FrameMsg{ Image{}, -1 });
+	for (auto& w : _workers) wait(&(*w));
+	// the trees built so far are saved even when stopping
+	_write_queue.enqueue(WriteMsg{ nullptr, -1 });
+	wait(&(*_writer));
+	done();
+}
+
+void CachedKDTreeSource::implementation::rebuild(FrameIndex idx) {
+	try{
+		_frame_queue.enqueue(FrameMsg{ _video.getFrame(idx), idx });
+	}
+	catch (std::exception e){
+		ostringstream s; s << "Exception in kd-tree agent, frame index=" << idx << ": " << e.what();
+		Log::write(s.str());
+	}
+}
+
+void CachedKDTreeSource::implementation::KDtreeFactoryAgent::run() {
+	while (true){
+		FrameMsg m = _source.dequeue();
+		FrameIndex idx = get<1>(m);
+		if (idx < 0) break;
+		try{
+			auto tree = make_shared<KDTree>(get<0>(m), _projector, _pixel_step, _index_type);
+			{
+				std::lock_guard<std::mutex> lock(_owner._cache_lock);
+				_owner._unwritten[idx] = tree;
+			}
+			_owner.insert(idx, tree);
+			bool rebuilt;
+			{
+				std::lock_guard<std::mutex> lock(_owner._cache_lock);
+				rebuilt = _owner._rebuilding.erase(idx) > 0;
+			}
+			// the promise of a tree built again was set when the pack was opened
+			if (!rebuilt) _owner._promises[idx].set_value();
+			_owner._write_queue.enqueue(WriteMsg{ tree, idx });
+
+			ostringstream s; s << "done kd-tree " << idx << ".";
+			Log::write(s.str());
+		}
+		catch (std::exception e)
+		{
+			// not ready, as with the other sources
+			ostringstream s; s << "exception while building kd-tree " << idx << ": " << e.what();
+			Log::write(s.str());
+		}
+	}
+	done();
+}
+
+void CachedKDTreeSource::implementation::TreeWriterAgent::run() {
+	const size_t max_batch = 64;
+	vector<std::pair<FrameIndex, shared_ptr<KDTree>>> batch;
+	bool stop = false;
+	while (!stop){
+		WriteMsg m = _owner._write_queue.dequeue();
+		batch.clear();
+		do{
+			if (get<1>(m) < 0){ stop = true; break; }
+			batch.push_back(std::make_pair(get<1>(m), get<0>(m)));
+		} while (batch.size() < max_batch && _owner._write_queue.try_dequeue(m));
+		if (batch.empty()) continue;
+		try{
+			_owner._pack.append(batch);
+		}
+		catch (std::exception e)
+		{
+			// loaded again they fail and are built again
+			ostringstream s; s << "exception while saving kd-trees " << batch.front().first << " to " << batch.back().first << ": " << e.what();
+			Log::write(s.str());
+		}
+		std::lock_guard<std::mutex> lock(_owner._cache_lock);
+		for (auto& t : batch){
+			auto it = _owner._unwritten.find(t.first);
+			if (it != _owner._unwritten.end() && it->second == t.second) _owner._unwritten.erase(it);
+		}
+	}
+	done();
+}
@@ -1,13 +1,18 @@
 #include <ztKDTree.h>
+#include "tree_pack.h"
 #include <ztLog.h>
 #include <bounded_queue.h>
 
+#include <algorithm>
+#include <mutex>
 #include <vector>
 #include <sstream>
 #include <future>
 #include <chrono>
+#include <atomic>
 #include <agents.h>
-#include <io.h>
+#include <ppl.h>
+#include <concurrent_queue.h>
 
 using std::tuple;
 using std::get;
@@ -18,6 +23,8 @@ using std::ostringstream;
 using std::shared_future;
 using std::promise;
 using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::atomic;
 using concurrency::agent;
 using std::string;
 
@@ -26,65 +33,124 @@ namespace zt{
 	class FileKDTreeSource::implementation : public agent
 	{
 	public:
-		using FrameMsg = tuple<Image, promise<shared_ptr<KDTree>>*, FrameIndex, string>;
-		implementation(OpenCVFrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, string folder_path);
+		using FrameMsg = tuple<Image, promise<shared_ptr<KDTree>>*, FrameIndex>;
+		using WriteMsg = tuple<shared_ptr<KDTree>, FrameIndex>;
+		implementation(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, string folder_path, IndexType index_type, int max_pending_writes, bool compress_files);
 		~implementation();
 		shared_ptr<KDTree> operator [] (FrameIndex idx) const { return _futures[idx].get(); }
 		bool is_ready(FrameIndex idx) const { return _futures[idx].wait_for(duration<int>::zero()) == std::future_status::ready; }
 		void subscribe(KDTreeSource::ProgressHandler handler){ if (!_stopping){ _subscription = handler; handler(_complete_count); } }
 		int num_frames() const { return static_cast<int>(_futures.size()); }
+		WriteProgress write_progress() const { return WriteProgress{ _io.written, _io.pending, _io.write_us * 1e-6, _io.overlapped_us * 1e-6 }; }
 	private:
+		// Shared by the workers and the writer to account for the time the writes overlap building.
+		struct io_counters{
+			atomic<int> building;	// workers building a tree now
+			atomic<int> pending;	// trees queued for writing
+			atomic<int> written;
+			atomic<long long> write_us;
+			atomic<long long> overlapped_us;
+		};
+
 		vector<promise<shared_ptr<KDTree>>> _promises;
 		vector<shared_future<shared_ptr<KDTree>>> _futures;
 		bool _stopping;
 		void run() override;
-		OpenCVFrameSource& _video;
+		FrameSource& _video;
+		// Streams the frames first to last - 1 to the workers, the frames of saved trees without decoding them.
+		void stream(FrameIndex first, FrameIndex last);
+		// Queues a frame for the workers and notifies the progress. Called by the decoders of several parts at once.
+		void queue(FrameIndex i, Image frame);
+		// Decodes the frames of the trees that failed to load and queues them for the workers, until the parts
+		// are streamed and every saved tree is loaded.
+		void rebuild_failed(const std::atomic<int>& streaming);
+		void update_progress();
 
 		class KDtreeFactoryAgent : public agent{
 		public:
-			KDtreeFactoryAgent(bounded_queue<FrameMsg>& source, const Projector& projector, int pixel_step) :_source(source), _projector(projector), _pixel_step(pixel_step){ start(); }
+			KDtreeFactoryAgent(bounded_queue<FrameMsg>& source, concurrency::concurrent_queue<FrameMsg>& rebuilds, atomic<int>& loading, concurrency::event& rebuild_ready, tree_pack& pack, bounded_queue<WriteMsg>& writes, io_counters& io, const Projector& projector, int pixel_step, IndexType index_type) :_source(source), _rebuilds(rebuilds), _loading(loading), _rebuild_ready(rebuild_ready), _pack(pack), _writes(writes), _io(io), _projector(projector), _pixel_step(pixel_step), _index_type(index_type){ start(); }
 			void run() override;
+			// Builds the tree of a frame, sets it and queues it for writing.
+			void build(const FrameMsg& m);
 		private:
 			bounded_queue<FrameMsg>& _source;
+			// Trees that fail to load, queued again with their frames while the workers run.
+			concurrency::concurrent_queue<FrameMsg>& _rebuilds;
+			atomic<int>& _loading;
+			concurrency::event& _rebuild_ready;
+			tree_pack& _pack;
+			bounded_queue<WriteMsg>& _writes;
+			io_counters& _io;
 			const Projector& _projector;
 			int _pixel_step;
+			IndexType _index_type;
+		};
+
+		// Appends built trees to the pack so that the workers never wait for the disc, unless the writes fall
+		// max_pending_writes trees behind. Writes whatever has queued up meanwhile in one go.
+		class TreeWriterAgent : public agent{
+		public:
+			TreeWriterAgent(bounded_queue<WriteMsg>& source, tree_pack& pack, io_counters& io) :_source(source), _pack(pack), _io(io){ start(); }
+			void run() override;
+		private:
+			bounded_queue<WriteMsg>& _source;
+			tree_pack& _pack;
+			io_counters& _io;
 		};
 
 		bounded_queue<FrameMsg> _frame_queue;
+		concurrency::concurrent_queue<FrameMsg> _rebuilds;
+		atomic<int> _loading; // saved trees queued and not loaded yet
+		concurrency::event _rebuild_ready; // set when a tree fails to load, the last one is loaded or a part is streamed
+		bounded_queue<WriteMsg> _write_queue;
+		io_counters _io;
 		vector<shared_ptr<KDtreeFactoryAgent>> _workers;
+		shared_ptr<TreeWriterAgent> _writer;
 		KDTreeSource::ProgressHandler _subscription;
 		FrameIndex _complete_count;
-		string _base_path;
+		std::mutex _progress_lock; // guards the complete count while frames are queued
+		tree_pack::key _key;
+		tree_pack _pack;
 	};
 }
 using namespace zt;
 
-FileKDTreeSource::FileKDTreeSource(OpenCVFrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, string folder_path)
-: impl(new implementation(video, projector, pixel_step, number_of_workers, folder_path)){}
+FileKDTreeSource::FileKDTreeSource(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, string folder_path, IndexType index_type, int max_pending_writes, bool compress_files)
+: impl(new implementation(video, projector, pixel_step, number_of_workers, folder_path, index_type, max_pending_writes, compress_files)){}
 FileKDTreeSource::~FileKDTreeSource() {}
 shared_ptr<KDTree> FileKDTreeSource::operator [] (FrameIndex idx) const { return (*impl)[idx]; }
 
 bool FileKDTreeSource::is_ready(FrameIndex idx) const { return impl->is_ready(idx); }
 int FileKDTreeSource::num_frames() const { return impl->num_frames(); }
 void FileKDTreeSource::subscribe(ProgressHandler handler) { impl->subscribe(handler); }
+FileKDTreeSource::WriteProgress FileKDTreeSource::write_progress() const { return impl->write_progress(); }
+
+int FileKDTreeSource::pack(FrameSource& video, const Projector& projector, string folder_path, int pixel_step, IndexType index_type, bool remove_files)
+{
+	auto key = tree_pack::make_key(video, projector, pixel_step, index_type);
+	tree_pack pack(tree_pack::base_path(folder_path, key), key);
+	return pack.append_files(tree_pack::legacy_base_path(folder_path, pixel_step, index_type), video.verifiedNumFrames(), remove_files);
+}
 
 
-FileKDTreeSource::implementation::implementation(OpenCVFrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, std::string folder_path)
-: _video(video), _frame_queue(number_of_workers), _stopping(false), _subscription(nullptr), _complete_count(0) {
-	if (folder_path.size() <= 0) throw std::invalid_argument("folder_path");
-	char& last_char = folder_path[folder_path.size() - 1];
-	ostringstream ss; ss << folder_path;
-	if (last_char != '\\' && last_char != '/') ss << "/";
-	ss << pixel_step << '.';
-	_base_path = ss.str();
-	int len = video.numFrames();
+FileKDTreeSource::implementation::implementation(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, std::string folder_path, IndexType index_type, int max_pending_writes, bool compress_files)
+: _video(video), _frame_queue(number_of_workers), _write_queue(std::max(1, max_pending_writes)), _stopping(false), _subscription(nullptr), _complete_count(0),
+_key(tree_pack::make_key(video, projector, pixel_step, index_type)), _pack(tree_pack::base_path(folder_path, _key), _key, compress_files) {
+	int len = video.verifiedNumFrames();
 	for (int i = 0; i < len; i++){
 		_promises.push_back(promise<shared_ptr<KDTree>>{});
 		_futures.push_back(_promises[_promises.size() - 1].get_future().share());
 	}
+	_loading = 0;
+	_io.building = 0;
+	_io.pending = 0;
+	_io.written = 0;
+	_io.write_us = 0;
+	_io.overlapped_us = 0;
 	for (int w = 0; w < number_of_workers; w++){
-		_workers.push_back(make_shared<KDtreeFactoryAgent>(_frame_queue, projector, pixel_step));
+		_workers.push_back(make_shared<KDtreeFactoryAgent>(_frame_queue, _rebuilds, _loading, _rebuild_ready, _pack, _write_queue, _io, projector, pixel_step, index_type));
 	}
+	_writer = make_shared<TreeWriterAgent>(_write_queue, _pack, _io);
 	start();
 }
 
@@ -97,57 +163,197 @@ FileKDTreeSource::implementation::~implementation(){
 
 void FileKDTreeSource::implementation::run() {
 	KDTreeSource::ProgressHandler notify;
-	for (FrameIndex i = 0; i < _video.numFrames() && !_stopping; i++){
-		ostringstream fns; fns << _base_path << i;
-		string fn = fns.str();
-		try{
-			if (_access_s(fn.c_str(), 0) == 0)
-				_promises[i].set_value(make_shared<KDTree>(fn));
-			else{
-				_frame_queue.enqueue(FrameMsg{ _video.getFrame(i), &_promises[i], i, fn });
-				FrameIndex prev_count = _complete_count;
-				while (_complete_count < _futures.size() && is_ready(_complete_count)) _complete_count += 1;
-				notify = _subscription;
-				if (notify != nullptr && _complete_count>prev_count) notify(_complete_count);
-			}
-		}
-		catch (std::exception e){
-			ostringstream s; s << "Exception in kd-tree agent, frame index=" << i << ": " << e.what();
-			Log::write(s.str());
-		}
+	// The frames of a video are streamed from as many parts of it as it has decoders at once, each part by
+	// the decoder that reads on through it. Sources that decode any frame as fast as the next have one part,
+	// with frames requested ahead by the source.
+	FrameIndex len = _video.numFrames();
+	int decoders = std::max(1, _video.numDecoders());
+	int parts = _video.randomAccess() ? 1 : std::max(1, std::min(decoders, len));
+	// frames queued for the workers, being made into trees and decoded
+	_video.reserveFrameBuffers(2 * static_cast<int>(_workers.size()) + decoders);
+	concurrency::task_group streams;
+	std::atomic<int> streaming(parts);
+	for (int p = 0; p < parts; p++){
+		FrameIndex first = static_cast<FrameIndex>(static_cast<long long>(len) * p / parts);
+		FrameIndex last = static_cast<FrameIndex>(static_cast<long long>(len) * (p + 1) / parts);
+		streams.run([this, first, last, &streaming]{
+			stream(first, last);
+			streaming--;
+			_rebuild_ready.set();
+		});
 	}
+	rebuild_failed(streaming);
+	streams.wait();
 	// stop all workers
 	if (_stopping) {
 		FrameMsg buf;
 		while (_frame_queue.try_dequeue(buf));
 	}
 	for (size_t i = 0; i < _workers.size(); i++)
-		_frame_queue.enqueue(FrameMsg{ Image{}, nullptr, -1 ,""});
+		_frame_queue.enqueue(FrameMsg{ Image{}, nullptr, -1 });
 	for (auto& w : _workers) wait(&(*w));
+	_write_queue.enqueue(WriteMsg{ nullptr, -1 });
+	wait(&(*_writer));
+	if (_io.written > 0){
+		ostringstream s; s << "kd-tree writes: " << _io.written << " trees in " << _io.write_us * 1e-6 << " s, "
+			<< _io.overlapped_us * 1e-6 << " s of it while building.";
+		Log::write(s.str());
+	}
+	auto decoding = _video.statistics();
+	if (decoding.frames_decoded > 0){
+		ostringstream s; s << "video decoding: " << decoding.frames_decoded << " frames at " << decoding.decode_fps() << " fps, "
+			<< decoding.seeks << " seeks, " << decoding.frames_skipped << " frames skipped, "
+			<< decoding.buffers_allocated << " frame buffers allocated.";
+		Log::write(s.str());
+	}
 	_complete_count = static_cast<FrameIndex>(_futures.size());
 	notify = _subscription;
 	if (notify != nullptr) notify(_complete_count);
 	done();
 }
 
+void FileKDTreeSource::implementation::stream(FrameIndex first, FrameIndex last) {
+	FrameIndex next = first;
+	FrameSource::FrameHandler handler = [this, &next](int i, Image frame){
+		queue(i, frame);
+		next = i + 1;
+		return !_stopping;
+	};
+	while (next < last && !_stopping){
+		// the workers load saved trees too, in frame order as they are queued; no frame to decode for them
+		if (_pack.contains(next)){
+			queue(next, Image{});
+			next++;
+			continue;
+		}
+		FrameIndex end = next + 1;
+		while (end < last && !_pack.contains(end)) end++;
+		try{
+			_video.getFrames(next, end, handler);
+			next = end;
+		}
+		catch (std::exception e){
+			ostringstream s; s << "Exception in kd-tree agent, frame index=" << next << ": " << e.what();
+			Log::write(s.str());
+			next++;
+		}
+	}
+}
+
+void FileKDTreeSource::implementation::rebuild_failed(const std::atomic<int>& streaming) {
+	while (!_stopping){
+		_rebuild_ready.reset();
+		FrameMsg failed;
+		// the counts first: once both are 0 every failed load has been pushed
+		bool last = streaming == 0 && _loading == 0;
+		if (_rebuilds.try_pop(failed)){
+			// decoded between the chunks of the parts, built by any idle worker
+			try{
+				get<0>(failed) = _video.getFrame(get<2>(failed));
+				_frame_queue.enqueue(failed);
+			}
+			catch (std::exception e){
+				ostringstream s; s << "Exception in kd-tree agent, frame index=" << get<2>(failed) << ": " << e.what();
+				Log::write(s.str());
+			}
+			continue;
+		}
+		if (last) break;
+		update_progress();
+		_rebuild_ready.wait();
+	}
+}
+
+void FileKDTreeSource::implementation::queue(FrameIndex i, Image frame) {
+	if (!frame) _loading++;
+	_frame_queue.enqueue(FrameMsg{ frame, &_promises[i], i });
+	update_progress();
+}
+
+void FileKDTreeSource::implementation::update_progress() {
+	FrameIndex count;
+	{
+		std::lock_guard<std::mutex> lock(_progress_lock);
+		FrameIndex prev_count = _complete_count;
+		while (_complete_count < _futures.size() && is_ready(_complete_count)) _complete_count += 1;
+		count = _complete_count > prev_count ? _complete_count : 0;
+	}
+	KDTreeSource::ProgressHandler notify = _subscription;
+	if (notify != nullptr && count > 0) notify(count);
+}
+
 void FileKDTreeSource::implementation::KDtreeFactoryAgent::run() {
 	while (true){
 		FrameMsg m = _source.dequeue();
 		if (get<2>(m) < 0) break;
-		Image img = get<0>(m);
-		try{
-			auto tree = make_shared<KDTree>(img, _projector, _pixel_step);
-			get<1>(m)->set_value(tree);
-			tree->saveToFile(get<3>(m));
+		if (!get<0>(m)){
+			try{
+				get<1>(m)->set_value(_pack.load(get<2>(m)));
+			}
+			catch (std::exception e){
+				// left by a crash or damaged, built again
+				ostringstream s; s << "rebuilding kd-tree " << get<2>(m) << ": " << e.what();
+				Log::write(s.str());
+				_rebuilds.push(m);
+			}
+			// after the push, so that a count of 0 means every failed load is queued for rebuilding
+			_loading--;
+			_rebuild_ready.set();
+			continue;
+		}
+		build(m);
+	}
+	done();
+}
 
-			ostringstream s; s << "done kd-tree " << get<2>(m) << ".";
-			Log::write(s.str());
+void FileKDTreeSource::implementation::KDtreeFactoryAgent::build(const FrameMsg& m) {
+	try{
+		_io.building++;
+		shared_ptr<KDTree> tree;
+		try{ tree = make_shared<KDTree>(get<0>(m), _projector, _pixel_step, _index_type); }
+		catch (...){ _io.building--; throw; }
+		_io.building--;
+		get<1>(m)->set_value(tree);
+		_io.pending++;
+		_writes.enqueue(WriteMsg{ tree, get<2>(m) });
+
+		ostringstream s; s << "done kd-tree " << get<2>(m) << ".";
+		Log::write(s.str());
+	}
+	catch (std::exception e)
+	{
+		ostringstream s; s << "exception while building kd-tree " << get<2>(m) << ": " << e.what();
+		Log::write(s.str());
+	}
+}
+
+void FileKDTreeSource::implementation::TreeWriterAgent::run() {
+	const size_t max_batch = 64;
+	vector<std::pair<FrameIndex, shared_ptr<KDTree>>> batch;
+	bool stop = false;
+	while (!stop){
+		WriteMsg m = _source.dequeue();
+		batch.clear();
+		do{
+			if (get<1>(m) < 0){ stop = true; break; }
+			batch.push_back(std::make_pair(get<1>(m), get<0>(m)));
+		} while (batch.size() < max_batch && _source.try_dequeue(m));
+		if (batch.empty()) continue;
+		bool overlapped = _io.building > 0;
+		auto start = steady_clock::now();
+		try{
+			_pack.append(batch);
+			_io.written += static_cast<int>(batch.size());
 		}
 		catch (std::exception e)
 		{
-			ostringstream s; s << "exception while building kd-tree " << get<2>(m) << ": " << e.what();
+			ostringstream s; s << "exception while saving kd-trees " << batch.front().first << " to " << batch.back().first << ": " << e.what();
 			Log::write(s.str());
 		}
+		long long us = std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - start).count();
+		_io.write_us += us;
+		if (overlapped || _io.building > 0) _io.overlapped_us += us;
+		_io.pending -= static_cast<int>(batch.size());
 	}
 	done();
-}
\ No newline at end of file
+}
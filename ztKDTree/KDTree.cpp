@@ -1,14 +1,20 @@
 #include <ztKDTree.h>
+#include "index_engine.h"
+#include "mapped_file.h"
+#include <ztLog.h>
 #include <cassert>
+#include <algorithm>
+#include <stdexcept>
 
 using namespace zt;
 
 KDTree::KDTree(
 	Image frame,				// A video frame.
 	const Projector& projector,	// Projector for the video.
-	int pixel_step				// The number of pixels to step horizontally and vertically. Translates into the precision of nearest match coordinates.
+	int pixel_step,				// The number of pixels to step horizontally and vertically. Translates into the precision of nearest match coordinates.
+	IndexType index_type		// Descriptor storage.
 	)
-	: kd_ptr(new kd_tree_float()), features(new std::vector<float>()), step(pixel_step)
+	: engine(make_index_engine(index_type)), step(pixel_step)
 {
 	int im_width = frame->width();
 	int im_height = frame->height();
@@ -34,7 +40,7 @@ KDTree::KDTree(
 	this->h_steps = (im_width - patch_width) / pixel_step; // patch_width + pixel_step * nw <= im_width
 	int v_steps = (im_height - patch_height) / pixel_step;
 	int point_count = h_steps*v_steps;
-	features->resize(point_count * dimension);
+	std::unique_ptr<std::vector<float>> features(new std::vector<float>(point_count * dimension));
 
 	for (int iv = 0; iv < v_steps; iv++)
 	for (int ih = 0; ih < h_steps; ih++){
@@ -46,14 +52,44 @@ KDTree::KDTree(
 		auto f = projector.project(patch);
 		std::copy(f.cbegin(), f.cend(), features->begin() + (i*dimension));
 	}
-	int max_per_leaf = 128; // the maximum number of nodes per leaf
-	kd_ptr->build(dimension, point_count, features->data(), max_per_leaf);
+	engine->build(dimension, point_count, std::move(features), projector);
 }
 
+KDTree::~KDTree(){}
+
 KDTree::KDTree(std::string fileName)
-: kd_ptr(new kd_tree_float()), features(new std::vector<float>())
 {
-	loadFromFile(fileName);
+	FILE * source;
+	errno_t err = fopen_s(&source, fileName.c_str(), "rb");
+	if (err) throw std::exception(("Couldn't open '" + fileName + "' for reading.").c_str());
+	try{
+		std::shared_ptr<const mapped_file> mapping;
+		try{ mapping = std::make_shared<const mapped_file>(fileName); }
+		catch (std::exception e){ Log::write(e.what()); }
+		readFileHeader(source);
+		loadMapped(source, mapping);
+	}
+	catch (...){
+		fclose(source);
+		throw;
+	}
+	fclose(source);
+}
+
+KDTree::KDTree(FILE* source, std::shared_ptr<const mapped_file> mapping)
+{
+	loadMapped(source, mapping);
+}
+
+// Reads what saveToFile wrote, using the engine data in place from the mapping if the engine can.
+void KDTree::loadMapped(FILE * source, std::shared_ptr<const mapped_file> mapping)
+{
+	checkName(source); // saveToFile writes the name ahead of saveTo
+	loadHeader(source);
+	// the mapping may start further into the file
+	long long offset = _ftelli64(source) - (mapping ? mapping->offset() : 0);
+	if (!mapping || offset < 0 || !engine->attach(mapping, static_cast<size_t>(offset)))
+		engine->load(source);
 }
 
 
@@ -62,31 +98,108 @@ void KDTree::saveTo(FILE * target) const
 	saveName(target);
 	file_write(step, target);
 	file_write(h_steps, target);
-	kd_ptr->save(target);
+	file_write(engine->marker(), target);
+	engine->save(target);
+}
+
+void KDTree::saveCompressedTo(FILE * target) const
+{
+	saveName(target);
+	file_write(step, target);
+	file_write(h_steps, target);
+	file_write(engine->marker(), target);
+	engine->save_compressed(target);
 }
 
 void KDTree::loadFrom(FILE * source)
+{
+	loadHeader(source);
+	engine->load(source);
+}
+
+// Reads the file up to the engine data and creates the engine.
+void KDTree::loadHeader(FILE * source)
 {
 	checkName(source);
 	file_read(step, source);
 	file_read(h_steps, source);
-	kd_ptr->load(source);
+	// float trees written by earlier versions have no marker.
+	long long pos = _ftelli64(source);
+	std::string marker;
+	file_read(marker, source);
+	engine = make_index_engine(marker);
+	if (!engine){
+		engine = make_index_engine(IndexType::Float);
+		_fseeki64(source, pos, SEEK_SET);
+	}
+}
+
+IndexType KDTree::indexType() const
+{
+	return engine->type();
+}
+
+size_t KDTree::memorySize() const
+{
+	return sizeof(KDTree) + engine->memory_size();
+}
+
+Match KDTree::to_match(int index, double distance, std::vector<float>& descriptor) const
+{
+	return Match{ (index % h_steps) * step, (index / h_steps) * step, distance, std::move(descriptor) };
 }
 
 std::vector<Match> KDTree::getMatches(const std::vector<float>& descriptor, int num_matches, double approx_ratio) const
 {
-	kd_tree_float::neighbour_array nbrs;
-	kd_ptr->get_neighbours(descriptor.data(), num_matches, nbrs, approx_ratio);
+	if (static_cast<int>(descriptor.size()) != engine->dimension()) throw std::invalid_argument("descriptor");
+	index_engine::hit_array hits;
+	engine->query(descriptor.data(), num_matches, approx_ratio, hits);
+	std::vector<Match> output;
+	for (auto& h : hits)
+		output.push_back(to_match(h.index, h.distance, h.descriptor));
+	return output;
+}
 
+std::vector<Match> KDTree::getMatches(const std::vector<float>& descriptor, int num_matches, double approx_ratio, Patch center, double radius) const
+{
+	if (static_cast<int>(descriptor.size()) != engine->dimension()) throw std::invalid_argument("descriptor");
+	index_engine::grid_disc disc{ h_steps, double(center.x()) / step, double(center.y()) / step, radius / step };
+	index_engine::hit_array hits;
+	engine->query(descriptor.data(), num_matches, approx_ratio, disc, hits);
 	std::vector<Match> output;
+	for (auto& h : hits)
+		output.push_back(to_match(h.index, h.distance, h.descriptor));
+	return output;
+}
 
-	int dim = kd_ptr->get_dimension();
-	for (int i = 0; i < (int)nbrs.size(); ++i)
-	{
-		int idx = kd_ptr->get_indices()[nbrs[i].index];
-		float* dp = kd_ptr->get_points() + nbrs[i].index*dim;
-		std::vector<float> descriptor(dp, dp + dim); assert(descriptor.size() == dim);
-		output.push_back(Match{ (idx % h_steps) * step, (idx / h_steps) * step, nbrs[i].distance, descriptor });
+std::vector<std::vector<Match>> KDTree::getMatches(const std::vector<std::vector<float>>& descriptors, int num_matches, double approx_ratio) const
+{
+	int dim = engine->dimension();
+	std::vector<float> queries;
+	queries.reserve(descriptors.size() * dim);
+	for (auto& d : descriptors){
+		if (static_cast<int>(d.size()) != dim) throw std::invalid_argument("descriptors");
+		queries.insert(queries.end(), d.cbegin(), d.cend());
 	}
+	std::vector<index_engine::hit_array> hits;
+	engine->query(queries.data(), static_cast<int>(descriptors.size()), num_matches, approx_ratio, hits);
+	std::vector<std::vector<Match>> output(hits.size());
+	for (size_t i = 0; i < hits.size(); i++)
+		for (auto& h : hits[i])
+			output[i].push_back(to_match(h.index, h.distance, h.descriptor));
 	return output;
+}
+
+void KDTree::rerank(std::vector<Match>& matches, const std::vector<float>& descriptor, Image frame, const Projector& projector, int num_matches)
+{
+	for (auto& m : matches){
+		Image patch = frame->subImage(std::get<0>(m), std::get<1>(m), projector.patchWidth(), projector.patchHeight());
+		auto d = projector.project(patch);
+		double dist = 0;
+		for (size_t i = 0; i < d.size(); i++) dist += (d[i] - descriptor[i])*(d[i] - descriptor[i]);
+		std::get<2>(m) = dist;
+		std::get<3>(m) = std::move(d);
+	}
+	std::sort(matches.begin(), matches.end(), [](const Match& a, const Match& b){ return std::get<2>(a) < std::get<2>(b); });
+	if (static_cast<int>(matches.size()) > num_matches) matches.resize(num_matches);
 }
\ No newline at end of file
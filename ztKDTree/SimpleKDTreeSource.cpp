@@ -28,7 +28,7 @@ namespace zt{
 	{
 	public:
 		using FrameMsg = tuple<Image, promise<shared_ptr<KDTree>>*, FrameIndex>;
-		implementation(OpenCVFrameSource& video, const Projector& projector, int pixel_step, int number_of_workers);
+		implementation(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, IndexType index_type);
 		~implementation();
 		shared_ptr<KDTree> operator [] (FrameIndex idx) const {return _futures[idx].get();}
 		bool is_ready(FrameIndex idx) const { return _futures[idx].wait_for(duration<int>::zero()) == std::future_status::ready; }
@@ -39,16 +39,17 @@ namespace zt{
 		vector<shared_future<shared_ptr<KDTree>>> _futures;
 		bool _stopping;
 		void run() override;
-		OpenCVFrameSource& _video;
+		FrameSource& _video;
 
 		class KDtreeFactoryAgent : public agent{
 		public:
-			KDtreeFactoryAgent(bounded_queue<FrameMsg>& source, const Projector& projector, int pixel_step) :_source(source), _projector(projector), _pixel_step(pixel_step){ start(); }
+			KDtreeFactoryAgent(bounded_queue<FrameMsg>& source, const Projector& projector, int pixel_step, IndexType index_type) :_source(source), _projector(projector), _pixel_step(pixel_step), _index_type(index_type){ start(); }
 			void run() override;
 		private:
 			bounded_queue<FrameMsg>& _source;
 			const Projector& _projector;
 			int _pixel_step;
+			IndexType _index_type;
 		};
 
 		bounded_queue<FrameMsg> _frame_queue;
@@ -59,8 +60,8 @@ namespace zt{
 }
 using namespace zt;
 
-SimpleKDTreeSource::SimpleKDTreeSource(OpenCVFrameSource& video, const Projector& projector, int pixel_step, int number_of_workers)
-: impl(new implementation(video, projector, pixel_step, number_of_workers)){}
+SimpleKDTreeSource::SimpleKDTreeSource(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, IndexType index_type)
+: impl(new implementation(video, projector, pixel_step, number_of_workers, index_type)){}
 SimpleKDTreeSource::~SimpleKDTreeSource() {}
 shared_ptr<KDTree> SimpleKDTreeSource::operator [] (FrameIndex idx) const { return (*impl)[idx]; }
 
@@ -69,15 +70,17 @@ int SimpleKDTreeSource::num_frames() const { return impl->num_frames(); }
 void SimpleKDTreeSource::subscribe(ProgressHandler handler) { impl->subscribe(handler); }
 
 
-SimpleKDTreeSource::implementation::implementation(OpenCVFrameSource& video, const Projector& projector, int pixel_step, int number_of_workers)
+SimpleKDTreeSource::implementation::implementation(FrameSource& video, const Projector& projector, int pixel_step, int number_of_workers, IndexType index_type)
 : _video(video), _frame_queue(number_of_workers), _stopping(false), _subscription(nullptr), _complete_count(0) {
-	int len = video.numFrames();
+	int len = video.verifiedNumFrames();
 	for (int i = 0; i < len; i++){
 		_promises.push_back(promise<shared_ptr<KDTree>>{});
 		_futures.push_back(_promises[_promises.size() - 1].get_future().share());
 	}
+	// frames queued for the workers and being made into trees, and the frame being read
+	video.reserveFrameBuffers(2 * number_of_workers + 1);
 	for (int w = 0; w < number_of_workers; w++){
-		_workers.push_back(make_shared<KDtreeFactoryAgent>( _frame_queue, projector, pixel_step ));
+		_workers.push_back(make_shared<KDtreeFactoryAgent>( _frame_queue, projector, pixel_step, index_type ));
 	}
 	start();
 }
@@ -91,19 +94,25 @@ SimpleKDTreeSource::implementation::~implementation(){
 
 void SimpleKDTreeSource::implementation::run() {
 	KDTreeSource::ProgressHandler notify;
-	for (FrameIndex i = 0; i < _video.numFrames() && !_stopping; i++){
-		//ostringstream s; s << "starting kd-tree " << i << "...";
-		//_logger(s.str());
+	// the frames are streamed in one request and queued by the decoder; a frame that fails is skipped
+	FrameIndex next = 0;
+	FrameSource::FrameHandler handler = [this, &next, &notify](int i, Image frame){
+		_frame_queue.enqueue(FrameMsg{ frame, &_promises[i], i });
+		FrameIndex prev_count = _complete_count;
+		while (_complete_count < _futures.size() && is_ready(_complete_count)) _complete_count += 1;
+		notify = _subscription;
+		if (notify != nullptr && _complete_count>prev_count) notify(_complete_count);
+		next = i + 1;
+		return !_stopping;
+	};
+	while (next < _video.numFrames() && !_stopping){
 		try{
-			_frame_queue.enqueue(FrameMsg{ _video.getFrame(i), &_promises[i], i });
-			FrameIndex prev_count = _complete_count;
-			while (_complete_count < _futures.size() && is_ready(_complete_count)) _complete_count += 1;
-			notify = _subscription;
-			if (notify != nullptr && _complete_count>prev_count) notify(_complete_count);
+			_video.getFrames(next, _video.numFrames(), handler);
 		}
 		catch (std::exception e){
-			ostringstream s; s << "exception while getting a frame " << i << ": " << e.what();
+			ostringstream s; s << "exception while getting a frame " << next << ": " << e.what();
 			Log::write(s.str());
+			next++;
 		}
 	}
 	// stop all workers
@@ -126,7 +135,7 @@ void SimpleKDTreeSource::implementation::KDtreeFactoryAgent::run() {
 		if (get<2>(m) < 0) break;
 		Image img = get<0>(m);
 		try{
-			get<1>(m)->set_value(make_shared<KDTree>(img, _projector, _pixel_step));
+			get<1>(m)->set_value(make_shared<KDTree>(img, _projector, _pixel_step, _index_type));
 			ostringstream s; s << "done kd-tree " << get<2>(m) << ".";
 			Log::write(s.str());
 		}
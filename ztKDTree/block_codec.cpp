@@ -0,0 +1,303 @@
+#include "block_codec.h"
+
+#include <ppl.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+using namespace zt;
+
+namespace{
+
+	// Blocks of about this many bytes are coded independently.
+	const size_t block_bytes = 256 << 10;
+
+	// Blocks are read in groups of about this many bytes; a group is decoded while the next one is read.
+	const size_t group_bytes = 4 << 20;
+
+	// A block size with this bit set is a block stored as is, which did not get smaller.
+	const unsigned int stored_flag = 0x80000000u;
+
+	// The beginning of a compressed array.
+	struct array_header{
+		unsigned long long count;
+		unsigned int element_size;
+		unsigned int filter;
+		unsigned int row_length;
+		unsigned int block_size;	// raw bytes per block but the last, a multiple of the row size
+		unsigned int blocks;		// followed by the coded size of each block
+		unsigned int reserved;
+	};
+
+	void damaged(){ throw std::runtime_error("Damaged compressed array."); }
+
+	// LZ77 with 64K window. A sequence is a token (literal count and match length - 4 in its nibbles, 15 continues
+	// in the following bytes up to one below 255), the literals, a two byte offset and the rest of the length.
+	// The last sequence has literals only.
+
+	const int hash_bits = 14;
+	const size_t min_match = 4;
+
+	unsigned int read32(const unsigned char* p){ unsigned int v; memcpy(&v, p, sizeof(v)); return v; }
+
+	bool put_length(unsigned char*& op, const unsigned char* oend, size_t length)
+	{
+		for (; length >= 255; length -= 255){
+			if (op == oend) return false;
+			*op++ = 255;
+		}
+		if (op == oend) return false;
+		*op++ = static_cast<unsigned char>(length);
+		return true;
+	}
+
+	bool put_sequence(unsigned char*& op, const unsigned char* oend, const unsigned char* literals, size_t literal_count, size_t offset, size_t match)
+	{
+		if (op == oend) return false;
+		size_t extra = match >= min_match ? match - min_match : 0;
+		unsigned char* token = op++;
+		*token = static_cast<unsigned char>((std::min<size_t>(literal_count, 15) << 4) | (match > 0 ? std::min<size_t>(extra, 15) : 0));
+		if (literal_count >= 15 && !put_length(op, oend, literal_count - 15)) return false;
+		if (static_cast<size_t>(oend - op) < literal_count) return false;
+		memcpy(op, literals, literal_count);
+		op += literal_count;
+		if (match == 0) return true;
+		if (oend - op < 2) return false;
+		*op++ = static_cast<unsigned char>(offset);
+		*op++ = static_cast<unsigned char>(offset >> 8);
+		return extra < 15 || put_length(op, oend, extra - 15);
+	}
+
+	// Returns the coded size, 0 if it would not be smaller than the input.
+	size_t lz_compress(const unsigned char* in, size_t size, unsigned char* out)
+	{
+		std::vector<int> table(size_t(1) << hash_bits, -1);
+		unsigned char* op = out;
+		const unsigned char* oend = out + (size > 0 ? size - 1 : 0);
+		size_t anchor = 0;
+		size_t i = 0;
+		while (i + min_match <= size){
+			unsigned int sequence = read32(in + i);
+			unsigned int h = (sequence * 2654435761u) >> (32 - hash_bits);
+			int candidate = table[h];
+			table[h] = static_cast<int>(i);
+			if (candidate < 0 || i - candidate > 65535 || read32(in + candidate) != sequence){
+				i += 1 + ((i - anchor) >> 6); // skips faster through data that do not compress
+				continue;
+			}
+			size_t match = min_match;
+			while (i + match < size && in[candidate + match] == in[i + match]) match++;
+			if (!put_sequence(op, oend, in + anchor, i - anchor, i - candidate, match)) return 0;
+			i += match;
+			anchor = i;
+		}
+		if (!put_sequence(op, oend, in + anchor, size - anchor, 0, 0)) return 0;
+		return op - out;
+	}
+
+	size_t get_length(const unsigned char*& ip, const unsigned char* iend, size_t length)
+	{
+		unsigned char b;
+		do{
+			if (ip == iend) damaged();
+			b = *ip++;
+			length += b;
+		} while (b == 255);
+		return length;
+	}
+
+	void lz_decompress(const unsigned char* in, size_t size, unsigned char* out, size_t out_size)
+	{
+		const unsigned char* ip = in;
+		const unsigned char* iend = in + size;
+		unsigned char* op = out;
+		unsigned char* oend = out + out_size;
+		while (true){
+			if (ip == iend) damaged();
+			unsigned char token = *ip++;
+			size_t literals = token >> 4;
+			if (literals == 15) literals = get_length(ip, iend, literals);
+			if (literals > static_cast<size_t>(iend - ip) || literals > static_cast<size_t>(oend - op)) damaged();
+			memcpy(op, ip, literals);
+			op += literals;
+			ip += literals;
+			if (ip == iend) break;
+			if (iend - ip < 2) damaged();
+			size_t offset = ip[0] | (ip[1] << 8);
+			ip += 2;
+			size_t match = token & 15;
+			if (match == 15) match = get_length(ip, iend, match);
+			match += min_match;
+			if (offset == 0 || offset > static_cast<size_t>(op - out) || match > static_cast<size_t>(oend - op)) damaged();
+			const unsigned char* from = op - offset;
+			if (offset >= match) memcpy(op, from, match);
+			else for (size_t k = 0; k < match; k++) op[k] = from[k]; // the match repeats itself
+			op += match;
+		}
+		if (op != oend) damaged();
+	}
+
+	unsigned int zigzag(int v){ return (static_cast<unsigned int>(v) << 1) ^ static_cast<unsigned int>(v >> 31); }
+	int unzigzag(unsigned int v){ return static_cast<int>(v >> 1) ^ -static_cast<int>(v & 1); }
+
+	// Filters a block and transposes its bytes into out.
+	void encode_block(const unsigned char* in, size_t size, size_t element_size, block_filter filter, size_t row_bytes, unsigned char* out)
+	{
+		std::vector<unsigned char> filtered;
+		const unsigned char* source = in;
+		if (filter == block_filter::delta){
+			filtered.resize(size);
+			int previous = 0;
+			for (size_t i = 0; i + 4 <= size; i += 4){
+				int v;
+				memcpy(&v, in + i, 4);
+				unsigned int d = zigzag(static_cast<int>(static_cast<unsigned int>(v) - static_cast<unsigned int>(previous)));
+				memcpy(&filtered[i], &d, 4);
+				previous = v;
+			}
+			source = filtered.data();
+		}
+		else if (filter == block_filter::rows){
+			filtered.resize(size);
+			memcpy(filtered.data(), in, std::min(size, row_bytes));
+			for (size_t i = row_bytes; i < size; i++)
+				filtered[i] = in[i] ^ in[i - row_bytes];
+			source = filtered.data();
+		}
+		size_t count = size / element_size;
+		// element by element, so that the reads and the writes of each plane are sequential
+		for (size_t i = 0; i < count; i++)
+		for (size_t b = 0; b < element_size; b++)
+			out[b * count + i] = source[i * element_size + b];
+	}
+
+	// Reverses encode_block.
+	void decode_block(const unsigned char* in, size_t size, size_t element_size, block_filter filter, size_t row_bytes, unsigned char* out)
+	{
+		size_t count = size / element_size;
+		for (size_t i = 0; i < count; i++)
+		for (size_t b = 0; b < element_size; b++)
+			out[i * element_size + b] = in[b * count + i];
+		if (filter == block_filter::delta){
+			int previous = 0;
+			for (size_t i = 0; i + 4 <= size; i += 4){
+				unsigned int d;
+				memcpy(&d, out + i, 4);
+				int v = static_cast<int>(static_cast<unsigned int>(previous) + static_cast<unsigned int>(unzigzag(d)));
+				memcpy(out + i, &v, 4);
+				previous = v;
+			}
+		}
+		else if (filter == block_filter::rows){
+			size_t i = row_bytes;
+			if (row_bytes >= sizeof(unsigned long long)){
+				// a word and the word a row before do not overlap
+				for (; i + sizeof(unsigned long long) <= size; i += sizeof(unsigned long long)){
+					unsigned long long w, previous;
+					memcpy(&w, out + i, sizeof(w));
+					memcpy(&previous, out + i - row_bytes, sizeof(previous));
+					w ^= previous;
+					memcpy(out + i, &w, sizeof(w));
+				}
+			}
+			for (; i < size; i++)
+				out[i] ^= out[i - row_bytes];
+		}
+	}
+
+	// Decodes a block coded with size bytes at in into the raw bytes at out.
+	void decompress_block(const unsigned char* in, unsigned int coded, size_t raw_size, const array_header& h, unsigned char* out)
+	{
+		std::vector<unsigned char> transposed(raw_size);
+		size_t size = coded & ~stored_flag;
+		if (coded & stored_flag){
+			if (size != raw_size) damaged();
+			memcpy(transposed.data(), in, size);
+		}
+		else lz_decompress(in, size, transposed.data(), raw_size);
+		decode_block(transposed.data(), raw_size, h.element_size, static_cast<block_filter>(h.filter), size_t(h.element_size) * h.row_length, out);
+	}
+}
+
+void zt::write_compressed(FILE* f, const void* data, size_t element_size, size_t count, block_filter filter, size_t row_length)
+{
+	if (element_size == 0 || row_length == 0) throw std::invalid_argument("element_size");
+	if (filter == block_filter::delta && element_size != 4) throw std::invalid_argument("filter");
+	size_t row_bytes = element_size * row_length;
+	size_t block_size = std::max<size_t>(1, block_bytes / row_bytes) * row_bytes;
+	size_t total = element_size * count;
+	size_t blocks = (total + block_size - 1) / block_size;
+
+	array_header h = { count, static_cast<unsigned int>(element_size), static_cast<unsigned int>(filter), static_cast<unsigned int>(row_length),
+		static_cast<unsigned int>(block_size), static_cast<unsigned int>(blocks), 0 };
+	std::vector<unsigned int> sizes(blocks);
+	std::vector<std::vector<unsigned char>> coded(blocks);
+	const unsigned char* raw = static_cast<const unsigned char*>(data);
+	concurrency::parallel_for(size_t(0), blocks, [&](size_t b){
+		size_t size = std::min(block_size, total - b * block_size);
+		std::vector<unsigned char> transposed(size);
+		encode_block(raw + b * block_size, size, element_size, filter, row_bytes, transposed.data());
+		coded[b].resize(size);
+		size_t n = lz_compress(transposed.data(), size, coded[b].data());
+		if (n == 0){
+			coded[b].swap(transposed);
+			sizes[b] = static_cast<unsigned int>(size) | stored_flag;
+		}
+		else{
+			coded[b].resize(n);
+			sizes[b] = static_cast<unsigned int>(n);
+		}
+	});
+	fwrite(&h, sizeof(h), 1, f);
+	if (blocks > 0) fwrite(sizes.data(), sizeof(unsigned int), blocks, f);
+	for (auto& c : coded)
+		fwrite(c.data(), 1, c.size(), f);
+}
+
+void zt::read_compressed(FILE* f, void* data, size_t element_size, size_t count)
+{
+	array_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1) damaged();
+	size_t row_bytes = size_t(h.element_size) * h.row_length;
+	size_t total = element_size * count;
+	if (h.count != count || h.element_size != element_size || h.filter > static_cast<unsigned int>(block_filter::rows)
+		|| row_bytes == 0 || h.block_size == 0 || h.block_size % row_bytes != 0
+		|| h.blocks != (total + h.block_size - 1) / h.block_size)
+		damaged();
+	std::vector<unsigned int> sizes(h.blocks);
+	if (h.blocks > 0 && fread(sizes.data(), sizeof(unsigned int), h.blocks, f) != h.blocks) damaged();
+
+	unsigned char* raw = static_cast<unsigned char*>(data);
+	concurrency::task_group decoders;
+	try{
+		for (size_t first = 0; first < h.blocks;){
+			// a group of blocks, read while the previous groups are decoded
+			size_t last = first;
+			size_t group = 0;
+			do{
+				group += sizes[last] & ~stored_flag;
+				last++;
+			} while (last < h.blocks && group < group_bytes);
+			auto buffer = std::make_shared<std::vector<unsigned char>>(group);
+			if (fread(buffer->data(), 1, group, f) != group) damaged();
+			size_t position = 0;
+			for (size_t b = first; b < last; b++){
+				const unsigned char* in = buffer->data() + position;
+				unsigned int coded = sizes[b];
+				size_t size = std::min<size_t>(h.block_size, total - b * h.block_size);
+				unsigned char* out = raw + b * h.block_size;
+				decoders.run([buffer, in, coded, size, &h, out]{ decompress_block(in, coded, size, h, out); });
+				position += coded & ~stored_flag;
+			}
+			first = last;
+		}
+	}
+	catch (...){
+		try{ decoders.wait(); }
+		catch (...){}
+		throw;
+	}
+	decoders.wait(); // rethrows the failure of a block
+}
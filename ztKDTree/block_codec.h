@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdio>
+
+namespace zt{
+
+	// Lossless compression of the large arrays of saved trees: a filter that exposes the redundancy of the
+	// values, a byte transpose that groups the bytes of equal significance and a small LZ77 coder.
+	// Arrays are cut into blocks coded independently, so that blocks are coded and decoded in parallel,
+	// and decoding starts with the first blocks read.
+	enum class block_filter{
+		none,
+		delta,	// differences of consecutive 32 bit integers, for sorted or locally ordered indices
+		rows	// exclusive or with the element a row before, for points stored close to their neighbours
+	};
+
+	// Writes count elements of element_size bytes. A row is row_length elements, used by block_filter::rows.
+	void write_compressed(FILE* f, const void* data, size_t element_size, size_t count, block_filter filter, size_t row_length = 1);
+
+	// Reads an array written by write_compressed into count elements of element_size bytes.
+	// Throws if the array in the file has another size or is damaged.
+	void read_compressed(FILE* f, void* data, size_t element_size, size_t count);
+}
@@ -0,0 +1,148 @@
+#include "brute_force_index.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define ZT_BRUTE_FORCE_USE_SSE
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+	// Blocks scanned by a batch before moving on to the next group, about 32KB of 16-D points.
+	const unsigned int blocks_per_chunk = 64;
+
+	struct farther {
+		bool operator()(brute_force_index::neighbour const& a, brute_force_index::neighbour const& b) const { return a.distance < b.distance; }
+	};
+}
+
+brute_force_index::brute_force_index() : d(0), npoints(0) {}
+
+void brute_force_index::build(unsigned int dim, unsigned int n, float const* points)
+{
+	if (dim == 0 || n == 0) throw std::invalid_argument("brute_force_index: empty point set");
+	d = dim;
+	npoints = n;
+	unsigned int blocks = (n + block - 1) / block;
+	data.assign(size_t(blocks) * d * block, 0.0f);
+	for (unsigned int i = 0; i < n; i++){
+		float* dst = data.data() + size_t(i / block) * d * block + i % block;
+		for (unsigned int k = 0; k < d; k++)
+			dst[k * block] = points[size_t(i) * d + k];
+	}
+}
+
+void brute_force_index::get_point(int index, float* point) const
+{
+	const float* src = data.data() + size_t(index / block) * d * block + index % block;
+	for (unsigned int k = 0; k < d; k++)
+		point[k] = src[k * block];
+}
+
+// Scans the points first..last-1 into the heap of the K best.
+void brute_force_index::scan(float const* query, unsigned int first, unsigned int last, unsigned int K, std::vector<neighbour>& heap) const
+{
+	float worst = heap.size() < K ? FLT_MAX : static_cast<float>(heap.front().distance);
+	float dist[block];
+	unsigned int last_block = (last + block - 1) / block;
+	for (unsigned int b = first / block; b < last_block; b++){
+		const float* p = data.data() + size_t(b) * d * block;
+#ifdef ZT_BRUTE_FORCE_USE_SSE
+		__m128 acc0 = _mm_setzero_ps();
+		__m128 acc1 = _mm_setzero_ps();
+		for (unsigned int k = 0; k < d; k++, p += block){
+			__m128 q = _mm_set1_ps(query[k]);
+			__m128 diff0 = _mm_sub_ps(_mm_loadu_ps(p), q);
+			__m128 diff1 = _mm_sub_ps(_mm_loadu_ps(p + 4), q);
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(diff0, diff0));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(diff1, diff1));
+		}
+		// most blocks have nothing closer than the current worst
+		__m128 limit = _mm_set1_ps(worst);
+		if ((_mm_movemask_ps(_mm_cmplt_ps(acc0, limit)) | _mm_movemask_ps(_mm_cmplt_ps(acc1, limit))) == 0) continue;
+		_mm_storeu_ps(dist, acc0);
+		_mm_storeu_ps(dist + 4, acc1);
+#else
+		for (int j = 0; j < block; j++) dist[j] = 0;
+		for (unsigned int k = 0; k < d; k++, p += block){
+			for (int j = 0; j < block; j++){
+				float diff = p[j] - query[k];
+				dist[j] += diff*diff;
+			}
+		}
+#endif
+		for (int j = 0; j < block; j++){
+			if (!(dist[j] < worst)) continue;
+			unsigned int idx = b * block + j;
+			if (idx < first) continue;
+			if (idx >= last) break; // padding or past the range
+			if (heap.size() == K){
+				std::pop_heap(heap.begin(), heap.end(), farther());
+				heap.pop_back();
+			}
+			heap.push_back(neighbour{ static_cast<int>(idx), dist[j] });
+			std::push_heap(heap.begin(), heap.end(), farther());
+			if (heap.size() == K) worst = static_cast<float>(heap.front().distance);
+		}
+	}
+}
+
+void brute_force_index::get_neighbours(float const* query_point, unsigned int K, neighbour_array& neighbours) const
+{
+	neighbours.resize(0);
+	if (K == 0) return;
+	neighbours.reserve(K);
+	scan(query_point, 0, npoints, K, neighbours);
+	std::sort_heap(neighbours.begin(), neighbours.end(), farther());
+}
+
+void brute_force_index::get_neighbours(float const* query_point, std::vector<std::pair<unsigned int, unsigned int>> const& ranges, unsigned int K, neighbour_array& neighbours) const
+{
+	neighbours.resize(0);
+	if (K == 0) return;
+	neighbours.reserve(K);
+	for (auto& r : ranges)
+		scan(query_point, r.first, std::min(r.second, npoints), K, neighbours);
+	std::sort_heap(neighbours.begin(), neighbours.end(), farther());
+}
+
+void brute_force_index::get_neighbours(float const* query_points, unsigned int count, unsigned int K, std::vector<neighbour_array>& neighbours) const
+{
+	neighbours.assign(count, neighbour_array());
+	if (K == 0) return;
+	unsigned int blocks = (npoints + block - 1) / block;
+	for (unsigned int first = 0; first < blocks; first += blocks_per_chunk){
+		unsigned int last = std::min(blocks, first + blocks_per_chunk);
+		for (unsigned int q = 0; q < count; q++)
+			scan(query_points + size_t(q) * d, first * block, std::min(npoints, last * block), K, neighbours[q]);
+	}
+	for (auto& n : neighbours)
+		std::sort_heap(n.begin(), n.end(), farther());
+}
+
+static const char brute_force_header[] = "brute_force_binary_file\n";
+
+void brute_force_index::save(FILE * f) const
+{
+	fwrite(brute_force_header, 1, sizeof(brute_force_header) - 1, f);
+	unsigned int header[] = { d, npoints };
+	fwrite(header, sizeof(header[0]), 2, f);
+	fwrite(data.data(), sizeof(float), data.size(), f);
+	if (ferror(f)) throw std::runtime_error("brute_force_index: failed to save");
+}
+
+void brute_force_index::load(FILE * f)
+{
+	char word[sizeof(brute_force_header)] = {};
+	if (fread(word, 1, sizeof(brute_force_header) - 1, f) != sizeof(brute_force_header) - 1 || strcmp(word, brute_force_header) != 0)
+		throw std::runtime_error("brute_force_index: bad header");
+	unsigned int header[2];
+	if (fread(header, sizeof(header[0]), 2, f) != 2) throw std::runtime_error("brute_force_index: truncated file");
+	d = header[0]; npoints = header[1];
+	data.resize(size_t((npoints + block - 1) / block) * d * block);
+	if (fread(data.data(), sizeof(float), data.size(), f) != data.size()) throw std::runtime_error("brute_force_index: truncated file");
+}
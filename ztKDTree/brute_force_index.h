@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+/// <summary>
+/// Exact nearest neighbour search by scanning all the points.
+/// The points are stored in blocks of <c>block</c> points, dimension by dimension
+/// (structure of arrays within a block), so that one SIMD load takes the same coordinate
+/// of several points and the squared distances of a whole block accumulate in registers.
+/// Without tree overhead this beats a kd-tree on small frames, and it is the reference for recall tests.
+/// </summary>
+class brute_force_index {
+public:
+	/// Points per block. The last block is padded.
+	static const int block = 8;
+
+	/// Structure used to return nearest neighbours. <c>index</c> is the position of the point in the input array.
+	struct neighbour {
+		int index;
+		double distance;
+	};
+	typedef std::vector<neighbour> neighbour_array;
+
+	brute_force_index();
+
+	/// Copy the points into the blocked layout. The points are not referenced after the call.
+	void build(unsigned int dim, unsigned int npoints, float const* points);
+
+	/// Exact k-nearest neighbour search, closest first.
+	void get_neighbours(float const* query_point, unsigned int K, neighbour_array& neighbours) const;
+
+	/// Exact k-nearest neighbours for <paramref name="count"/> queries stored one after another.
+	/// The queries are scanned together so that every block is loaded once per batch.
+	void get_neighbours(float const* query_points, unsigned int count, unsigned int K, std::vector<neighbour_array>& neighbours) const;
+
+	/// Exact k-nearest neighbours among the points in the given ranges, each a pair of first and one past the last point index.
+	/// Only the blocks holding the ranges are scanned.
+	void get_neighbours(float const* query_point, std::vector<std::pair<unsigned int, unsigned int>> const& ranges, unsigned int K, neighbour_array& neighbours) const;
+
+	/// Copy the point <paramref name="index"/> into <paramref name="point"/> (get_dimension() floats).
+	void get_point(int index, float* point) const;
+
+	int get_dimension() const { return d; }
+	int get_npoints() const { return npoints; }
+	size_t memory_size() const { return data.size() * sizeof(float); }
+
+	void save(FILE * f) const;
+	void load(FILE * f);
+
+private:
+	unsigned int d;
+	unsigned int npoints;
+	std::vector<float> data; // (blocks) x d x block floats
+
+	void scan(float const* query_point, unsigned int first, unsigned int last, unsigned int K, std::vector<neighbour>& heap) const;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <ztKDTree.h>
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace zt{
+
+	class mapped_file;
+
+	// A nearest neighbour search structure over the grid descriptors of one frame.
+	// KDTree computes the descriptors and maps grid indices to pixel offsets; the engine does the rest.
+	class index_engine{
+	public:
+		// A found grid point: its index in the descriptor array, squared distance and (possibly decoded) descriptor.
+		struct hit{
+			int index;
+			double distance;
+			std::vector<float> descriptor;
+		};
+		using hit_array = std::vector<hit>;
+
+		// A disc on the descriptor grid. Grid point i sits in column i % h_steps and row i / h_steps;
+		// the centre and the radius are measured in grid steps.
+		struct grid_disc{
+			int h_steps;
+			double x;
+			double y;
+			double radius;
+			bool contains(int index) const {
+				double dx = index % h_steps - x, dy = index / h_steps - y;
+				return dx*dx + dy*dy <= radius*radius;
+			}
+			// The grid points of the disc among npoints, as [first, last) runs of indices, one per grid row.
+			std::vector<std::pair<unsigned int, unsigned int>> ranges(int npoints) const;
+			// The number of grid points in the ranges.
+			static int count(const std::vector<std::pair<unsigned int, unsigned int>>& ranges);
+		};
+
+		virtual ~index_engine(){}
+
+		virtual IndexType type() const = 0;
+
+		// Build the index from npoints descriptors of dim floats. The engine takes the descriptors over and may keep or release them.
+		virtual void build(int dim, int npoints, std::unique_ptr<std::vector<float>> points, const Projector& projector) = 0;
+
+		// [Approximate] k-nearest neighbours, closest first.
+		virtual void query(const float* descriptor, int K, double approx_ratio, hit_array& hits) const = 0;
+
+		// k-nearest neighbours for count descriptors of dimension() floats stored one after another.
+		// The default runs the queries one by one.
+		virtual void query(const float* descriptors, int count, int K, double approx_ratio, std::vector<hit_array>& hits) const;
+
+		// [Approximate] k-nearest neighbours among the grid points in the disc, closest first.
+		// The default scans the points of a disc of up to a quarter of the grid when the engine gives its points
+		// by grid index, exactly up to the precision the points are kept at. Otherwise it filters unrestricted
+		// queries for more and more neighbours until K of them are in the disc or the whole grid is searched.
+		virtual void query(const float* descriptor, int K, double approx_ratio, const grid_disc& disc, hit_array& hits) const;
+
+		// The descriptor of a grid point as the engine keeps it. False if the engine cannot give it by grid
+		// index; the default.
+		virtual bool point(int index, std::vector<float>& descriptor) const { return false; }
+
+		virtual int dimension() const = 0;
+		virtual int num_points() const = 0;
+
+		// Approximate bytes held by the engine, including descriptors it keeps and mapped data it uses.
+		virtual size_t memory_size() const = 0;
+
+		// A word written before the engine data so that loading can recreate the engine.
+		// Float kd-trees written by earlier versions have no marker.
+		virtual std::string marker() const = 0;
+		virtual void save(FILE*) const = 0;
+		virtual void load(FILE*) = 0;
+
+		// Saves the data in a smaller layout that load decodes, if the engine has one; the default saves as usual.
+		virtual void save_compressed(FILE* f) const { save(f); }
+
+		// Use the engine data at offset in a mapped file in place, keeping the file mapped while the engine lives.
+		// Returns false if the engine cannot use the data without loading them; the default.
+		virtual bool attach(std::shared_ptr<const mapped_file> file, size_t offset){ return false; }
+	};
+
+	// Creates an empty engine of the given type.
+	std::unique_ptr<index_engine> make_index_engine(IndexType type);
+
+	// Creates an empty engine for a marker read from a file, nullptr if the marker is not known.
+	std::unique_ptr<index_engine> make_index_engine(const std::string& marker);
+}
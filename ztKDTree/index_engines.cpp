@@ -0,0 +1,384 @@
+#include "index_engine.h"
+#include "ivfpq_index.h"
+#include "kd_forest.h"
+#include "brute_force_index.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+using namespace zt;
+
+void index_engine::query(const float* descriptors, int count, int K, double approx_ratio, std::vector<hit_array>& hits) const
+{
+	hits.resize(count);
+	for (int i = 0; i < count; i++)
+		query(descriptors + i*dimension(), K, approx_ratio, hits[i]);
+}
+
+std::vector<std::pair<unsigned int, unsigned int>> index_engine::grid_disc::ranges(int npoints) const
+{
+	std::vector<std::pair<unsigned int, unsigned int>> result;
+	int v_steps = npoints / h_steps;
+	int row_first = std::max(0, static_cast<int>(std::ceil(y - radius)));
+	int row_last = std::min(v_steps - 1, static_cast<int>(std::floor(y + radius)));
+	for (int row = row_first; row <= row_last; row++){
+		double half = std::sqrt(std::max(0.0, radius*radius - (row - y)*(row - y)));
+		int col_first = std::max(0, static_cast<int>(std::ceil(x - half)));
+		int col_last = std::min(h_steps - 1, static_cast<int>(std::floor(x + half)));
+		if (col_first <= col_last)
+			result.push_back(std::make_pair(row*h_steps + col_first, row*h_steps + col_last + 1));
+	}
+	return result;
+}
+
+int index_engine::grid_disc::count(const std::vector<std::pair<unsigned int, unsigned int>>& ranges)
+{
+	int n = 0;
+	for (auto& r : ranges) n += static_cast<int>(r.second - r.first);
+	return n;
+}
+
+void index_engine::query(const float* descriptor, int K, double approx_ratio, const grid_disc& disc, hit_array& hits) const
+{
+	auto ranges = disc.ranges(num_points());
+	int in_disc = grid_disc::count(ranges);
+	std::vector<float> p;
+	if (in_disc <= num_points() / 4 && point(0, p)){
+		// squared distances to every point of the disc
+		int dim = dimension();
+		std::vector<std::pair<double, int>> found;
+		found.reserve(in_disc);
+		for (auto& r : ranges){
+			for (unsigned int i = r.first; i < r.second; i++){
+				point(static_cast<int>(i), p);
+				double d = 0;
+				for (int k = 0; k < dim; k++) d += double(p[k] - descriptor[k]) * (p[k] - descriptor[k]);
+				found.push_back(std::make_pair(d, static_cast<int>(i)));
+			}
+		}
+		size_t n = std::min(found.size(), static_cast<size_t>(std::max(0, K)));
+		std::partial_sort(found.begin(), found.begin() + n, found.end());
+		hits.clear();
+		for (size_t j = 0; j < n; j++){
+			hit h{ found[j].second, found[j].first };
+			point(found[j].second, h.descriptor);
+			hits.push_back(std::move(h));
+		}
+		return;
+	}
+	// a few times more neighbours than there are points wanted outside the disc, more until enough are in it
+	int wanted = std::min(K, in_disc);
+	for (int oversample = 4;; oversample *= 4){
+		int asked = static_cast<int>(std::min<long long>(static_cast<long long>(K) * oversample, num_points()));
+		query(descriptor, asked, approx_ratio, hits);
+		hits.erase(std::remove_if(hits.begin(), hits.end(), [&disc](const hit& h){ return !disc.contains(h.index); }), hits.end());
+		if (static_cast<int>(hits.size()) >= wanted || asked >= num_points()) break;
+	}
+	if (static_cast<int>(hits.size()) > K) hits.resize(K);
+}
+
+namespace{
+
+	// Quantised descriptors span this many standard deviations either side of zero.
+	const float quantisation_range = 4.0f;
+
+	// The maximum number of points per kd-tree leaf.
+	const int max_per_leaf = 128;
+
+	// The position in the tree order of each grid point, as trees reorder the points as they build. Made on
+	// the first scan of a disc rather than with the tree, so that a mapped tree opens without reading its
+	// indices; not counted in the memory size of the tree.
+	class tree_positions{
+	public:
+		template<class tree_type>
+		const std::vector<unsigned int>& of(tree_type& kd) const {
+			std::call_once(_made, [this, &kd]{
+				_positions.assign(kd.get_npoints(), 0);
+				for (unsigned int i = 0; i < _positions.size(); i++)
+					_positions[kd.get_indices()[i]] = i;
+			});
+			return _positions;
+		}
+	private:
+		mutable std::once_flag _made;
+		mutable std::vector<unsigned int> _positions;
+	};
+
+	// Float descriptors in a single kd-tree, the tree permutes them in place.
+	// Saved in the aligned layout so that trees can be used straight from mapped files.
+	class kd_tree_engine : public index_engine{
+		std::unique_ptr<kd_tree_float> kd{ new kd_tree_float() };
+		std::unique_ptr<std::vector<float>> features; // when built from data kd will point to data in the vector.
+		std::shared_ptr<const mapped_file> mapping; // when attached kd points into the mapping.
+		tree_positions positions; // for scans of a disc
+	public:
+		IndexType type() const override { return IndexType::Float; }
+
+		void build(int dim, int npoints, std::unique_ptr<std::vector<float>> points, const Projector&) override {
+			features = std::move(points);
+			kd->build(dim, npoints, features->data(), max_per_leaf);
+		}
+
+		void query(const float* descriptor, int K, double approx_ratio, hit_array& hits) const override {
+			kd_tree_float::neighbour_array nbrs;
+			kd->get_neighbours(descriptor, K, nbrs, approx_ratio);
+			int dim = kd->get_dimension();
+			hits.clear();
+			for (auto& nbr : nbrs){
+				float* dp = kd->get_points() + nbr.index*dim;
+				hits.push_back(hit{ static_cast<int>(kd->get_indices()[nbr.index]), nbr.distance, std::vector<float>(dp, dp + dim) });
+			}
+		}
+		using index_engine::query;
+
+		bool point(int index, std::vector<float>& descriptor) const override {
+			auto& position = positions.of(*kd);
+			if (index < 0 || index >= static_cast<int>(position.size())) return false;
+			const float* dp = kd->get_points() + size_t(position[index]) * kd->get_dimension();
+			descriptor.assign(dp, dp + kd->get_dimension());
+			return true;
+		}
+
+		int dimension() const override { return kd->get_dimension(); }
+		int num_points() const override { return static_cast<int>(kd->get_npoints()); }
+		size_t memory_size() const override { return size_t(kd->get_npoints()) * (kd->get_dimension() * sizeof(float) + sizeof(kd_tree_float::index_type)); }
+		std::string marker() const override { return "kd_tree_v2"; }
+		void save(FILE* f) const override { kd->save_aligned(f); }
+		void load(FILE* f) override { kd->load(f); }
+		void save_compressed(FILE* f) const override { kd->save_compressed(f); }
+		bool attach(std::shared_ptr<const mapped_file> file, size_t offset) override {
+			if (offset >= file->size() || !kd->attach(file->data() + offset, file->size() - offset)) return false;
+			mapping = file;
+			return true;
+		}
+	};
+
+	// Descriptors quantised to bytes using the projector eigenvalues.
+	class quantised_engine : public index_engine{
+		std::unique_ptr<kd_tree_byte_scaled> kd{ new kd_tree_byte_scaled() };
+		std::unique_ptr<std::vector<unsigned char>> byte_features; // when built from data kd will point to data in the vector.
+		std::vector<float> q_offset;	// Descriptor value that corresponds to zero byte, per dimension.
+		std::vector<float> q_step;	// Descriptor value that corresponds to one byte increment, per dimension.
+		tree_positions positions; // for scans of a disc
+
+		void quantise(const float* descriptor, unsigned char* q) const {
+			for (size_t d = 0; d < q_step.size(); d++){
+				float v = (descriptor[d] - q_offset[d]) / q_step[d] + 0.5f;
+				q[d] = static_cast<unsigned char>(std::min(255.0f, std::max(0.0f, v)));
+			}
+		}
+
+		void dequantise(const unsigned char* q, std::vector<float>& descriptor) const {
+			descriptor.resize(q_step.size());
+			for (size_t d = 0; d < q_step.size(); d++)
+				descriptor[d] = q_offset[d] + q[d] * q_step[d];
+		}
+
+	public:
+		IndexType type() const override { return IndexType::Quantised; }
+
+		void build(int dim, int npoints, std::unique_ptr<std::vector<float>> points, const Projector& projector) override {
+			// PCA components are zero mean with variance equal to the eigenvalue.
+			q_offset.resize(dim);
+			q_step.resize(dim);
+			std::vector<double> scale(dim);
+			for (int d = 0; d < dim; d++){
+				float sigma = std::sqrt(std::max(projector.get_eigenvalue(d), 1e-12f));
+				q_offset[d] = -quantisation_range * sigma;
+				q_step[d] = 2.0f * quantisation_range * sigma / 255.0f;
+				scale[d] = 1.0 / q_step[d]; // the tree multiplies byte differences by 1/scale
+			}
+			byte_features.reset(new std::vector<unsigned char>(points->size()));
+			for (int i = 0; i < npoints; i++)
+				quantise(points->data() + i*dim, byte_features->data() + i*dim);
+			points.reset(); // release float descriptors
+			kd->build(dim, npoints, byte_features->data(), max_per_leaf, scale.data());
+		}
+
+		void query(const float* descriptor, int K, double approx_ratio, hit_array& hits) const override {
+			int dim = kd->get_dimension();
+			std::vector<unsigned char> q(dim);
+			quantise(descriptor, q.data());
+			kd_tree_byte_scaled::neighbour_array nbrs;
+			kd->get_neighbours(q.data(), K, nbrs, approx_ratio);
+			hits.clear();
+			for (auto& nbr : nbrs){
+				if (nbr.index < 0) continue; // fewer points than requested
+				hit h{ static_cast<int>(kd->get_indices()[nbr.index]), nbr.distance };
+				dequantise(kd->get_points() + nbr.index*dim, h.descriptor);
+				hits.push_back(std::move(h));
+			}
+		}
+		using index_engine::query;
+
+		// dequantised, as the hits of a query are
+		bool point(int index, std::vector<float>& descriptor) const override {
+			auto& position = positions.of(*kd);
+			if (index < 0 || index >= static_cast<int>(position.size())) return false;
+			dequantise(kd->get_points() + size_t(position[index]) * kd->get_dimension(), descriptor);
+			return true;
+		}
+
+		int dimension() const override { return kd->get_dimension(); }
+		int num_points() const override { return static_cast<int>(kd->get_npoints()); }
+		size_t memory_size() const override { return size_t(kd->get_npoints()) * (kd->get_dimension() + sizeof(kd_tree_byte_scaled::index_type)); }
+		std::string marker() const override { return "quantised"; }
+		void save(FILE* f) const override {
+			file_write(q_offset, f);
+			file_write(q_step, f);
+			kd->save(f);
+		}
+		void load(FILE* f) override {
+			file_read(q_offset, f);
+			file_read(q_step, f);
+			kd->load(f);
+		}
+		void save_compressed(FILE* f) const override {
+			file_write(q_offset, f);
+			file_write(q_step, f);
+			kd->save_compressed(f);
+		}
+	};
+
+	// Inverted lists of product-quantised residuals.
+	class pq_engine : public index_engine{
+		ivfpq_index pq;
+	public:
+		IndexType type() const override { return IndexType::ProductQuantised; }
+
+		void build(int dim, int npoints, std::unique_ptr<std::vector<float>> points, const Projector&) override {
+			pq.build(dim, npoints, points->data()); // the codes replace float descriptors
+		}
+
+		void query(const float* descriptor, int K, double approx_ratio, hit_array& hits) const override {
+			ivfpq_index::neighbour_array nbrs;
+			pq.get_neighbours(descriptor, K, nbrs, approx_ratio);
+			hits.clear();
+			for (auto& nbr : nbrs){
+				hit h{ static_cast<int>(pq.get_id(nbr.index)), nbr.distance, std::vector<float>(pq.get_dimension()) };
+				pq.reconstruct(nbr.index, h.descriptor.data());
+				hits.push_back(std::move(h));
+			}
+		}
+		using index_engine::query;
+
+		int dimension() const override { return pq.get_dimension(); }
+		int num_points() const override { return pq.get_npoints(); }
+		size_t memory_size() const override { return pq.memory_size(); }
+		std::string marker() const override { return "ivfpq"; }
+		void save(FILE* f) const override { pq.save(f); }
+		void load(FILE* f) override { pq.load(f); }
+	};
+
+	// Randomised kd-trees sharing the float descriptors.
+	class forest_engine : public index_engine{
+		kd_forest forest;
+		std::unique_ptr<std::vector<float>> features; // the forest references the descriptors in the vector.
+	public:
+		IndexType type() const override { return IndexType::Forest; }
+
+		void build(int dim, int npoints, std::unique_ptr<std::vector<float>> points, const Projector&) override {
+			int num_trees = 4;
+			int max_per_forest_leaf = 64; // the forest visits leaves of several trees so they are kept smaller
+			features = std::move(points);
+			forest.build(dim, npoints, features->data(), num_trees, max_per_forest_leaf);
+		}
+
+		void query(const float* descriptor, int K, double approx_ratio, hit_array& hits) const override {
+			kd_forest::neighbour_array nbrs;
+			forest.get_neighbours(descriptor, K, nbrs, approx_ratio);
+			int dim = forest.get_dimension();
+			hits.clear();
+			for (auto& nbr : nbrs){
+				const float* dp = forest.get_points() + nbr.index*dim; // the forest does not reorder points
+				hits.push_back(hit{ nbr.index, nbr.distance, std::vector<float>(dp, dp + dim) });
+			}
+		}
+		using index_engine::query;
+
+		bool point(int index, std::vector<float>& descriptor) const override {
+			if (index < 0 || index >= forest.get_npoints()) return false;
+			const float* dp = forest.get_points() + size_t(index) * forest.get_dimension();
+			descriptor.assign(dp, dp + forest.get_dimension());
+			return true;
+		}
+
+		int dimension() const override { return forest.get_dimension(); }
+		int num_points() const override { return forest.get_npoints(); }
+		size_t memory_size() const override { return forest.memory_size() + (features ? features->size() * sizeof(float) : 0); }
+		std::string marker() const override { return "forest"; }
+		void save(FILE* f) const override { forest.save(f); }
+		void load(FILE* f) override { forest.load(f); }
+	};
+
+	// Exact search by scanning all the descriptors. The approximation ratio is ignored.
+	class brute_force_engine : public index_engine{
+		brute_force_index bf;
+
+		void to_hits(const brute_force_index::neighbour_array& nbrs, hit_array& hits) const {
+			hits.clear();
+			for (auto& nbr : nbrs){
+				hit h{ nbr.index, nbr.distance, std::vector<float>(bf.get_dimension()) };
+				bf.get_point(nbr.index, h.descriptor.data());
+				hits.push_back(std::move(h));
+			}
+		}
+	public:
+		IndexType type() const override { return IndexType::BruteForce; }
+
+		void build(int dim, int npoints, std::unique_ptr<std::vector<float>> points, const Projector&) override {
+			bf.build(dim, npoints, points->data()); // copied into the blocked layout
+		}
+
+		void query(const float* descriptor, int K, double, hit_array& hits) const override {
+			brute_force_index::neighbour_array nbrs;
+			bf.get_neighbours(descriptor, K, nbrs);
+			to_hits(nbrs, hits);
+		}
+
+		// Scans only the part of each grid row that falls in the disc.
+		void query(const float* descriptor, int K, double, const grid_disc& disc, hit_array& hits) const override {
+			brute_force_index::neighbour_array nbrs;
+			bf.get_neighbours(descriptor, disc.ranges(bf.get_npoints()), K, nbrs);
+			to_hits(nbrs, hits);
+		}
+
+		void query(const float* descriptors, int count, int K, double, std::vector<hit_array>& hits) const override {
+			std::vector<brute_force_index::neighbour_array> nbrs;
+			bf.get_neighbours(descriptors, count, K, nbrs);
+			hits.resize(count);
+			for (int i = 0; i < count; i++)
+				to_hits(nbrs[i], hits[i]);
+		}
+
+		int dimension() const override { return bf.get_dimension(); }
+		int num_points() const override { return bf.get_npoints(); }
+		size_t memory_size() const override { return bf.memory_size(); }
+		std::string marker() const override { return "bruteforce"; }
+		void save(FILE* f) const override { bf.save(f); }
+		void load(FILE* f) override { bf.load(f); }
+	};
+}
+
+std::unique_ptr<index_engine> zt::make_index_engine(IndexType type)
+{
+	switch (type){
+	case IndexType::Quantised: return std::unique_ptr<index_engine>(new quantised_engine());
+	case IndexType::ProductQuantised: return std::unique_ptr<index_engine>(new pq_engine());
+	case IndexType::Forest: return std::unique_ptr<index_engine>(new forest_engine());
+	case IndexType::BruteForce: return std::unique_ptr<index_engine>(new brute_force_engine());
+	default: return std::unique_ptr<index_engine>(new kd_tree_engine());
+	}
+}
+
+std::unique_ptr<index_engine> zt::make_index_engine(const std::string& marker)
+{
+	const IndexType types[] = { IndexType::Float, IndexType::Quantised, IndexType::ProductQuantised, IndexType::Forest, IndexType::BruteForce };
+	for (auto type : types){
+		auto engine = make_index_engine(type);
+		if (engine->marker() == marker) return engine;
+	}
+	return nullptr;
+}
@@ -0,0 +1,328 @@
+#include "ivfpq_index.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// Every x64 CPU we run on has SSSE3; other builds use the scalar scan.
+#if defined(_M_X64) || defined(__SSSE3__)
+#define ZT_IVFPQ_USE_SSSE3
+#include <tmmintrin.h>
+#endif
+
+namespace {
+
+	const unsigned int max_training_points = 65536;
+	const int kmeans_iterations = 10;
+
+	inline float squared_distance(const float* a, const float* b, unsigned int dim)
+	{
+		float sum = 0;
+		for (unsigned int i = 0; i < dim; i++){
+			float diff = a[i] - b[i];
+			sum += diff*diff;
+		}
+		return sum;
+	}
+
+	unsigned int nearest(const float* p, const float* centroids, unsigned int k, unsigned int dim)
+	{
+		unsigned int best = 0;
+		float best_dist = FLT_MAX;
+		for (unsigned int c = 0; c < k; c++){
+			float dist = squared_distance(p, centroids + c*dim, dim);
+			if (dist < best_dist){
+				best_dist = dist;
+				best = c;
+			}
+		}
+		return best;
+	}
+
+	// Lloyd's k-means. Centroids are seeded with evenly spaced points so the result is reproducible.
+	void kmeans(const float* data, unsigned int n, unsigned int dim, unsigned int k, std::vector<float>& centroids)
+	{
+		centroids.resize(k*dim);
+		for (unsigned int c = 0; c < k; c++){
+			const float* p = data + (size_t(c) * n / k) * dim;
+			std::copy(p, p + dim, centroids.begin() + c*dim);
+		}
+		std::vector<double> sum(k*dim);
+		std::vector<unsigned int> count(k);
+		for (int it = 0; it < kmeans_iterations; it++){
+			std::fill(sum.begin(), sum.end(), 0.0);
+			std::fill(count.begin(), count.end(), 0);
+			for (unsigned int i = 0; i < n; i++){
+				const float* p = data + size_t(i)*dim;
+				unsigned int c = nearest(p, centroids.data(), k, dim);
+				count[c] += 1;
+				for (unsigned int t = 0; t < dim; t++) sum[c*dim + t] += p[t];
+			}
+			for (unsigned int c = 0; c < k; c++)
+			if (count[c] > 0) // an empty cluster keeps its centroid
+			for (unsigned int t = 0; t < dim; t++)
+				centroids[c*dim + t] = static_cast<float>(sum[c*dim + t] / count[c]);
+		}
+	}
+
+	// Sums lookup table entries for the 16 points of a code block.
+	// The table holds m rows of 16 bytes, the block holds m/2 rows of 16 bytes with
+	// sub-quantiser 2j in the low and 2j+1 in the high nibble.
+	inline void scan_block(const unsigned char* block_codes, const unsigned char* table, unsigned int m, unsigned short* sums)
+	{
+#ifdef ZT_IVFPQ_USE_SSSE3
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i low_nibble = _mm_set1_epi8(0x0f);
+		__m128i acc_lo = zero;
+		__m128i acc_hi = zero;
+		for (unsigned int j = 0; j < m / 2; j++){
+			__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block_codes + j * 16));
+			__m128i c0 = _mm_and_si128(c, low_nibble);
+			__m128i c1 = _mm_and_si128(_mm_srli_epi16(c, 4), low_nibble);
+			__m128i d0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table + 2 * j * 16)), c0);
+			__m128i d1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table + (2 * j + 1) * 16)), c1);
+			acc_lo = _mm_add_epi16(acc_lo, _mm_unpacklo_epi8(d0, zero));
+			acc_hi = _mm_add_epi16(acc_hi, _mm_unpackhi_epi8(d0, zero));
+			acc_lo = _mm_add_epi16(acc_lo, _mm_unpacklo_epi8(d1, zero));
+			acc_hi = _mm_add_epi16(acc_hi, _mm_unpackhi_epi8(d1, zero));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(sums), acc_lo);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(sums + 8), acc_hi);
+#else
+		for (int lane = 0; lane < 16; lane++) sums[lane] = 0;
+		for (unsigned int j = 0; j < m / 2; j++)
+		for (int lane = 0; lane < 16; lane++){
+			unsigned char c = block_codes[j * 16 + lane];
+			sums[lane] += table[2 * j * 16 + (c & 15)] + table[(2 * j + 1) * 16 + (c >> 4)];
+		}
+#endif
+	}
+
+	struct farther {
+		bool operator()(ivfpq_index::neighbour const& a, ivfpq_index::neighbour const& b) const { return a.distance < b.distance; }
+	};
+}
+
+const unsigned int ivfpq_index::empty_slot;
+
+ivfpq_index::ivfpq_index() : d(0), m(0), nlist(0), npoints(0) {}
+
+int ivfpq_index::code(int slot, unsigned int sub) const
+{
+	unsigned char c = codes[(slot / block) * (m / 2) * block + (sub / 2) * block + slot % block];
+	return sub % 2 == 0 ? (c & 15) : (c >> 4);
+}
+
+void ivfpq_index::build(unsigned int dim, unsigned int n, float const* points, unsigned int nlist_in)
+{
+	if (dim == 0 || n == 0) throw std::invalid_argument("ivfpq_index: empty point set");
+	d = dim;
+	npoints = n;
+	unsigned int msub = (d + dsub - 1) / dsub;
+	m = (msub + 1) & ~1u;
+	if (nlist_in == 0) nlist_in = std::min(256u, std::max(1u, static_cast<unsigned int>(std::sqrt(double(n)) / 2)));
+	nlist = std::min(nlist_in, n);
+
+	// training sample
+	unsigned int stride = std::max(1u, n / max_training_points);
+	unsigned int ns = (n + stride - 1) / stride;
+	std::vector<float> sample(size_t(ns)*d);
+	for (unsigned int s = 0; s < ns; s++)
+		std::copy(points + size_t(s)*stride*d, points + (size_t(s)*stride + 1)*d, sample.begin() + size_t(s)*d);
+
+	kmeans(sample.data(), ns, d, nlist, coarse);
+
+	// residual codebooks, one sub-vector at a time
+	std::vector<unsigned int> sample_list(ns);
+	for (unsigned int s = 0; s < ns; s++) sample_list[s] = nearest(&sample[size_t(s)*d], coarse.data(), nlist, d);
+	codebooks.assign(m*ksub*dsub, 0.0f);
+	std::vector<float> sub(size_t(ns)*dsub);
+	std::vector<float> cb;
+	for (unsigned int j = 0; j < msub; j++){
+		for (unsigned int s = 0; s < ns; s++)
+		for (unsigned int t = 0; t < dsub; t++){
+			unsigned int k = j*dsub + t;
+			sub[s*dsub + t] = k < d ? sample[size_t(s)*d + k] - coarse[sample_list[s] * d + k] : 0.0f;
+		}
+		kmeans(sub.data(), ns, dsub, ksub, cb);
+		std::copy(cb.begin(), cb.end(), codebooks.begin() + j*ksub*dsub);
+	}
+
+	// inverted lists padded to whole blocks
+	std::vector<unsigned int> assign(n);
+	std::vector<unsigned int> count(nlist, 0);
+	for (unsigned int i = 0; i < n; i++){
+		assign[i] = nearest(points + size_t(i)*d, coarse.data(), nlist, d);
+		count[assign[i]] += 1;
+	}
+	list_start.assign(nlist + 1, 0);
+	for (unsigned int l = 0; l < nlist; l++)
+		list_start[l + 1] = list_start[l] + (count[l] + block - 1) / block * block;
+	unsigned int slots = list_start[nlist];
+	ids.assign(slots, empty_slot);
+	codes.assign(size_t(slots) / block * (m / 2) * block, 0);
+
+	std::vector<unsigned int> fill(list_start.begin(), list_start.end() - 1);
+	float residual[dsub];
+	for (unsigned int i = 0; i < n; i++){
+		unsigned int l = assign[i];
+		unsigned int slot = fill[l]++;
+		ids[slot] = i;
+		for (unsigned int j = 0; j < msub; j++){
+			for (unsigned int t = 0; t < dsub; t++){
+				unsigned int k = j*dsub + t;
+				residual[t] = k < d ? points[size_t(i)*d + k] - coarse[l*d + k] : 0.0f;
+			}
+			unsigned char c = static_cast<unsigned char>(nearest(residual, &codebooks[j*ksub*dsub], ksub, dsub));
+			unsigned char& byte = codes[(slot / block) * (m / 2) * block + (j / 2) * block + slot % block];
+			byte |= j % 2 == 0 ? c : (c << 4);
+		}
+	}
+}
+
+void ivfpq_index::reconstruct(int slot, float* point) const
+{
+	unsigned int l = static_cast<unsigned int>(std::upper_bound(list_start.begin(), list_start.end(), static_cast<unsigned int>(slot)) - list_start.begin()) - 1;
+	for (unsigned int k = 0; k < d; k++){
+		unsigned int j = k / dsub;
+		point[k] = coarse[l*d + k] + codebooks[(j*ksub + code(slot, j))*dsub + k % dsub];
+	}
+}
+
+// Squared distances from the residual sub-vectors to every codebook entry, m rows of ksub floats.
+void ivfpq_index::residual_table(float const* residual, float* table) const
+{
+	for (unsigned int j = 0; j < m; j++)
+	for (unsigned int c = 0; c < ksub; c++){
+		float sum = 0;
+		for (unsigned int t = 0; t < dsub; t++){
+			unsigned int k = j*dsub + t;
+			if (k >= d) break; // padding sub-quantisers contribute nothing
+			float diff = residual[k] - codebooks[(j*ksub + c)*dsub + t];
+			sum += diff*diff;
+		}
+		table[j*ksub + c] = sum;
+	}
+}
+
+void ivfpq_index::get_neighbours(float const* query, unsigned int K, neighbour_array& neighbours, double approxRatio) const
+{
+	neighbours.resize(0);
+	if (K == 0) return;
+
+	// rank coarse lists by distance to the query
+	std::vector<std::pair<float, unsigned int>> lists(nlist);
+	for (unsigned int l = 0; l < nlist; l++)
+		lists[l] = std::make_pair(squared_distance(query, &coarse[l*d], d), l);
+	unsigned int nprobe = approxRatio >= 1.0 ? nlist : static_cast<unsigned int>(std::ceil(nlist * approxRatio));
+	nprobe = std::min(nlist, std::max(1u, nprobe));
+	std::partial_sort(lists.begin(), lists.begin() + nprobe, lists.end());
+
+	std::vector<neighbour> heap; // max-heap of the best K so far
+	heap.reserve(K);
+	std::vector<float> residual(d);
+	std::vector<float> table(m*ksub);
+	std::vector<unsigned char> qtable(m*ksub);
+	unsigned short sums[block];
+	const size_t block_bytes = (m / 2) * block;
+
+	for (unsigned int p = 0; p < nprobe; p++){
+		unsigned int l = lists[p].second;
+		for (unsigned int k = 0; k < d; k++) residual[k] = query[k] - coarse[l*d + k];
+		residual_table(residual.data(), table.data());
+
+		// quantise the table to bytes: subtract each row minimum and scale the widest row to 255
+		double bias = 0;
+		float range = 0;
+		for (unsigned int j = 0; j < m; j++){
+			float* row = &table[j*ksub];
+			float mn = *std::min_element(row, row + ksub);
+			float mx = *std::max_element(row, row + ksub);
+			bias += mn;
+			range = std::max(range, mx - mn);
+		}
+		float scale = range > 0 ? 255.0f / range : 0.0f;
+		for (unsigned int j = 0; j < m; j++){
+			float* row = &table[j*ksub];
+			float mn = *std::min_element(row, row + ksub);
+			for (unsigned int c = 0; c < ksub; c++)
+				qtable[j*ksub + c] = static_cast<unsigned char>(std::min(255.0f, (row[c] - mn) * scale + 0.5f));
+		}
+
+		for (unsigned int base = list_start[l]; base < list_start[l + 1]; base += block){
+			scan_block(&codes[base / block * block_bytes], qtable.data(), m, sums);
+			// each byte entry is off by at most half a unit
+			double limit = heap.size() < K ? DBL_MAX : (heap.front().distance - bias) * scale + 0.5 * m;
+			for (unsigned int lane = 0; lane < block; lane++){
+				unsigned int slot = base + lane;
+				if (ids[slot] == empty_slot || sums[lane] > limit) continue;
+				// exact asymmetric distance for the survivors
+				double dist = 0;
+				for (unsigned int j = 0; j < m; j++) dist += table[j*ksub + code(slot, j)];
+				if (heap.size() < K){
+					heap.push_back(neighbour{ static_cast<int>(slot), dist });
+					std::push_heap(heap.begin(), heap.end(), farther());
+				}
+				else if (dist < heap.front().distance){
+					std::pop_heap(heap.begin(), heap.end(), farther());
+					heap.back() = neighbour{ static_cast<int>(slot), dist };
+					std::push_heap(heap.begin(), heap.end(), farther());
+				}
+				else continue;
+				if (heap.size() == K) limit = (heap.front().distance - bias) * scale + 0.5 * m;
+			}
+		}
+	}
+	std::sort_heap(heap.begin(), heap.end(), farther());
+	neighbours.swap(heap);
+}
+
+static const char ivfpq_header[] = "ivfpq_binary_file\n";
+
+template <class T>
+static void write_vector(FILE * f, std::vector<T> const& v)
+{
+	unsigned int n = static_cast<unsigned int>(v.size());
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(v.data(), sizeof(T), v.size(), f);
+}
+
+template <class T>
+static void read_vector(FILE * f, std::vector<T>& v)
+{
+	unsigned int n = 0;
+	if (fread(&n, sizeof(n), 1, f) != 1) throw std::runtime_error("ivfpq_index: truncated file");
+	v.resize(n);
+	if (fread(v.data(), sizeof(T), n, f) != n) throw std::runtime_error("ivfpq_index: truncated file");
+}
+
+void ivfpq_index::save(FILE * f) const
+{
+	fwrite(ivfpq_header, 1, sizeof(ivfpq_header) - 1, f);
+	unsigned int header[] = { d, m, nlist, npoints };
+	fwrite(header, sizeof(header[0]), 4, f);
+	write_vector(f, coarse);
+	write_vector(f, codebooks);
+	write_vector(f, list_start);
+	write_vector(f, ids);
+	write_vector(f, codes);
+	if (ferror(f)) throw std::runtime_error("ivfpq_index: failed to save");
+}
+
+void ivfpq_index::load(FILE * f)
+{
+	char word[sizeof(ivfpq_header)] = {};
+	if (fread(word, 1, sizeof(ivfpq_header) - 1, f) != sizeof(ivfpq_header) - 1 || strcmp(word, ivfpq_header) != 0)
+		throw std::runtime_error("ivfpq_index: bad header");
+	unsigned int header[4];
+	if (fread(header, sizeof(header[0]), 4, f) != 4) throw std::runtime_error("ivfpq_index: truncated file");
+	d = header[0]; m = header[1]; nlist = header[2]; npoints = header[3];
+	read_vector(f, coarse);
+	read_vector(f, codebooks);
+	read_vector(f, list_start);
+	read_vector(f, ids);
+	read_vector(f, codes);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+/// <summary>
+/// Inverted file index with product-quantised residuals (IVF-PQ).
+/// Each point is assigned to the nearest of <c>nlist</c> coarse centroids. The residual to that
+/// centroid is cut into <c>m</c> two-dimensional sub-vectors and every sub-vector is replaced by a
+/// 4-bit index into a 16-entry codebook. With 16-D descriptors a point costs 4 bytes of codes
+/// plus a 4 byte grid index.
+/// Queries visit the closest coarse lists and score the codes through lookup tables
+/// (asymmetric distance computation), 16 points per SIMD shuffle.
+/// </summary>
+class ivfpq_index {
+public:
+	/// Centroids per sub-quantiser; codes are 4 bits wide.
+	static const int ksub = 16;
+
+	/// Points per code block. A block holds one byte per point for each pair of sub-quantisers.
+	static const int block = 16;
+
+	/// Dimensions per sub-vector.
+	static const int dsub = 2;
+
+	/// Structure used to return nearest neighbours.
+	/// <c>index</c> is a slot in the index, use <see>get_id</see> to get the original point index.
+	struct neighbour {
+		int index;
+		double distance;
+	};
+	typedef std::vector<neighbour> neighbour_array;
+
+	ivfpq_index();
+
+	/// Train the quantisers on the points and encode them. The points are not referenced after the call.
+	/// <param name="nlist">Number of coarse lists, 0 chooses a value from the number of points.</param>
+	void build(unsigned int dim, unsigned int npoints, float const* points, unsigned int nlist = 0);
+
+	/// Approximate k-nearest neighbour search.
+	/// <param name="approxRatio">Share of the coarse lists to visit, 1.0 visits them all.</param>
+	void get_neighbours(float const* query_point, unsigned int K, neighbour_array& neighbours, double approxRatio) const;
+
+	/// The original index of the point stored at <paramref name="slot"/>.
+	unsigned int get_id(int slot) const { return ids[slot]; }
+
+	/// Decode the point stored at <paramref name="slot"/> into <paramref name="point"/> (get_dimension() floats).
+	void reconstruct(int slot, float* point) const;
+
+	int get_dimension() const { return d; }
+	int get_npoints() const { return npoints; }
+
+	/// Bytes held by the codes and point indices.
+	size_t memory_size() const { return codes.size() + ids.size() * sizeof(ids[0]); }
+
+	void save(FILE * f) const;
+	void load(FILE * f);
+
+private:
+	unsigned int d;			// dimensionality
+	unsigned int m;			// sub-quantisers, padded to an even number
+	unsigned int nlist;		// coarse lists
+	unsigned int npoints;
+
+	std::vector<float> coarse;		// nlist x d coarse centroids
+	std::vector<float> codebooks;	// m x ksub x dsub residual centroids
+	std::vector<unsigned int> list_start; // nlist+1 slot offsets, each list padded to whole blocks
+	std::vector<unsigned int> ids;	// original point index per slot, empty_slot for padding
+	std::vector<unsigned char> codes; // (slots/block) x (m/2) x block bytes
+
+	static const unsigned int empty_slot = 0xFFFFFFFF;
+
+	int code(int slot, unsigned int sub) const;
+	void residual_table(float const* residual, float* table) const;
+};
@@ -0,0 +1,220 @@
+#include "kd_forest.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <queue>
+#include <random>
+#include <stack>
+#include <stdexcept>
+
+namespace {
+
+	// Variance is estimated on at most this many points of a node.
+	const unsigned int variance_sample = 128;
+
+	struct build_range {
+		int node;
+		unsigned int begin;
+		unsigned int end;
+	};
+
+	struct branch {
+		double dist_to_plane;
+		unsigned int tree;
+		int node;
+		bool operator<(branch const& that) const { return dist_to_plane > that.dist_to_plane; } // closest first
+	};
+
+	struct farther {
+		bool operator()(kd_forest::neighbour const& a, kd_forest::neighbour const& b) const { return a.distance < b.distance; }
+	};
+
+	inline double squared_distance(const float* a, const float* b, unsigned int dim, double dmax)
+	{
+		double sum = 0;
+		for (unsigned int i = 0; i < dim; i++){
+			double diff = a[i] - b[i];
+			sum += diff*diff;
+			if (sum >= dmax) break;
+		}
+		return sum;
+	}
+}
+
+kd_forest::kd_forest() : d(0), npoints(0), points(nullptr) {}
+
+void kd_forest::build(unsigned int dim, unsigned int n, float const* points_in, unsigned int ntrees, unsigned int max_per_leaf, unsigned int top_dims)
+{
+	if (dim == 0 || n == 0 || ntrees == 0) throw std::invalid_argument("kd_forest: empty point set");
+	d = dim;
+	npoints = n;
+	points = points_in;
+	own_points.clear();
+	trees.assign(ntrees, tree());
+	for (unsigned int t = 0; t < ntrees; t++)
+		build_tree(trees[t], std::max(1u, max_per_leaf), std::max(1u, std::min(top_dims, d)), t);
+}
+
+void kd_forest::build_tree(tree& t, unsigned int max_per_leaf, unsigned int top_dims, unsigned int seed)
+{
+	std::mt19937 random(seed);
+	t.indices.resize(npoints);
+	for (unsigned int i = 0; i < npoints; i++) t.indices[i] = i;
+	t.nodes.reserve(2 * (npoints / max_per_leaf + 1));
+	t.nodes.push_back(node());
+
+	std::vector<double> mean(d), var(d);
+	std::vector<unsigned int> dims(d);
+	std::stack<build_range> ranges;
+	ranges.push(build_range{ 0, 0, npoints });
+	while (!ranges.empty()){
+		build_range r = ranges.top();
+		ranges.pop();
+		unsigned int count = r.end - r.begin;
+		if (count <= max_per_leaf){
+			t.nodes[r.node] = node{ -1, 0.0f, static_cast<int>(r.begin), static_cast<int>(r.end) };
+			continue;
+		}
+
+		// variance per dimension over a sample of the node
+		unsigned int stride = std::max(1u, count / variance_sample);
+		unsigned int samples = 0;
+		std::fill(mean.begin(), mean.end(), 0.0);
+		std::fill(var.begin(), var.end(), 0.0);
+		for (unsigned int i = r.begin; i < r.end; i += stride, samples++){
+			const float* p = points + size_t(t.indices[i])*d;
+			for (unsigned int k = 0; k < d; k++){
+				mean[k] += p[k];
+				var[k] += double(p[k])*p[k];
+			}
+		}
+		for (unsigned int k = 0; k < d; k++){
+			mean[k] /= samples;
+			var[k] = var[k] / samples - mean[k] * mean[k];
+			dims[k] = k;
+		}
+		std::partial_sort(dims.begin(), dims.begin() + top_dims, dims.end(), [&](unsigned int a, unsigned int b){ return var[a] > var[b]; });
+		unsigned int split_dim = dims[random() % top_dims];
+
+		// split at the median so the trees stay balanced
+		unsigned int mid = r.begin + count / 2;
+		const float* pts = points;
+		unsigned int dim = d;
+		std::nth_element(t.indices.begin() + r.begin, t.indices.begin() + mid, t.indices.begin() + r.end,
+			[pts, dim, split_dim](unsigned int a, unsigned int b){ return pts[size_t(a)*dim + split_dim] < pts[size_t(b)*dim + split_dim]; });
+		float split_value = points[size_t(t.indices[mid])*d + split_dim];
+
+		int left = static_cast<int>(t.nodes.size());
+		t.nodes.push_back(node());
+		t.nodes.push_back(node());
+		t.nodes[r.node] = node{ static_cast<int>(split_dim), split_value, left, left + 1 };
+		ranges.push(build_range{ left + 1, mid, r.end });
+		ranges.push(build_range{ left, r.begin, mid });
+	}
+}
+
+void kd_forest::get_neighbours(float const* query, unsigned int K, neighbour_array& neighbours, double approxRatio) const
+{
+	neighbours.resize(0);
+	if (K == 0) return;
+	std::vector<neighbour> heap; // max-heap of the best K so far
+	heap.reserve(K);
+	std::priority_queue<branch> queue;
+	for (unsigned int t = 0; t < trees.size(); t++) queue.push(branch{ 0.0, t, 0 });
+
+	while (!queue.empty()){
+		branch b = queue.top();
+		queue.pop();
+		double worst = heap.size() < K ? DBL_MAX : heap.front().distance;
+		// the queue is ordered, so no remaining branch passes the test either
+		if (b.dist_to_plane != 0 && !(b.dist_to_plane < worst*approxRatio)) break;
+
+		// descend to a leaf, queueing the far sides
+		tree const& t = trees[b.tree];
+		const node* n = &t.nodes[b.node];
+		while (n->split_dim >= 0){
+			double diff = query[n->split_dim] - n->split_value;
+			bool on_left = diff <= 0;
+			queue.push(branch{ diff*diff, b.tree, on_left ? n->right : n->left });
+			n = &t.nodes[on_left ? n->left : n->right];
+		}
+
+		for (int i = n->left; i < n->right; i++){
+			unsigned int idx = t.indices[i];
+			double dmax = heap.size() < K ? DBL_MAX : heap.front().distance;
+			double dist = squared_distance(points + size_t(idx)*d, query, d, dmax);
+			if (dist >= dmax) continue;
+			// other trees may have offered the same point already
+			bool seen = false;
+			for (auto& h : heap) if (h.index == static_cast<int>(idx)) { seen = true; break; }
+			if (seen) continue;
+			if (heap.size() == K){
+				std::pop_heap(heap.begin(), heap.end(), farther());
+				heap.pop_back();
+			}
+			heap.push_back(neighbour{ static_cast<int>(idx), dist });
+			std::push_heap(heap.begin(), heap.end(), farther());
+		}
+	}
+	std::sort_heap(heap.begin(), heap.end(), farther());
+	neighbours.swap(heap);
+}
+
+static const char kd_forest_header[] = "kd_forest_binary_file\n";
+
+template <class T>
+static void write_vector(FILE * f, std::vector<T> const& v)
+{
+	unsigned int n = static_cast<unsigned int>(v.size());
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(v.data(), sizeof(T), v.size(), f);
+}
+
+template <class T>
+static void read_vector(FILE * f, std::vector<T>& v)
+{
+	unsigned int n = 0;
+	if (fread(&n, sizeof(n), 1, f) != 1) throw std::runtime_error("kd_forest: truncated file");
+	v.resize(n);
+	if (fread(v.data(), sizeof(T), n, f) != n) throw std::runtime_error("kd_forest: truncated file");
+}
+
+size_t kd_forest::memory_size() const
+{
+	size_t bytes = own_points.size() * sizeof(float);
+	for (auto& t : trees)
+		bytes += t.nodes.size() * sizeof(node) + t.indices.size() * sizeof(unsigned int);
+	return bytes;
+}
+
+void kd_forest::save(FILE * f) const
+{
+	fwrite(kd_forest_header, 1, sizeof(kd_forest_header) - 1, f);
+	unsigned int header[] = { d, npoints, static_cast<unsigned int>(trees.size()) };
+	fwrite(header, sizeof(header[0]), 3, f);
+	fwrite(points, sizeof(float), size_t(d)*npoints, f);
+	for (auto& t : trees){
+		write_vector(f, t.nodes);
+		write_vector(f, t.indices);
+	}
+	if (ferror(f)) throw std::runtime_error("kd_forest: failed to save");
+}
+
+void kd_forest::load(FILE * f)
+{
+	char word[sizeof(kd_forest_header)] = {};
+	if (fread(word, 1, sizeof(kd_forest_header) - 1, f) != sizeof(kd_forest_header) - 1 || strcmp(word, kd_forest_header) != 0)
+		throw std::runtime_error("kd_forest: bad header");
+	unsigned int header[3];
+	if (fread(header, sizeof(header[0]), 3, f) != 3) throw std::runtime_error("kd_forest: truncated file");
+	d = header[0]; npoints = header[1];
+	own_points.resize(size_t(d)*npoints);
+	if (fread(own_points.data(), sizeof(float), own_points.size(), f) != own_points.size()) throw std::runtime_error("kd_forest: truncated file");
+	points = own_points.data();
+	trees.assign(header[2], tree());
+	for (auto& t : trees){
+		read_vector(f, t.nodes);
+		read_vector(f, t.indices);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+/// <summary>
+/// A forest of randomised kd-trees over one array of float points.
+/// Each tree splits on a dimension drawn at random among the few with the largest variance,
+/// so the trees partition the space differently and a point missed by one tree is likely
+/// to sit near the query in another. The trees keep their own index permutations; the points
+/// are neither copied nor reordered.
+/// All trees are searched together, best bin first, from a single priority queue.
+/// </summary>
+class kd_forest {
+public:
+	/// Structure used to return nearest neighbours. <c>index</c> is the position of the point in the input array.
+	struct neighbour {
+		int index;
+		double distance;
+	};
+	typedef std::vector<neighbour> neighbour_array;
+
+	kd_forest();
+
+	/// Build the trees. The points are referenced, not copied, and must outlive the forest.
+	/// <param name="ntrees">Number of randomised trees.</param>
+	/// <param name="top_dims">Split dimensions are drawn among this many dimensions of largest variance.</param>
+	void build(unsigned int dim, unsigned int npoints, float const* points, unsigned int ntrees = 4, unsigned int max_per_leaf = 64, unsigned int top_dims = 5);
+
+	/// [Approximate] k-nearest neighbour search, see <see>kd_tree::get_neighbours</see> for <paramref name="approxRatio"/>.
+	void get_neighbours(float const* query_point, unsigned int K, neighbour_array& neighbours, double approxRatio) const;
+
+	/// Get our pointer to the points. They are owned by the caller, unless the forest was loaded from file.
+	float const* get_points() const { return points; }
+
+	int get_dimension() const { return d; }
+	int get_npoints() const { return npoints; }
+	int get_ntrees() const { return static_cast<int>(trees.size()); }
+
+	/// Bytes held by the trees, and by the points if the forest loaded them.
+	size_t memory_size() const;
+
+	void save(FILE * f) const;
+	void load(FILE * f);
+
+private:
+	struct node {
+		int split_dim;	// negative for leaves
+		float split_value;
+		int left;		// leaf: first position in the tree's index array
+		int right;		// leaf: one past the last position
+	};
+	struct tree {
+		std::vector<node> nodes; // nodes[0] is the root
+		std::vector<unsigned int> indices;
+	};
+
+	unsigned int d;
+	unsigned int npoints;
+	float const* points;
+	std::vector<float> own_points; // storage for loaded forests
+	std::vector<tree> trees;
+
+	void build_tree(tree& t, unsigned int max_per_leaf, unsigned int top_dims, unsigned int seed);
+};
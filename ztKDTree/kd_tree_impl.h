@@ -8,11 +8,14 @@
 #include <queue>
 #include <map>
 #include <memory>
+#include <cstring>
+#include <stdexcept>
 //#include <fstream>
 #include <string>
 
 #include "detachable_vector.h"
 #include "array2d_adaptor.h"
+#include "block_codec.h"
 
 #ifndef ASSERT
 #define ASSERT(x)
@@ -86,6 +89,11 @@ struct kd_tree_impl {
 	void print(std::ostream& s, int node, int indent);
 	void save(FILE * f);
 	void load(FILE * f);
+	void save_aligned(FILE * f);
+	void load_aligned(FILE * f, long long start);
+	bool attach(char const* data, size_t size);
+	void save_compressed(FILE * f);
+	void load_compressed(FILE * f);
 
 };
                                               
@@ -187,6 +195,27 @@ void kd_tree<point_traits, with_scaling>::load(FILE * f)
 	impl->load(f);
 }
 
+template<class point_traits, bool with_scaling>
+void kd_tree<point_traits, with_scaling>::save_aligned(FILE * f)
+{
+	impl->save_aligned(f);
+}
+
+template<class point_traits, bool with_scaling>
+void kd_tree<point_traits, with_scaling>::save_compressed(FILE * f)
+{
+	impl->save_compressed(f);
+}
+
+template<class point_traits, bool with_scaling>
+bool kd_tree<point_traits, with_scaling>::attach(char const* data, size_t size)
+{
+	delete impl;
+	impl = new kd_tree_impl<point_traits, with_scaling>;
+	reset_stats();
+	return impl->attach(data, size);
+}
+
 template<class point_traits, bool with_scaling>
 typename kd_tree<point_traits, with_scaling>::value_type* kd_tree<point_traits, with_scaling>::get_points()
 {
@@ -892,9 +921,10 @@ void kd_tree_impl<point_traits, with_scaling>::print(std::ostream& s, int node,
 // kd_tree_impl::save
 ///////////////////
 
-std::exception* err(std::string const& s)
+// Thrown by value, so that the loaders of trees that catch std::exception rebuild a tree that fails to parse.
+inline std::runtime_error err(std::string const& s)
 {
-	return new std::exception(s.c_str());
+	return std::runtime_error(s);
 }
 
 static void skipword(FILE * s, std::string const & desired_word)
@@ -917,6 +947,54 @@ static void skipword(FILE * s, std::string const & desired_word)
 #undef SKIPWORD_LIMIT
 }
 
+// The first word of the aligned layout, see kd_tree::save_aligned.
+static const char aligned_file_word[] = "kd_tree_binary_file_v2";
+
+// The binary header of the aligned layout. It follows the first line.
+// Array offsets are counted from the first byte of the first line, so a tree can be copied
+// to any position of another file; alignment is only checked when the tree is attached.
+struct kd_tree_aligned_header {
+	enum { arrays = 8 };
+	int typetag;
+	unsigned int d;
+	unsigned long long npoints;
+	unsigned long long nodes;
+	unsigned long long leaves;
+	long long rootnode;
+	unsigned long long offset[arrays]; // split dims, thresholds, left, right, leaf table, scale, indices, points.
+	unsigned long long count[arrays];  // elements in each array.
+	unsigned long long end;            // bytes from the first line to the end of the points.
+};
+
+// The first word of the compressed layout, see kd_tree::save_compressed.
+static const char compressed_file_word[] = "kd_tree_binary_file_z1";
+
+// The binary header of the compressed layout. It follows the first line and is followed by the node arrays
+// as they are and the compressed index and point arrays, see block_codec.h.
+struct kd_tree_compressed_header {
+	int typetag;
+	unsigned int d;
+	unsigned long long npoints;
+	unsigned long long nodes;
+	unsigned long long leaves;
+	long long rootnode;
+};
+
+static const long long kd_tree_line_alignment = 64;
+static const long long kd_tree_page_alignment = 4096;
+
+static std::string readword(FILE * s)
+{
+	std::string word;
+	int c = fgetc(s);
+	while (!(c == EOF || c == ' ' || c == '\t' || c == '\n') && word.size() < 1024)
+	{
+		word += static_cast<char>(c);
+		c = fgetc(s);
+	}
+	return word;
+}
+
 template <class T>
 static void write(FILE * f, detachable_vector<T> const& v)
 {
@@ -1009,7 +1087,17 @@ void kd_tree_impl<point_traits, with_scaling>::load(FILE * f)
 
 	// std::string line;
 	// skipword(f, line);  if (line != "kd_tree_binary_file") throw err("bad header line : " + line);
-	skipword(f, "kd_tree_binary_file");
+	long long start = _ftelli64(f);
+	std::string word = readword(f);
+	if (word == aligned_file_word) {
+		load_aligned(f, start);
+		return;
+	}
+	if (word == compressed_file_word) {
+		load_compressed(f);
+		return;
+	}
+	if (word != "kd_tree_binary_file") throw err("Wanted [kd_tree_binary_file], got [" + word + "]");
 	int typetag_read;
 	sr::fread_int("typetag", typetag_read, f);
 	if (typetag_read != typetag) throw err("bad typetag"); // TODO: better error reporting
@@ -1041,3 +1129,183 @@ void kd_tree_impl<point_traits, with_scaling>::load(FILE * f)
 	points.resize(d * npoints);
 	fread(points.begin(), sizeof(points[0]), d * npoints, f);
 }
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// kd_tree_impl::save_aligned, load_aligned, attach
+///////////////////
+
+// Write zeros up to the next multiple of alignment of the absolute file position and return the position relative to start.
+static unsigned long long pad_to(FILE * f, long long start, long long alignment)
+{
+	long long pos = _ftelli64(f);
+	static const char zeros[4096] = {};
+	long long padding = (alignment - pos % alignment) % alignment;
+	fwrite(zeros, 1, static_cast<size_t>(padding), f);
+	return static_cast<unsigned long long>(pos + padding - start);
+}
+
+template <class T>
+static void write_aligned(FILE * f, long long start, long long alignment, detachable_vector<T> const& v, size_t count,
+	kd_tree_aligned_header& h, int i)
+{
+	h.offset[i] = pad_to(f, start, alignment);
+	h.count[i] = count;
+	fwrite(v.begin(), sizeof(T), count, f);
+}
+
+template <class point_traits, bool with_scaling>
+void kd_tree_impl<point_traits, with_scaling>::save_aligned(FILE * f)
+{
+	long long start = _ftelli64(f);
+	fwrite(aligned_file_word, 1, sizeof(aligned_file_word) - 1, f);
+	fputc('\n', f);
+	kd_tree_aligned_header h = {};
+	h.typetag = typetag;
+	h.d = d;
+	h.npoints = npoints;
+	h.nodes = internalNodesSplitDim.size();
+	h.leaves = leafNodeTable.size();
+	h.rootnode = rootnode;
+	long long header_pos = _ftelli64(f);
+	fwrite(&h, sizeof(h), 1, f); // placeholder, rewritten below with the offsets
+
+	write_aligned(f, start, kd_tree_line_alignment, internalNodesSplitDim, internalNodesSplitDim.size(), h, 0);
+	write_aligned(f, start, kd_tree_line_alignment, internalNodesSplitThreshold, internalNodesSplitThreshold.size(), h, 1);
+	write_aligned(f, start, kd_tree_line_alignment, internalNodesLeft, internalNodesLeft.size(), h, 2);
+	write_aligned(f, start, kd_tree_line_alignment, internalNodesRight, internalNodesRight.size(), h, 3);
+	write_aligned(f, start, kd_tree_line_alignment, leafNodeTable, leafNodeTable.size(), h, 4);
+	write_aligned(f, start, kd_tree_line_alignment, invScaleConstant, with_scaling ? d : 0, h, 5);
+	write_aligned(f, start, kd_tree_page_alignment, indices, npoints, h, 6);
+	write_aligned(f, start, kd_tree_page_alignment, points, size_t(d) * npoints, h, 7);
+	long long end = _ftelli64(f);
+	h.end = static_cast<unsigned long long>(end - start);
+
+	_fseeki64(f, header_pos, SEEK_SET);
+	fwrite(&h, sizeof(h), 1, f);
+	_fseeki64(f, end, SEEK_SET);
+	if (ferror(f)) throw err("kd_tree: failed to save");
+}
+
+template <class T>
+static void read_aligned(FILE * f, long long start, kd_tree_aligned_header const& h, int i, detachable_vector<T>& v)
+{
+	v.resize(static_cast<size_t>(h.count[i]));
+	_fseeki64(f, start + static_cast<long long>(h.offset[i]), SEEK_SET);
+	if (fread(v.begin(), sizeof(T), v.size(), f) != v.size()) throw err("kd_tree: truncated file");
+}
+
+// Reads the aligned layout with stdio, the first word has been read.
+template <class point_traits, bool with_scaling>
+void kd_tree_impl<point_traits, with_scaling>::load_aligned(FILE * f, long long start)
+{
+	kd_tree_aligned_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1) throw err("kd_tree: truncated file");
+	if (h.typetag != typetag) throw err("bad typetag");
+	d = h.d;
+	npoints = static_cast<index_type>(h.npoints);
+	rootnode = static_cast<signed_index_type>(h.rootnode);
+	read_aligned(f, start, h, 0, internalNodesSplitDim);
+	read_aligned(f, start, h, 1, internalNodesSplitThreshold);
+	read_aligned(f, start, h, 2, internalNodesLeft);
+	read_aligned(f, start, h, 3, internalNodesRight);
+	read_aligned(f, start, h, 4, leafNodeTable);
+	if (with_scaling) read_aligned(f, start, h, 5, invScaleConstant);
+	read_aligned(f, start, h, 6, indices);
+	read_aligned(f, start, h, 7, points);
+	_fseeki64(f, start + static_cast<long long>(h.end), SEEK_SET);
+}
+
+template <class T>
+static bool attach_aligned(char const* data, size_t size, kd_tree_aligned_header const& h, int i, detachable_vector<T>& v)
+{
+	if (h.offset[i] > size || h.count[i] > (size - h.offset[i]) / sizeof(T)) return false;
+	char const* p = data + h.offset[i];
+	if (reinterpret_cast<size_t>(p) % sizeof(T) != 0) return false;
+	// the tree never writes to its arrays after building
+	v.attach(reinterpret_cast<T*>(const_cast<char*>(p)), static_cast<size_t>(h.count[i]));
+	return true;
+}
+
+template <class point_traits, bool with_scaling>
+bool kd_tree_impl<point_traits, with_scaling>::attach(char const* data, size_t size)
+{
+	size_t word = sizeof(aligned_file_word) - 1;
+	if (size < word + 1 + sizeof(kd_tree_aligned_header)) return false;
+	if (memcmp(data, aligned_file_word, word) != 0 || data[word] != '\n') return false;
+	kd_tree_aligned_header h;
+	memcpy(&h, data + word + 1, sizeof(h));
+	if (h.typetag != typetag || h.end > size) return false;
+	d = h.d;
+	npoints = static_cast<index_type>(h.npoints);
+	rootnode = static_cast<signed_index_type>(h.rootnode);
+	bool ok = attach_aligned(data, size, h, 0, internalNodesSplitDim)
+		&& attach_aligned(data, size, h, 1, internalNodesSplitThreshold)
+		&& attach_aligned(data, size, h, 2, internalNodesLeft)
+		&& attach_aligned(data, size, h, 3, internalNodesRight)
+		&& attach_aligned(data, size, h, 4, leafNodeTable)
+		&& (!with_scaling || attach_aligned(data, size, h, 5, invScaleConstant))
+		&& attach_aligned(data, size, h, 6, indices)
+		&& attach_aligned(data, size, h, 7, points);
+	return ok && h.count[6] == npoints && h.count[7] == size_t(d) * npoints;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// kd_tree_impl::save_compressed, load_compressed
+///////////////////
+
+template <class T>
+static void read_checked(FILE * f, detachable_vector<T>& v, size_t count)
+{
+	v.resize(count);
+	if (fread(v.begin(), sizeof(T), v.size(), f) != v.size()) throw err("kd_tree: truncated file");
+}
+
+template <class point_traits, bool with_scaling>
+void kd_tree_impl<point_traits, with_scaling>::save_compressed(FILE * f)
+{
+	fwrite(compressed_file_word, 1, sizeof(compressed_file_word) - 1, f);
+	fputc('\n', f);
+	kd_tree_compressed_header h = {};
+	h.typetag = typetag;
+	h.d = d;
+	h.npoints = npoints;
+	h.nodes = internalNodesSplitDim.size();
+	h.leaves = leafNodeTable.size();
+	h.rootnode = rootnode;
+	fwrite(&h, sizeof(h), 1, f);
+	// the nodes take a small part of the tree
+	write(f, internalNodesSplitDim);
+	write(f, internalNodesSplitThreshold);
+	write(f, internalNodesLeft);
+	write(f, internalNodesRight);
+	write(f, leafNodeTable);
+	if (with_scaling)
+		write(f, invScaleConstant);
+	// points of a leaf are stored together and are close to each other
+	zt::write_compressed(f, indices.begin(), sizeof(index_type), npoints, zt::block_filter::delta);
+	zt::write_compressed(f, points.begin(), sizeof(value_type), size_t(d) * npoints, zt::block_filter::rows, d);
+	if (ferror(f)) throw err("kd_tree: failed to save");
+}
+
+// Reads the compressed layout, the first word has been read.
+template <class point_traits, bool with_scaling>
+void kd_tree_impl<point_traits, with_scaling>::load_compressed(FILE * f)
+{
+	kd_tree_compressed_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1) throw err("kd_tree: truncated file");
+	if (h.typetag != typetag) throw err("bad typetag");
+	d = h.d;
+	npoints = static_cast<index_type>(h.npoints);
+	rootnode = static_cast<signed_index_type>(h.rootnode);
+	size_t nodes = static_cast<size_t>(h.nodes);
+	read_checked(f, internalNodesSplitDim, nodes);
+	read_checked(f, internalNodesSplitThreshold, nodes);
+	read_checked(f, internalNodesLeft, nodes);
+	read_checked(f, internalNodesRight, nodes);
+	read_checked(f, leafNodeTable, static_cast<size_t>(h.leaves));
+	if (with_scaling) read_checked(f, invScaleConstant, d);
+	indices.resize(npoints);
+	points.resize(size_t(d) * npoints);
+	zt::read_compressed(f, indices.begin(), sizeof(index_type), npoints);
+	zt::read_compressed(f, points.begin(), sizeof(value_type), size_t(d) * npoints);
+}
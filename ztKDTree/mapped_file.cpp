@@ -0,0 +1,56 @@
+#include "mapped_file.h"
+
+#include <windows.h>
+#include <stdexcept>
+
+using namespace zt;
+
+mapped_file::mapped_file(const std::string& fileName)
+: _file(INVALID_HANDLE_VALUE), _mapping(nullptr), _view(nullptr), _size(0), _offset(0)
+{
+	map(fileName, 0, 0);
+}
+
+mapped_file::mapped_file(const std::string& fileName, long long offset, size_t size)
+: _file(INVALID_HANDLE_VALUE), _mapping(nullptr), _view(nullptr), _size(0), _offset(0)
+{
+	if (offset < 0 || size == 0) throw std::invalid_argument("cannot map an empty range of " + fileName);
+	map(fileName, offset, size);
+}
+
+// Maps from offset to the end of the file if size is 0.
+void mapped_file::map(const std::string& fileName, long long offset, size_t size)
+{
+	_file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (_file == INVALID_HANDLE_VALUE) throw std::runtime_error("cannot open " + fileName);
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(_file, &file_size) || file_size.QuadPart == 0){
+		CloseHandle(_file);
+		throw std::runtime_error("cannot map empty file " + fileName);
+	}
+	if (size == 0) size = static_cast<size_t>(file_size.QuadPart - offset);
+	if (offset + static_cast<long long>(size) > file_size.QuadPart){
+		CloseHandle(_file);
+		throw std::runtime_error("cannot map past the end of " + fileName);
+	}
+	SYSTEM_INFO system;
+	GetSystemInfo(&system);
+	_offset = offset - offset % system.dwAllocationGranularity;
+	_size = static_cast<size_t>(offset - _offset) + size;
+	// copy-on-write: the pages stay shared unless somebody writes to them
+	_mapping = CreateFileMappingA(_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	if (_mapping != nullptr)
+		_view = static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_COPY, static_cast<DWORD>(_offset >> 32), static_cast<DWORD>(_offset & 0xFFFFFFFF), _size));
+	if (_view == nullptr){
+		if (_mapping != nullptr) CloseHandle(_mapping);
+		CloseHandle(_file);
+		throw std::runtime_error("cannot map " + fileName);
+	}
+}
+
+mapped_file::~mapped_file()
+{
+	UnmapViewOfFile(_view);
+	CloseHandle(_mapping);
+	CloseHandle(_file);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+namespace zt{
+
+	// A file, or a part of it, mapped into memory with copy-on-write protection.
+	// Pages are loaded on first access and shared with every other process mapping the same file.
+	class mapped_file{
+	public:
+		// Throws if the file cannot be opened or mapped.
+		explicit mapped_file(const std::string& fileName);
+		// The bytes from offset to offset + size, which must be in the file. The view starts at the allocation
+		// boundary at or before offset, 64 KB on Windows, so that data at page boundaries of the file stays at
+		// page boundaries in memory.
+		mapped_file(const std::string& fileName, long long offset, size_t size);
+		~mapped_file();
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator = (const mapped_file&) = delete;
+
+		const char* data() const { return _view; }
+		size_t size() const { return _size; }
+		// The position of data() in the file.
+		long long offset() const { return _offset; }
+	private:
+		void* _file;
+		void* _mapping;
+		const char* _view;
+		size_t _size;
+		long long _offset;
+
+		void map(const std::string& fileName, long long offset, size_t size);
+	};
+}
@@ -0,0 +1,399 @@
+#include "tree_pack.h"
+#include "mapped_file.h"
+#include <ztLog.h>
+
+#include <io.h>
+#include <share.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+using namespace zt;
+
+namespace{
+
+	// Trees start at page boundaries, see kd_tree_impl.h save_aligned.
+	const long long page_size = 4096;
+
+	// The staging file buffer. Trees are saved element by element, the buffer turns that into large writes.
+	const size_t write_buffer_size = 4 << 20;
+
+	// Opens an existing file for reading and writing or creates it; others may read and map it meanwhile.
+	FILE* open_shared(const std::string& path, bool truncate)
+	{
+		FILE* f = truncate ? nullptr : _fsopen(path.c_str(), "r+b", _SH_DENYNO);
+		if (f == nullptr) f = _fsopen(path.c_str(), "w+b", _SH_DENYNO);
+		if (f == nullptr) throw std::runtime_error("Couldn't open '" + path + "'.");
+		return f;
+	}
+
+	const char table_magic[16] = "zt_tree_pack_2";
+
+	// Word-wise FNV-1a folded to 32 bits, fast enough to check every tree on its first load.
+	// Feed it whole words but for the last part.
+	class running_checksum{
+	public:
+		void add(const char* data, size_t size)
+		{
+			size_t words = size / sizeof(unsigned long long);
+			for (size_t i = 0; i < words; i++){
+				unsigned long long w;
+				memcpy(&w, data + i * sizeof(w), sizeof(w));
+				_h = (_h ^ w) * 1099511628211ULL;
+			}
+			for (size_t i = words * sizeof(unsigned long long); i < size; i++)
+				_h = (_h ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+		}
+		unsigned int value() const { return static_cast<unsigned int>(_h ^ (_h >> 32)); }
+	private:
+		unsigned long long _h = 14695981039346656037ULL;
+	};
+
+	// Sizes of the reads that sum trees from a file and of the copies from the staging file.
+	const size_t checksum_chunk = 1 << 20;
+
+	// A temporary file that the system keeps in memory as far as it can and deletes on closing.
+	FILE* open_staging()
+	{
+		char* name = _tempnam(nullptr, "ztkd");
+		if (name == nullptr) throw std::runtime_error("Couldn't name a temporary file.");
+		FILE* f = _fsopen(name, "w+bTD", _SH_DENYRW);
+		std::string path = name;
+		free(name);
+		if (f == nullptr) throw std::runtime_error("Couldn't open '" + path + "'.");
+		setvbuf(f, nullptr, _IOFBF, write_buffer_size);
+		return f;
+	}
+
+	// 64 bit FNV-1a
+	unsigned long long hash_bytes(const void* data, size_t size, unsigned long long h = 14695981039346656037ULL)
+	{
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++){
+			h ^= p[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	std::string folder_prefix(std::string folder_path, int pixel_step, IndexType index_type)
+	{
+		if (folder_path.size() <= 0) throw std::invalid_argument("folder_path");
+		char& last_char = folder_path[folder_path.size() - 1];
+		std::ostringstream ss; ss << folder_path;
+		if (last_char != '\\' && last_char != '/') ss << "/";
+		ss << pixel_step;
+		if (index_type == IndexType::Quantised) ss << 'q';
+		if (index_type == IndexType::ProductQuantised) ss << 'p';
+		if (index_type == IndexType::Forest) ss << 'f';
+		if (index_type == IndexType::BruteForce) ss << 'b';
+		return ss.str();
+	}
+}
+
+tree_pack::key tree_pack::make_key(FrameSource& video, const Projector& projector, int pixel_step, IndexType index_type)
+{
+	key k = {};
+	k.projector = projector.fingerprint();
+	k.pixel_step = pixel_step;
+	k.index_type = static_cast<int>(index_type);
+	k.num_frames = video.verifiedNumFrames();
+	int size[] = { video.frameWidth(), video.frameHeight() };
+	unsigned long long fingerprint = video.fingerprint();
+	k.video = hash_bytes(&fingerprint, sizeof(fingerprint), hash_bytes(size, sizeof(size)));
+	return k;
+}
+
+std::string tree_pack::base_path(std::string folder_path, const key& k)
+{
+	std::ostringstream ss;
+	ss << folder_prefix(folder_path, k.pixel_step, static_cast<IndexType>(k.index_type)) << '-' << std::hex;
+	ss.width(16);
+	ss.fill('0');
+	ss << hash_bytes(&k, sizeof(k)) << '.';
+	return ss.str();
+}
+
+std::string tree_pack::legacy_base_path(std::string folder_path, int pixel_step, IndexType index_type)
+{
+	return folder_prefix(folder_path, pixel_step, index_type) + '.';
+}
+
+void tree_pack::remove_stale(const std::string& base_path)
+{
+	size_t dash = base_path.rfind('-');
+	size_t slash = base_path.find_last_of("\\/");
+	if (dash == std::string::npos || (slash != std::string::npos && dash < slash)) return;
+	std::string prefix = base_path.substr(0, dash + 1);
+	std::string folder = slash == std::string::npos ? std::string() : base_path.substr(0, slash + 1);
+	for (const char* extension : { "kdp", "kdx" }){
+		_finddata_t found;
+		intptr_t search = _findfirst((prefix + "*." + extension).c_str(), &found);
+		if (search == -1) continue;
+		do{
+			std::string path = folder + found.name;
+			// a pack still mapped by another process stays until the next opening
+			if (path != base_path + extension && path.compare(0, prefix.size(), prefix) == 0 && remove(path.c_str()) == 0)
+				Log::write("Removed the stale kd-tree pack file '" + path + "'.");
+		} while (_findnext(search, &found) == 0);
+		_findclose(search);
+	}
+}
+
+tree_pack::tree_pack(const std::string& base_path, const key& k, bool compress) : _data_path(base_path + "kdp"), _table_path(base_path + "kdx"), _key(k), _data(nullptr), _staging(nullptr), _table(nullptr), _count(0), _compress(compress)
+{
+	remove_stale(base_path);
+	long long table_size = open(false);
+	header h = {};
+	if (table_size > 0 && (fread(&h, sizeof(h), 1, _table) != 1 || memcmp(h.magic, table_magic, sizeof(h.magic)) != 0 || memcmp(&h.k, &_key, sizeof(_key)) != 0)){
+		Log::write("kd-tree pack '" + _data_path + "' does not match the video and the projector, emptied.");
+		fclose(_table);
+		fclose(_data);
+		table_size = open(true);
+	}
+	if (table_size == 0){
+		memcpy(h.magic, table_magic, sizeof(h.magic));
+		h.k = _key;
+		fwrite(&h, sizeof(h), 1, _table);
+		fflush(_table);
+		return;
+	}
+	_fseeki64(_data, 0, SEEK_END);
+	long long data_size = _ftelli64(_data);
+	record r;
+	long long good = 0;
+	while (fread(&r, sizeof(r), 1, _table) == 1){
+		good += 1;
+		if (r.frame < 0 || r.length < 0 || r.offset + r.length > data_size) continue;
+		if (r.frame >= static_cast<int>(_records.size())) _records.resize(r.frame + 1, record{ 0, 0, 0, 0 });
+		if (r.length == 0){
+			// a tree found corrupt, dropped
+			if (_records[r.frame].length > 0) _count -= 1;
+			_records[r.frame].length = 0;
+			continue;
+		}
+		if (_records[r.frame].length == 0) _count += 1;
+		_records[r.frame] = r;
+	}
+	_verified.resize(_records.size(), false);
+	// a record torn by a crash is overwritten by the next one
+	_fseeki64(_table, static_cast<long long>(sizeof(header)) + good * static_cast<long long>(sizeof(record)), SEEK_SET);
+}
+
+long long tree_pack::open(bool truncate)
+{
+	_data = open_shared(_data_path, truncate);
+	setvbuf(_data, nullptr, _IOFBF, write_buffer_size);
+	try{
+		_table = open_shared(_table_path, truncate);
+	}
+	catch (...){
+		fclose(_data);
+		throw;
+	}
+	_fseeki64(_table, 0, SEEK_END);
+	long long size = _ftelli64(_table);
+	_fseeki64(_table, 0, SEEK_SET);
+	return size;
+}
+
+tree_pack::~tree_pack()
+{
+	fclose(_table);
+	for (auto reader : _readers) fclose(reader);
+	if (_staging != nullptr) fclose(_staging);
+	fclose(_data);
+}
+
+bool tree_pack::contains(FrameIndex frame) const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return frame >= 0 && frame < static_cast<int>(_records.size()) && _records[frame].length > 0;
+}
+
+int tree_pack::size() const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return _count;
+}
+
+std::shared_ptr<KDTree> tree_pack::load(FrameIndex frame)
+{
+	record r;
+	bool verified;
+	std::shared_ptr<const mapped_file> mapping;
+	FILE* reader = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		if (frame < 0 || frame >= static_cast<int>(_records.size()) || _records[frame].length == 0){
+			std::ostringstream s; s << "No kd-tree for frame " << frame << " in '" << _data_path << "'.";
+			throw std::invalid_argument(s.str());
+		}
+		r = _records[frame];
+		verified = _verified[frame];
+		if (!_readers.empty()){
+			reader = _readers.back();
+			_readers.pop_back();
+		}
+	}
+	// each concurrent load has a reader of its own
+	if (reader == nullptr) reader = _fsopen(_data_path.c_str(), "rb", _SH_DENYNO);
+	if (reader == nullptr) throw std::runtime_error("Couldn't open '" + _data_path + "' for reading.");
+	// only the tree's own range, which lives as long as the tree does, rather than the whole growing pack
+	try{ mapping = std::make_shared<const mapped_file>(_data_path, r.offset, static_cast<size_t>(r.length)); }
+	catch (const std::exception& e){ Log::write(e.what()); }
+	std::shared_ptr<KDTree> tree;
+	try{
+		if (!verified && checksum(r, reader, mapping.get()) != r.checksum){
+			{
+				std::lock_guard<std::mutex> write_lock(_write_lock);
+				bool drop;
+				{
+					std::lock_guard<std::mutex> lock(_lock);
+					// unless it was written again meanwhile
+					drop = _records[frame].offset == r.offset && _records[frame].length > 0;
+					if (drop){
+						_records[frame].length = 0;
+						_count -= 1;
+					}
+				}
+				if (drop){
+					// for good, so that the next opening neither sums nor drops it again
+					record dropped{ frame, 0, r.offset, 0 };
+					fwrite(&dropped, sizeof(dropped), 1, _table);
+					fflush(_table);
+				}
+			}
+			std::ostringstream s; s << "Corrupt kd-tree for frame " << frame << " in '" << _data_path << "'.";
+			throw std::runtime_error(s.str());
+		}
+		_fseeki64(reader, r.offset, SEEK_SET);
+		tree = std::make_shared<KDTree>(reader, mapping);
+	}
+	catch (...){
+		fclose(reader);
+		throw;
+	}
+	std::lock_guard<std::mutex> lock(_lock);
+	if (!verified && _records[frame].offset == r.offset) _verified[frame] = true;
+	_readers.push_back(reader);
+	return tree;
+}
+
+unsigned int tree_pack::checksum(const record& r, FILE* source, const mapped_file* mapping) const
+{
+	running_checksum sum;
+	if (mapping != nullptr && mapping->offset() <= r.offset && mapping->offset() + static_cast<long long>(mapping->size()) >= r.offset + r.length){
+		sum.add(mapping->data() + (r.offset - mapping->offset()), static_cast<size_t>(r.length));
+		return sum.value();
+	}
+	std::vector<char> buffer(static_cast<size_t>(std::min<long long>(r.length, checksum_chunk)));
+	_fseeki64(source, r.offset, SEEK_SET);
+	for (long long done = 0; done < r.length;){
+		size_t size = static_cast<size_t>(std::min<long long>(r.length - done, buffer.size()));
+		if (fread(buffer.data(), 1, size, source) != size) throw std::runtime_error("Couldn't read '" + _data_path + "'.");
+		sum.add(buffer.data(), size);
+		done += size;
+	}
+	return sum.value();
+}
+
+template<class Writer> tree_pack::record tree_pack::write_locked(FrameIndex frame, Writer write)
+{
+	if (frame < 0) throw std::invalid_argument("frame");
+	// Saves seek back to fill in headers, so the record is summed once it is complete, on its way to the data file.
+	if (_staging == nullptr) _staging = open_staging();
+	rewind(_staging);
+	if (_chsize_s(_fileno(_staging), 0) != 0) throw std::runtime_error("Couldn't write a temporary file.");
+	write(_staging);
+	_fseeki64(_staging, 0, SEEK_END);
+	long long length = _ftelli64(_staging);
+	rewind(_staging);
+	_fseeki64(_data, 0, SEEK_END);
+	long long offset = _ftelli64(_data);
+	for (; offset % page_size != 0; offset++) fputc(0, _data);
+	running_checksum sum;
+	std::vector<char> buffer(static_cast<size_t>(std::min<long long>(length, checksum_chunk)));
+	for (long long done = 0; done < length;){
+		size_t size = static_cast<size_t>(std::min<long long>(length - done, buffer.size()));
+		if (fread(buffer.data(), 1, size, _staging) != size) throw std::runtime_error("Couldn't read a temporary file.");
+		sum.add(buffer.data(), size);
+		fwrite(buffer.data(), 1, size, _data);
+		done += size;
+	}
+	return record{ frame, sum.value(), offset, length };
+}
+
+void tree_pack::commit_locked(std::vector<record>& records)
+{
+	fflush(_data);
+	if (ferror(_data)){
+		clearerr(_data);
+		throw std::runtime_error("Couldn't write to '" + _data_path + "'.");
+	}
+	// records never point to data that a power failure could lose
+	if (_commit(_fileno(_data)) != 0) throw std::runtime_error("Couldn't write to '" + _data_path + "'.");
+	if (!records.empty()) fwrite(records.data(), sizeof(record), records.size(), _table);
+	fflush(_table);
+	std::lock_guard<std::mutex> lock(_lock);
+	for (auto& r : records){
+		if (r.frame >= static_cast<int>(_records.size())){
+			_records.resize(r.frame + 1, record{ 0, 0, 0, 0 });
+			_verified.resize(_records.size(), false);
+		}
+		if (_records[r.frame].length == 0) _count += 1;
+		_records[r.frame] = r;
+		_verified[r.frame] = true;
+	}
+}
+
+void tree_pack::append(FrameIndex frame, const KDTree& tree)
+{
+	std::lock_guard<std::mutex> lock(_write_lock);
+	std::vector<record> records(1, write_locked(frame, [this, &tree](FILE* f){
+		saveName(tree.name(), f); // as KDTree::saveToFile
+		if (_compress) tree.saveCompressedTo(f);
+		else tree.saveTo(f);
+	}));
+	commit_locked(records);
+}
+
+void tree_pack::append(const std::vector<std::pair<FrameIndex, std::shared_ptr<KDTree>>>& trees)
+{
+	std::lock_guard<std::mutex> lock(_write_lock);
+	std::vector<record> records;
+	for (auto& t : trees){
+		const KDTree& tree = *t.second;
+		records.push_back(write_locked(t.first, [this, &tree](FILE* f){
+			saveName(tree.name(), f);
+			if (_compress) tree.saveCompressedTo(f);
+			else tree.saveTo(f);
+		}));
+	}
+	commit_locked(records);
+}
+
+void tree_pack::append_file(FrameIndex frame, const std::string& fileName)
+{
+	// Saved again rather than copied: the padding of the file aligns the points to pages of the file, not of the pack.
+	KDTree tree(fileName);
+	append(frame, tree);
+}
+
+int tree_pack::append_files(const std::string& legacy_base, int num_frames, bool remove_files)
+{
+	int count = 0;
+	for (FrameIndex i = 0; i < num_frames; i++){
+		std::ostringstream fns; fns << legacy_base << i;
+		std::string fn = fns.str();
+		if (_access_s(fn.c_str(), 0) != 0) continue;
+		if (!contains(i)){
+			append_file(i, fn);
+			count += 1;
+		}
+		if (remove_files) remove(fn.c_str());
+	}
+	return count;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <ztKDTree.h>
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace zt{
+
+	class mapped_file;
+
+	// The trees of all frames of a video in one append-only data file "<base>kdp" and a table "<base>kdx"
+	// of fixed size records (frame, checksum, offset, length) into it. A tree is appended to the data file first
+	// and its table record is written after the data are on the disc, so a build interrupted at any point
+	// leaves a pack that loads every tree with a record. Later records of a frame replace earlier ones.
+	// A tree is summed as it goes into the data file and checked against the sum when it is first loaded; a tree
+	// that fails is dropped from the pack by a record of length 0.
+	// Trees start at page boundaries so that float kd-trees are used in place from the mapped data file.
+	// The table starts with the key of the trees; a pack whose key does not match is emptied on opening.
+	// The folder holds the trees of one video, so the packs of the same step and index type with another key,
+	// made of an earlier version of the video or with another projector, are removed on opening.
+	class tree_pack{
+	public:
+		// What the trees depend on. Packs are named after a hash of the key, so that trees made with another
+		// projector or of another video are neither used nor overwritten.
+		struct key{
+			unsigned long long video;		// frame size and FrameSource::fingerprint
+			unsigned long long projector;	// Projector::fingerprint
+			int pixel_step;
+			int index_type;
+			int num_frames;
+			int reserved;
+		};
+		static key make_key(FrameSource& video, const Projector& projector, int pixel_step, IndexType index_type);
+
+		// The common part of the pack file names, "<folder>/<step><type letter>-<key hash>.".
+		static std::string base_path(std::string folder_path, const key& k);
+
+		// The common part of the tree file names of earlier versions, "<folder>/<step><type letter>.", followed by the frame index.
+		static std::string legacy_base_path(std::string folder_path, int pixel_step, IndexType index_type);
+
+		// Opens the pack files or creates empty ones. Trees are appended compressed if compress is true,
+		// see KDTree::saveCompressedTo; a pack can hold trees of both layouts.
+		tree_pack(const std::string& base_path, const key& k, bool compress = false);
+		~tree_pack();
+		tree_pack(const tree_pack&) = delete;
+		tree_pack& operator = (const tree_pack&) = delete;
+
+		bool contains(FrameIndex frame) const;
+		int size() const;	// The number of frames with a tree.
+
+		// Reads the tree of the frame. Throws if the pack has no tree for the frame or the tree is corrupt,
+		// in which case the pack no longer contains it. Loads from several threads run in parallel.
+		std::shared_ptr<KDTree> load(FrameIndex frame);
+
+		// Appends the tree of the frame. Can be called from several threads.
+		void append(FrameIndex frame, const KDTree& tree);
+
+		// Appends the trees of several frames with one flush of each file.
+		void append(const std::vector<std::pair<FrameIndex, std::shared_ptr<KDTree>>>& trees);
+
+		// Appends the tree of a file written by KDTree::saveToFile, loaded and saved again in the layout of the pack.
+		void append_file(FrameIndex frame, const std::string& fileName);
+
+		// Appends the per-frame files "<legacy_base><frame>" the pack does not have yet, optionally removing them.
+		// Nothing tells which video and projector the files were made with, the caller vouches for them.
+		// Returns the number of trees appended.
+		int append_files(const std::string& legacy_base, int num_frames, bool remove_files);
+
+	private:
+		struct record{
+			int frame;
+			unsigned int checksum;	// of the length bytes at offset
+			long long offset;
+			long long length;		// 0 drops the tree of the frame
+		};
+
+		struct header{
+			char magic[16];
+			key k;
+		};
+
+		// Removes the pack files "<prefix>-<hash>.kdp" and ".kdx" of the prefix of base_path but for its own.
+		static void remove_stale(const std::string& base_path);
+		// Opens both files, empty if truncate is true, and returns the table size.
+		long long open(bool truncate);
+		// Calls write with the staging file, pads the data file to a page boundary and copies the record into it,
+		// summing it. The caller holds _write_lock and commits the record.
+		template<class Writer> record write_locked(FrameIndex frame, Writer write);
+		// Flushes the data file and writes the records once the data are on the disc. The caller holds
+		// _write_lock; _lock is taken only to publish the records.
+		void commit_locked(std::vector<record>& records);
+		// Sums the bytes of a record from the mapping or the file.
+		unsigned int checksum(const record& r, FILE* source, const mapped_file* mapping) const;
+
+		std::string _data_path;
+		std::string _table_path;
+		key _key;
+		FILE* _data;	// append, written a record at a time from the staging file
+		FILE* _staging;	// a temporary file a tree is saved to before it goes into the data file, opened on the first write
+		std::vector<FILE*> _readers;	// idle readers for loads, with the default buffer as mapped trees read only a few header lines
+		FILE* _table;	// append
+		std::vector<record> _records; // by frame, length 0 if there is no tree
+		std::vector<bool> _verified; // by frame, the checksum of the record was found right or the tree was written here
+		int _count;
+		bool _compress;
+		mutable std::mutex _lock;	// _records, _verified, _count and _readers
+		std::mutex _write_lock;		// _staging, _data and _table, taken before _lock so that loads never wait for a write
+	};
+}
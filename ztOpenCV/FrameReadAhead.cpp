@@ -0,0 +1,171 @@
+#include <ztFrameSource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <agents.h>
+
+using namespace zt;
+
+// Reads ahead on its own agent, woken with the generation of the prediction to read ahead for.
+class FrameReadAhead::implementation : concurrency::agent{
+public:
+	implementation(FrameSource& source, int frames_ahead);
+	~implementation();
+	Image getFrame(int n);
+	statistics getStatistics() const;
+private:
+	FrameSource& source;
+	const int frames_ahead;
+
+	mutable std::mutex lock; // guards the members below
+	int position;	// of the viewer, -1 before the first frame
+	int previous;	// the position before, kept for a step back
+	int step;		// the predicted move, never 0
+	std::map<int, Image> frames; // the frames of the position, the one before and those read ahead
+	statistics stats;
+
+	// Changed on every move; the reading ahead for an older one ends.
+	std::atomic<int> generation;
+	// a generation to read ahead for, -1 stops the agent
+	concurrency::unbounded_buffer<int> wakeups;
+
+	// The frames predicted after the position, the nearest first. The caller holds the lock.
+	std::vector<int> predicted_locked() const;
+	// Keeps a frame read ahead for a generation. False once the generation is not the current one.
+	bool keep(int gen, int n, Image frame);
+	void run() override;
+};
+
+FrameReadAhead::implementation::implementation(FrameSource& source, int frames_ahead)
+: source(source), frames_ahead(frames_ahead > 1 ? frames_ahead : 1), position(-1), previous(-1), step(1)
+{
+	stats = statistics{};
+	generation = 0;
+	// frames dropped after a jump are decoded into again
+	source.reserveFrameBuffers(this->frames_ahead + 2);
+	start();
+}
+
+FrameReadAhead::implementation::~implementation()
+{
+	generation++;
+	concurrency::send(wakeups, -1);
+	agent::wait(this);
+}
+
+std::vector<int> FrameReadAhead::implementation::predicted_locked() const
+{
+	std::vector<int> predicted;
+	int count = source.numFrames();
+	for (int k = 1; k <= frames_ahead; k++){
+		int n = position + k * step;
+		if (n < 0 || n >= count) break;
+		predicted.push_back(n);
+	}
+	return predicted;
+}
+
+Image FrameReadAhead::implementation::getFrame(int n)
+{
+	Image frame;
+	int gen = -1;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (n != position){
+			int moved = n - position;
+			if (position >= 0 && std::abs(moved) <= max_step) step = moved;
+			else step = step > 0 ? 1 : -1;
+			previous = position;
+			position = n;
+			gen = ++generation;
+			// the frames no longer predicted are dropped
+			std::vector<int> predicted = predicted_locked();
+			for (auto it = frames.begin(); it != frames.end();){
+				if (it->first == position || it->first == previous || std::find(predicted.begin(), predicted.end(), it->first) != predicted.end()) ++it;
+				else it = frames.erase(it);
+			}
+		}
+		auto it = frames.find(n);
+		if (it != frames.end()){
+			stats.hits++;
+			frame = it->second;
+		}
+		else stats.misses++;
+	}
+	// on a miss the reading ahead waits for the frame, so as not to queue before it with the decoder
+	if (frame){
+		if (gen >= 0) concurrency::send(wakeups, gen);
+		return frame;
+	}
+	frame = source.getFrame(n);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (position == n) frames[n] = frame;
+	}
+	if (gen >= 0) concurrency::send(wakeups, gen);
+	return frame;
+}
+
+bool FrameReadAhead::implementation::keep(int gen, int n, Image frame)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (gen != generation) return false;
+	if (frames.count(n) == 0){
+		std::vector<int> predicted = predicted_locked();
+		if (std::find(predicted.begin(), predicted.end(), n) != predicted.end()){
+			frames[n] = frame;
+			stats.frames_read++;
+		}
+	}
+	return true;
+}
+
+void FrameReadAhead::implementation::run()
+{
+	while (true){
+		int gen = concurrency::receive(wakeups);
+		if (gen < 0) break;
+		if (gen != generation) continue; // moved on meanwhile
+		std::vector<int> wanted;
+		bool in_order;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for (int n : predicted_locked())
+				if (frames.count(n) == 0) wanted.push_back(n);
+			// Frame by frame a video that decodes in order is read on from the earliest frame wanted, also
+			// when the viewer steps back; other moves take each frame by itself.
+			in_order = !source.randomAccess() && std::abs(step) == 1;
+		}
+		if (wanted.empty()) continue;
+		auto keep_frame = [this, gen](int n, Image frame){ return keep(gen, n, frame); };
+		try{
+			if (in_order){
+				auto range = std::minmax_element(wanted.begin(), wanted.end());
+				source.getFrames(*range.first, *range.second + 1, keep_frame);
+			}
+			else{
+				for (int n : wanted)
+					if (!keep_frame(n, source.getFrame(n))) break;
+			}
+		}
+		catch (...){
+			// the viewer gets the exception when it asks for the frame
+		}
+	}
+	done();
+}
+
+FrameReadAhead::statistics FrameReadAhead::implementation::getStatistics() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return stats;
+}
+
+FrameReadAhead::FrameReadAhead(FrameSource& source, int frames_ahead) : impl(new implementation(source, frames_ahead)) {}
+FrameReadAhead::~FrameReadAhead() {}
+Image FrameReadAhead::getFrame(int frameNo) { return impl->getFrame(frameNo); }
+FrameReadAhead::statistics FrameReadAhead::readAheadStatistics() const { return impl->getStatistics(); }
@@ -0,0 +1,121 @@
+#include <ztFrameSource.h>
+#include <OpenCVFrameSource.h>
+
+#include <windows.h>
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <stdexcept>
+#include <vector>
+
+using namespace zt;
+
+namespace{
+	// 64 bit FNV-1a
+	unsigned long long hash_bytes(const void* data, size_t size, unsigned long long h = 14695981039346656037ULL)
+	{
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++){
+			h ^= p[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	struct file_closer{ void operator()(FILE* f) const { fclose(f); } };
+}
+
+std::future<Image> FrameSource::requestFrame(int frameNo) const
+{
+	std::promise<Image> frame;
+	try{
+		frame.set_value(getFrame(frameNo));
+	}
+	catch (...){
+		frame.set_exception(std::current_exception());
+	}
+	return frame.get_future();
+}
+
+void FrameSource::getFrames(int first, int last, const FrameHandler& handler) const
+{
+	// as many frames requested ahead as are decoded at once
+	size_t depth = numDecoders() > 1 ? static_cast<size_t>(numDecoders()) : 1;
+	std::deque<std::future<Image>> ahead;
+	int requested = first;
+	for (int n = first; n < last; n++){
+		while (ahead.size() < depth && requested < last) ahead.push_back(requestFrame(requested++));
+		Image frame = ahead.front().get();
+		ahead.pop_front();
+		if (!handler(n, frame)) break;
+	}
+}
+
+namespace{
+	// rounds towards minus infinity, as pixels left of or above the crop are
+	int floor_div(int a, int b){ return a >= 0 ? a / b : -((b - 1 - a) / b); }
+}
+
+Patch FrameSource::videoLocation(Patch frame_location) const
+{
+	int scale = videoScale();
+	Patch offset = videoOffset();
+	return Patch(frame_location.x() * scale + offset.x(), frame_location.y() * scale + offset.y());
+}
+
+Patch FrameSource::frameLocation(Patch video_location) const
+{
+	int scale = videoScale();
+	Patch offset = videoOffset();
+	return Patch(floor_div(video_location.x() - offset.x(), scale), floor_div(video_location.y() - offset.y(), scale));
+}
+
+unsigned long long FrameSource::fingerprint() const
+{
+	const int frames = 4;
+	int size[] = { frameWidth(), frameHeight(), verifiedNumFrames() };
+	unsigned long long h = hash_bytes(size, sizeof(size));
+	// in order from the first frame, which every decoder decodes alike, rather than after seeks
+	getFrames(0, std::min(frames, size[2]), [&h](int, Image frame){
+		int pixel_size = static_cast<int>(frame->pixel_size());
+		h = hash_bytes(&pixel_size, sizeof(pixel_size), h);
+		for (int row = 0; row < frame->height(); row++)
+			h = hash_bytes(frame->data(row), frame->width() * frame->pixel_size(), h);
+		return true;
+	});
+	return h;
+}
+
+unsigned long long FrameSource::fileFingerprint(const std::string& path)
+{
+	const long long head_bytes = 64 << 10, sample_bytes = 4 << 10;
+	const int samples = 32;
+	FILE* f = nullptr;
+	if (fopen_s(&f, path.c_str(), "rb") != 0) throw std::runtime_error("cannot read " + path);
+	std::unique_ptr<FILE, file_closer> closer(f);
+	_fseeki64(f, 0, SEEK_END);
+	long long size = _ftelli64(f);
+	unsigned long long h = hash_bytes(&size, sizeof(size));
+	std::vector<char> buffer(static_cast<size_t>(head_bytes));
+	auto add = [&](long long offset, long long length){
+		size_t n = static_cast<size_t>(std::min(length, size - offset));
+		if (_fseeki64(f, offset, SEEK_SET) != 0 || fread(buffer.data(), 1, n, f) != n) throw std::runtime_error("cannot read " + path);
+		h = hash_bytes(buffer.data(), n, h);
+	};
+	// the header of the container and samples of the rest up to its end, where an index may be
+	add(0, head_bytes);
+	long long span = std::max(0LL, size - head_bytes - sample_bytes);
+	for (int s = 0; s < samples && size > head_bytes; s++)
+		add(head_bytes + span * s / (samples - 1), sample_bytes);
+	return h;
+}
+
+std::unique_ptr<FrameSource> FrameSource::open(const std::string& path, int decoders, bool fast_open)
+{
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		return std::unique_ptr<FrameSource>(new ImageSequenceFrameSource(path, 25, default_cache_bytes, decoders > 1 ? decoders : 0));
+	if (RawFrameSource::isRawFile(path))
+		return std::unique_ptr<FrameSource>(new RawFrameSource(path));
+	return std::unique_ptr<FrameSource>(new OpenCVFrameSource(path, default_cache_bytes, decoders, fast_open));
+}
@@ -0,0 +1,237 @@
+#include <ztFrameSource.h>
+#include "OpenCVImage.h"
+
+#include <opencv2/highgui/highgui.hpp>
+#define NOMINMAX
+#include <windows.h>
+#include <ppl.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+using namespace zt;
+
+namespace{
+
+	bool is_image_file(const std::string& name)
+	{
+		static const char* const extensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff" };
+		auto dot = name.find_last_of('.');
+		if (dot == std::string::npos) return false;
+		std::string extension = name.substr(dot);
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char c){ return static_cast<char>(tolower(static_cast<unsigned char>(c))); });
+		for (auto e : extensions)
+			if (extension == e) return true;
+		return false;
+	}
+
+	// Compares runs of digits by value and other characters regardless of case.
+	bool name_before(const std::string& a, const std::string& b)
+	{
+		size_t i = 0, j = 0;
+		while (i < a.size() && j < b.size()){
+			if (isdigit(static_cast<unsigned char>(a[i])) && isdigit(static_cast<unsigned char>(b[j]))){
+				size_t i0 = i, j0 = j;
+				while (i < a.size() && isdigit(static_cast<unsigned char>(a[i]))) i++;
+				while (j < b.size() && isdigit(static_cast<unsigned char>(b[j]))) j++;
+				std::string x = a.substr(i0, i - i0), y = b.substr(j0, j - j0);
+				x.erase(0, std::min(x.find_first_not_of('0'), x.size()));
+				y.erase(0, std::min(y.find_first_not_of('0'), y.size()));
+				if (x.size() != y.size()) return x.size() < y.size();
+				if (x != y) return x < y;
+				continue;
+			}
+			int x = tolower(static_cast<unsigned char>(a[i++])), y = tolower(static_cast<unsigned char>(b[j++]));
+			if (x != y) return x < y;
+		}
+		return a.size() - i < b.size() - j;
+	}
+
+	std::vector<std::string> list_images(const std::string& folder_path)
+	{
+		std::vector<std::string> names;
+		WIN32_FIND_DATAA found;
+		HANDLE search = FindFirstFileA((folder_path + "\\*").c_str(), &found);
+		if (search == INVALID_HANDLE_VALUE) return names;
+		do{
+			if ((found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0 && is_image_file(found.cFileName))
+				names.push_back(found.cFileName);
+		} while (FindNextFileA(search, &found));
+		FindClose(search);
+		std::sort(names.begin(), names.end(), name_before);
+		return names;
+	}
+}
+
+class ImageSequenceFrameSource::implementation{
+public:
+	implementation(const std::string& folder_path, double fps, size_t cache_bytes, int decoders);
+	~implementation();
+
+	std::string folder;
+	std::vector<std::string> names;
+	int width, height;
+	double fps;
+	int decoders;
+
+	// Returns the frame from the cache, joins the request of a frame being decoded or queues a new one.
+	std::future<Image> request(int n);
+	decode_statistics getStatistics() const;
+
+private:
+	// Frames waiting for a decoder, in the order they were requested, and the requests of each frame.
+	std::deque<int> waiting;
+	std::unordered_map<int, std::vector<std::promise<Image>>> requests;
+	int running;
+	concurrency::task_group tasks;
+
+	// decoded frames, the most recently used first; all frames are of the same size
+	struct cache_entry{
+		Image frame;
+		std::list<int>::iterator position; // in lru
+	};
+	std::unordered_map<int, cache_entry> cache;
+	std::list<int> lru;
+	size_t max_cached;
+	void insert_locked(int, Image);
+
+	decode_statistics stats;
+	mutable std::mutex lock; // guards all of the above
+
+	Image decode(int n);
+	// Decodes waiting frames until there are none.
+	void decode_waiting();
+};
+
+ImageSequenceFrameSource::implementation::implementation(const std::string& folder_path, double fps, size_t cache_bytes, int decoders)
+: folder(folder_path), names(list_images(folder_path)), width(0), height(0), fps(fps),
+decoders(decoders > 0 ? decoders : static_cast<int>(concurrency::GetProcessorCount())), running(0), max_cached(1)
+{
+	stats = decode_statistics{};
+	if (names.empty()) return;
+	// the size of the first image is that of all
+	Image first = decode(0);
+	width = first->width();
+	height = first->height();
+	max_cached = std::max<size_t>(1, cache_bytes / (static_cast<size_t>(first->stride()) * height));
+	std::lock_guard<std::mutex> guard(lock);
+	insert_locked(0, first);
+}
+
+ImageSequenceFrameSource::implementation::~implementation()
+{
+	{
+		// the requests of frames not started yet are broken
+		std::lock_guard<std::mutex> guard(lock);
+		for (int n : waiting) requests.erase(n);
+		waiting.clear();
+	}
+	tasks.wait();
+}
+
+Image ImageSequenceFrameSource::implementation::decode(int n)
+{
+	std::string file = folder + "\\" + names[n];
+	auto start = std::chrono::steady_clock::now();
+	cv::Mat image = cv::imread(file, CV_LOAD_IMAGE_COLOR);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (image.empty()) throw std::runtime_error("cannot read image " + file);
+	if (width > 0 && (image.cols != width || image.rows != height)) throw std::runtime_error("image of another size " + file);
+	std::lock_guard<std::mutex> guard(lock);
+	stats.frames_decoded++;
+	stats.buffers_allocated++; // by imread
+	stats.decode_seconds += seconds;
+	return std::make_shared<OpenCVImage>(image);
+}
+
+std::future<Image> ImageSequenceFrameSource::implementation::request(int n)
+{
+	std::promise<Image> result;
+	std::future<Image> future = result.get_future();
+	if (n < 0 || n >= static_cast<int>(names.size())){
+		result.set_exception(std::make_exception_ptr(std::out_of_range("no such frame in the image sequence")));
+		return future;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	auto cached = cache.find(n);
+	if (cached != cache.end()){
+		lru.splice(lru.begin(), lru, cached->second.position);
+		result.set_value(cached->second.frame);
+		return future;
+	}
+	auto& frame_requests = requests[n];
+	frame_requests.push_back(std::move(result));
+	if (frame_requests.size() == 1){
+		waiting.push_back(n);
+		if (running < decoders){
+			running++;
+			tasks.run([this]{ decode_waiting(); });
+		}
+	}
+	return future;
+}
+
+void ImageSequenceFrameSource::implementation::decode_waiting()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (!waiting.empty()){
+		int n = waiting.front();
+		waiting.pop_front();
+		guard.unlock();
+		Image frame;
+		std::exception_ptr error;
+		try{
+			frame = decode(n);
+		}
+		catch (...){
+			error = std::current_exception();
+		}
+		guard.lock();
+		if (frame) insert_locked(n, frame);
+		std::vector<std::promise<Image>> done = std::move(requests[n]);
+		requests.erase(n);
+		guard.unlock();
+		for (auto& r : done){
+			if (frame) r.set_value(frame);
+			else r.set_exception(error);
+		}
+		guard.lock();
+	}
+	running--;
+}
+
+void ImageSequenceFrameSource::implementation::insert_locked(int n, Image frame)
+{
+	if (cache.count(n) > 0) return;
+	lru.push_front(n);
+	cache[n] = cache_entry{ frame, lru.begin() };
+	while (lru.size() > max_cached){
+		cache.erase(lru.back());
+		lru.pop_back();
+	}
+}
+
+ImageSequenceFrameSource::decode_statistics ImageSequenceFrameSource::implementation::getStatistics() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return stats;
+}
+
+ImageSequenceFrameSource::ImageSequenceFrameSource(std::string folder_path, double fps, size_t cache_bytes, int decoders)
+: impl(new implementation(folder_path, fps, cache_bytes, decoders)) {}
+ImageSequenceFrameSource::~ImageSequenceFrameSource() {}
+int ImageSequenceFrameSource::frameWidth() const { return impl->width; }
+int ImageSequenceFrameSource::frameHeight() const { return impl->height; }
+int ImageSequenceFrameSource::numFrames() const { return static_cast<int>(impl->names.size()); }
+double ImageSequenceFrameSource::framesPerSecond() const { return impl->fps; }
+std::string ImageSequenceFrameSource::fileName(int frameNo) const { return impl->folder + "\\" + impl->names.at(frameNo); }
+Image ImageSequenceFrameSource::getFrame(int frameNo) const { return impl->request(frameNo).get(); }
+std::future<Image> ImageSequenceFrameSource::requestFrame(int frameNo) const { return impl->request(frameNo); }
+int ImageSequenceFrameSource::numDecoders() const { return impl->decoders; }
+ImageSequenceFrameSource::decode_statistics ImageSequenceFrameSource::statistics() const { return impl->getStatistics(); }
@@ -1,39 +1,75 @@
 #include <OpenCVFrameSource.h>
 #include "OpenCVImage.h"
+#include "keyframe_index.h"
+#include "frame_pool.h"
 
 #include <opencv2/highgui/highgui.hpp> 
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <deque>
 #include <future>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <agents.h>
 
 
 namespace zt {
-	class OpenCVFrameSource::implementation : concurrency::agent
+	class OpenCVFrameSource::implementation
 	{
 		//friend class OpenCVFrameSource;
 	public:
 		implementation();
-		implementation(std::string const & filename);
+		implementation(std::string const & filename, size_t cache_bytes, int number_of_decoders, bool fast_open);
 		~implementation();
 
 		void setFrameOffset(int);
 		void openVideo(std::string const & filename);
 		int numFrames() const;
 		bool isActive() const;
+		bool isFrameCountVerified() const;
+		int waitFrameCount();
+		void subscribeFrameCount(FrameCountHandler);
 
-		// TODO: if n < frame_count, cache preceding N frames
 		Image getFrameData(int);
 
 		int getFrameWidth() const;
 		int getFrameHeight() const;
 		double getFPS() const;
 		std::string getFourCC() const;
+		// empty if the video is not open
+		std::string getFileName() const { return video_filename; }
+		// Queues the request with the decoder that reaches the frame soonest.
 		std::future<Image> post(int);
+		// Queues a range with the decoder that reaches its first frame soonest. The future is ready once the
+		// frames are handed over; the handler is used until then.
+		std::future<Image> post(int first, int last, const FrameHandler& handler);
+		// Posts the range a chunk at a time, so that the frames requested meanwhile, as by a viewer, wait for
+		// one chunk at most.
+		void getFrames(int first, int last, const FrameHandler& handler);
+		int numDecoders() const;
+		decode_statistics getStatistics() const;
+		void reserveFrameBuffers(int);
+
+		// Returns the frame if it is cached, an empty image otherwise. Called by the clients, not the agent.
+		Image findFrame(int);
+		cache_statistics getCacheStatistics() const;
+		void setCacheBytes(size_t);
 
 	private:
-		cv::VideoCapture source;
+		class decoder;
+		std::vector<std::unique_ptr<decoder>> decoders;
+		std::mutex route_lock; // guards the planned positions and queue lengths of the decoders
+		// The decoder for a request from frame n, planned to return frame next after it. The caller holds the route lock.
+		decoder& route(int n, int next);
 		std::string video_filename;
 		int frame_pointer;
-		int frame_count;
+		std::atomic<int> frame_count;
 		int frame_offset;
 		int frame_width;
 		int frame_height;
@@ -42,26 +78,104 @@ namespace zt {
 
 		void init();
 
-		// trivial cache
-		int last_frame_number = -1;
-		Image last_frame;
-		Image getFrame(int);
+		// frame cache, bounded by the pixel memory of the frames
+		struct cache_entry{
+			Image frame;
+			size_t bytes;
+			std::list<int>::iterator position; // in lru
+		};
+		std::unordered_map<int, cache_entry> cache;
+		std::list<int> lru; // the most recently used first
+		size_t cache_budget;
+		cache_statistics cache_stats;
+		mutable std::mutex cache_lock;
+		// Adds a frame as the most recently used one and drops the least recently used frames over the budget.
+		void insert(int, Image);
+		void trim_locked();
+
+		// Frames up to max_frames_skipped ahead of a decoder are reached by decoding the frames in between
+		// rather than by a seek, and so are frames further ahead with no key frame in between.
+		// Seeks go to the key frame before the frame when the video has a key frame index.
+		static const int max_frames_skipped = 25;
+		// Ranges are posted in requests of up to this many frames; the requests queued meanwhile are served
+		// between them.
+		static const int max_range_frames = 32;
+		static const int unknown_position = INT_MAX;
+		keyframe_index keys;
+		bool reads_on(int position, int n) const;
+		decode_statistics stats;
+		mutable std::mutex stats_lock;
+		std::shared_ptr<frame_pool> buffers; // outlived by the images it made
+
+		void openVideoFile(std::string const & filename, int number_of_decoders, bool fast_open);
+
+		// With a fast open the frame count is that of the container until a counter decodes the video through.
+		class counter;
+		std::unique_ptr<counter> frame_counter;
+		bool count_verified;
+		FrameCountHandler count_handler;
+		mutable std::mutex count_lock;
+		std::condition_variable count_known;
+		void setCountedFrames(int);
+	};
+
+	// Counts the frames of the video with a capture of its own, as the decoders serve frames meanwhile.
+	// The frames are grabbed one by one from the last key frame known, so that closing the video stops the
+	// count after the frame being grabbed.
+	class OpenCVFrameSource::implementation::counter : concurrency::agent
+	{
+	public:
+		counter(implementation& owner, std::string const & filename) : owner(owner), filename(filename), stopping(false) { start(); }
+		~counter() {
+			stopping = true;
+			agent::wait(this);
+		}
+	private:
+		implementation& owner;
+		std::string filename;
+		std::atomic<bool> stopping;
+		void run() override;
+	};
 
-		//class OCVVH_cache : public MemCache<OpenCVImage>
-		//{
-		//private:
-		//	implementation * parent;
-		//	void getCallback(int n, OpenCVImage & b) { return parent->getFrame(n, b); }
-		//public:
-		//	OCVVH_cache(implementation * owner) : parent(owner) {}
-		//	~OCVVH_cache() {}
-		//} *cache;
+	// A capture of the video with its own agent, so that the decoders of a pool decode in parallel.
+	// Each decoder is first sent to its own range of the video; after that the requests go where they are
+	// read on without a seek, so that every decoder stays with one run of frames.
+	class OpenCVFrameSource::implementation::decoder : concurrency::agent
+	{
+	public:
+		decoder(implementation& owner, int range_start) : owner(owner), range_start(range_start) {}
+		~decoder();
+		cv::VideoCapture source;
+		const int range_start;
+		// The frame the decoder returns next once the queued requests are served, and the number of these
+		// requests. Guarded by the route lock of the owner.
+		int planned;
+		int queued = 0;
 
-		void openVideoFile(std::string const & filename);
+		std::future<Image> post(int);
+		std::future<Image> post(int first, int last, const FrameHandler* handler);
 
-		// asynchronous mailbox
-		typedef std::pair<int, std::promise<Image>> msg_type;
+	private:
+		implementation& owner;
+		int position; // the frame the capture returns next, unknown_position if not known
+		Image getFrame(int);
+		// Decodes up to frame n from the position into the buffer, counting the frames dropped on the way.
+		// The frame is the buffer if frame n was decoded and empty otherwise.
+		void read_on(int n, cv::Mat& buffer, cv::Mat& frame, long long& skipped);
+
+		// a frame, or a range of frames for a handler
+		struct msg_type{
+			int first, last;
+			const FrameHandler* handler;	// nullptr for a single frame
+			std::promise<Image> frame;		// the frame, or an empty image once the range is handed over
+		};
+		// asynchronous mailbox, an empty message stops the agent
 		concurrency::unbounded_buffer<std::shared_ptr<msg_type>> mqueue;
+		// ranges and the stop message received while a range is served, served after it in order
+		std::deque<std::shared_ptr<msg_type>> deferred;
+		void serve(msg_type& msg);
+		// Serves the requests for single frames queued since the range began, between two of its frames.
+		void serve_waiting();
 		void run() override;
 	};
 
@@ -69,41 +183,73 @@ namespace zt {
 
 using namespace zt;
 
-OpenCVFrameSource::OpenCVFrameSource(std::string fileName) : impl(new OpenCVFrameSource::implementation(fileName)) {}
+OpenCVFrameSource::OpenCVFrameSource(std::string fileName, size_t cache_bytes, int decoders, bool fast_open) : impl(new OpenCVFrameSource::implementation(fileName, cache_bytes, decoders, fast_open)) {}
 OpenCVFrameSource::~OpenCVFrameSource() {}
 int OpenCVFrameSource::numFrames() const { return impl->numFrames(); }
+bool OpenCVFrameSource::frameCountVerified() const { return impl->isFrameCountVerified(); }
+int OpenCVFrameSource::verifiedNumFrames() const { return impl->waitFrameCount(); }
+void OpenCVFrameSource::subscribeFrameCount(FrameCountHandler handler) { impl->subscribeFrameCount(handler); }
 //bool OpenCVFrameSource::isActive() const { return impl->isActive(); }
-Image OpenCVFrameSource::getFrame(int n) const { return impl->post(n).get(); }
+Image OpenCVFrameSource::getFrame(int n) const {
+	Image frame = impl->findFrame(n);
+	return frame ? frame : impl->post(n).get();
+}
+std::future<Image> OpenCVFrameSource::requestFrame(int n) const {
+	Image frame = impl->findFrame(n);
+	if (!frame) return impl->post(n);
+	std::promise<Image> ready;
+	ready.set_value(frame);
+	return ready.get_future();
+}
+void OpenCVFrameSource::getFrames(int first, int last, const FrameHandler& handler) const { impl->getFrames(first, last, handler); }
+int OpenCVFrameSource::numDecoders() const { return impl->numDecoders(); }
 int OpenCVFrameSource::frameWidth() const { return impl->getFrameWidth(); }
 int OpenCVFrameSource::frameHeight() const { return impl->getFrameHeight(); }
 double OpenCVFrameSource::framesPerSecond() const { return impl->getFPS(); }
 std::string OpenCVFrameSource::fourCC() const { return impl->getFourCC(); }
+unsigned long long OpenCVFrameSource::fingerprint() const {
+	std::string fileName = impl->getFileName();
+	return fileName.empty() ? FrameSource::fingerprint() : fileFingerprint(fileName);
+}
+OpenCVFrameSource::decode_statistics OpenCVFrameSource::statistics() const { return impl->getStatistics(); }
+void OpenCVFrameSource::reserveFrameBuffers(int buffers) { impl->reserveFrameBuffers(buffers); }
+OpenCVFrameSource::cache_statistics OpenCVFrameSource::cacheStatistics() const { return impl->getCacheStatistics(); }
+void OpenCVFrameSource::setCacheBytes(size_t cache_bytes) { impl->setCacheBytes(cache_bytes); }
 
 void OpenCVFrameSource::implementation::init()
 {
+	frame_count = 0;
+	count_verified = true;
+	count_handler = nullptr;
+	stats = decode_statistics{};
+	buffers = std::make_shared<frame_pool>(default_frame_buffers);
+	cache_budget = default_cache_bytes;
+	cache_stats = cache_statistics{};
 	//frame_pointer = Nullint;
 	//frame_offset = 0;
 	//cache = new OCVVH_cache(this);
 }
 
 OpenCVFrameSource::implementation::implementation()
-:mqueue()
 {
 	init();
 }
-OpenCVFrameSource::implementation::implementation(std::string const & filename)
+OpenCVFrameSource::implementation::implementation(std::string const & filename, size_t cache_bytes, int number_of_decoders, bool fast_open)
 {
 	init();
-	this->openVideo(filename);
+	cache_budget = cache_bytes;
+	openVideoFile(filename, number_of_decoders, fast_open);
 }
 OpenCVFrameSource::implementation::~implementation()
 {
-	//delete cache;
+	// the counter and the decoders use the members until they stop
+	frame_counter.reset();
+	decoders.clear();
 }
 
 bool OpenCVFrameSource::implementation::isActive() const
 {
-	return source.isOpened();
+	return !decoders.empty();
 }
 
 void OpenCVFrameSource::implementation::setFrameOffset(int n)
@@ -114,12 +260,15 @@ void OpenCVFrameSource::implementation::setFrameOffset(int n)
 void OpenCVFrameSource::implementation::openVideo(std::string const & filename)
 {
 	// TODO: check whether 'filename' already open ...would need explicit filename/frame_pointer reset below. 
-	openVideoFile(filename);
+	openVideoFile(filename, 1, false);
 }
 
-void OpenCVFrameSource::implementation::openVideoFile(std::string const & filename)
+void OpenCVFrameSource::implementation::openVideoFile(std::string const & filename, int number_of_decoders, bool fast_open)
 {
 	// TODO: sort out video_filename member - should reflect actuality, not aspiration
+	decoders.clear();
+	decoders.emplace_back(new decoder(*this, 0));
+	cv::VideoCapture& source = decoders[0]->source;
 	source.open(filename);
 
 	if (!source.isOpened())
@@ -128,6 +277,7 @@ void OpenCVFrameSource::implementation::openVideoFile(std::string const & filena
 		video_filename = "";
 		frame_pointer = 0;
 		frame_count = 0;
+		decoders.clear();
 	}
 	else
 	{
@@ -135,9 +285,20 @@ void OpenCVFrameSource::implementation::openVideoFile(std::string const & filena
 		video_filename = filename;
 		//cache->reset();
 
-		// force codec to actually count frames. The fetch stops past the last frame.
-		source.set(CV_CAP_PROP_POS_FRAMES, source.get(CV_CAP_PROP_FRAME_COUNT));
-		frame_count = static_cast<int>(source.get(CV_CAP_PROP_POS_FRAMES));
+		keys = keyframe_index::open(filename);
+		if (!fast_open){
+			// force codec to actually count frames. The fetch stops past the last frame.
+			source.set(CV_CAP_PROP_POS_FRAMES, source.get(CV_CAP_PROP_FRAME_COUNT));
+			frame_count = static_cast<int>(source.get(CV_CAP_PROP_POS_FRAMES));
+			if (keys.counted_frames() != frame_count) keys.set_counted_frames(filename, frame_count);
+		}
+		else if (keys.counted_frames() >= 0)
+			frame_count = keys.counted_frames();
+		else{
+			// the frames in the index of the container, or the count the container header gives
+			frame_count = keys.indexed_frames() > 0 ? keys.indexed_frames() : static_cast<int>(source.get(CV_CAP_PROP_FRAME_COUNT));
+			count_verified = false;
+		}
 
 		// set-up frame buffer
 		frame_width = static_cast<int>(source.get(CV_CAP_PROP_FRAME_WIDTH));
@@ -150,6 +311,19 @@ void OpenCVFrameSource::implementation::openVideoFile(std::string const & filena
 		fourCC.push_back(char((fcc >> 16) & 255));
 		fourCC.push_back(char((fcc >> 24) & 255));
 
+		// the other decoders of a pool, each for about an equal range of the video starting at a key frame;
+		// they need not count the frames
+		for (int d = 1; d < number_of_decoders && d < frame_count; d++){
+			int range_start = static_cast<int>(static_cast<long long>(frame_count) * d / number_of_decoders);
+			int key = keys.key_frame_before(range_start);
+			if (key > 0) range_start = key;
+			std::unique_ptr<decoder> other(new decoder(*this, range_start));
+			if (!other->source.open(filename)) break;
+			decoders.push_back(std::move(other));
+		}
+		for (auto& d : decoders) d->planned = unknown_position;
+		if (!count_verified) frame_counter.reset(new counter(*this, filename));
+
 		// TODO: validity checks
 		/*
 		cv::Mat frame;
@@ -164,6 +338,63 @@ int OpenCVFrameSource::implementation::numFrames() const
 	return frame_count;
 }
 
+bool OpenCVFrameSource::implementation::isFrameCountVerified() const
+{
+	std::lock_guard<std::mutex> lock(count_lock);
+	return count_verified;
+}
+
+int OpenCVFrameSource::implementation::waitFrameCount()
+{
+	std::unique_lock<std::mutex> lock(count_lock);
+	count_known.wait(lock, [this]{ return count_verified; });
+	return frame_count;
+}
+
+void OpenCVFrameSource::implementation::subscribeFrameCount(FrameCountHandler handler)
+{
+	bool verified;
+	{
+		std::lock_guard<std::mutex> lock(count_lock);
+		count_handler = handler;
+		verified = count_verified;
+	}
+	if (handler != nullptr && verified) handler(frame_count);
+}
+
+void OpenCVFrameSource::implementation::setCountedFrames(int count)
+{
+	FrameCountHandler handler;
+	{
+		std::lock_guard<std::mutex> lock(count_lock);
+		frame_count = count;
+		count_verified = true;
+		handler = count_handler;
+	}
+	count_known.notify_all();
+	// the side file is written without holding up those who wait for the count
+	keys.set_counted_frames(video_filename, count);
+	if (handler != nullptr) handler(count);
+}
+
+void OpenCVFrameSource::implementation::counter::run()
+{
+	cv::VideoCapture source;
+	int count = owner.frame_count;
+	if (source.open(filename)){
+		// a seek to a key frame lands where asked, the frames after it are counted
+		int key = owner.keys.key_frame_before(owner.keys.indexed_frames() - 1);
+		count = 0;
+		if (key > 0){
+			source.set(CV_CAP_PROP_POS_FRAMES, key);
+			count = key;
+		}
+		while (!stopping && source.grab()) count++;
+	}
+	if (!stopping) owner.setCountedFrames(count);
+	done();
+}
+
 int OpenCVFrameSource::implementation::getFrameWidth() const
 {
 	return frame_width;
@@ -177,6 +408,19 @@ int OpenCVFrameSource::implementation::getFrameHeight() const
 double OpenCVFrameSource::implementation::getFPS() const { return fps; }
 std::string OpenCVFrameSource::implementation::getFourCC() const { return fourCC; }
 
+OpenCVFrameSource::decode_statistics OpenCVFrameSource::implementation::getStatistics() const
+{
+	std::lock_guard<std::mutex> lock(stats_lock);
+	decode_statistics result = stats;
+	result.buffers_allocated = buffers->allocated();
+	return result;
+}
+
+void OpenCVFrameSource::implementation::reserveFrameBuffers(int count)
+{
+	buffers->reserve(count);
+}
+
 //Image OpenCVFrameSource::implementation::getFrameData(int n)
 //{
 //	n += frame_offset;
@@ -190,37 +434,219 @@ std::string OpenCVFrameSource::implementation::getFourCC() const { return fourCC
 //	return *frame_buffer;
 //}
 
-Image OpenCVFrameSource::implementation::getFrame(int n)
+Image OpenCVFrameSource::implementation::decoder::getFrame(int n)
 {
-	if (!source.isOpened() || n < 0 || n >= numFrames()) throw std::exception("invalid operation on OpenCV video capture");
-	if (n != last_frame_number){
-		last_frame_number = n;
+	if (!source.isOpened() || n < 0 || n >= owner.numFrames()) throw std::exception("invalid operation on OpenCV video capture");
+	{
+		// decoded while the request was queued
+		std::lock_guard<std::mutex> lock(owner.cache_lock);
+		auto it = owner.cache.find(n);
+		if (it != owner.cache.end()) return it->second.frame;
+	}
+	auto start = std::chrono::steady_clock::now();
+	long long skipped = 0, seeks = 0;
+	cv::Mat buffer = owner.buffers->acquire(owner.frame_height, owner.frame_width, CV_8UC3), frame;
+	if (owner.reads_on(position, n)) read_on(n, buffer, frame, skipped);
+	int key = owner.keys.key_frame_before(n);
+	if (frame.empty() && key >= 0){
+		// behind or far ahead: a seek to a key frame lands where asked, the frames from it to n are decoded
+		source.set(CV_CAP_PROP_POS_FRAMES, key);
+		seeks++;
+		position = key;
+		read_on(n, buffer, frame, skipped);
+	}
+	if (frame.empty()){
+		// no key frame known or the decoder lost its place
 		source.set(CV_CAP_PROP_POS_FRAMES, n);
+		seeks++;
+		if (source.read(buffer)) frame = buffer;
+	}
+	position = frame.empty() ? unknown_position : n + 1;
+	{
+		std::lock_guard<std::mutex> lock(owner.stats_lock);
+		if (!frame.empty()) owner.stats.frames_decoded++;
+		owner.stats.frames_skipped += skipped;
+		owner.stats.seeks += seeks;
+		owner.stats.decode_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	if (frame.empty()) throw std::runtime_error("cannot read frame " + std::to_string(n) + " of " + owner.video_filename);
+	Image image = owner.buffers->make_image(frame);
+	owner.insert(n, image);
+	return image;
+}
 
-		cv::Mat frame;
-		source >> frame;
-		last_frame = std::make_shared<OpenCVImage>(frame);
+void OpenCVFrameSource::implementation::decoder::read_on(int n, cv::Mat& buffer, cv::Mat& frame, long long& skipped)
+{
+	while (position < n && source.grab()){
+		position++;
+		skipped++;
+	}
+	// a frame of the size of the buffer is copied into it
+	if (position == n && source.read(buffer)) frame = buffer;
+}
+
+bool OpenCVFrameSource::implementation::reads_on(int position, int n) const
+{
+	if (n < position) return false;
+	int key = keys.key_frame_before(n);
+	return n - position <= max_frames_skipped || (key >= 0 && key <= position);
+}
+
+Image OpenCVFrameSource::implementation::findFrame(int n)
+{
+	std::lock_guard<std::mutex> lock(cache_lock);
+	auto it = cache.find(n);
+	if (it == cache.end()){
+		cache_stats.misses++;
+		return Image{};
 	}
-	return last_frame;
+	cache_stats.hits++;
+	lru.splice(lru.begin(), lru, it->second.position);
+	return it->second.frame;
+}
+
+void OpenCVFrameSource::implementation::insert(int n, Image frame)
+{
+	size_t bytes = static_cast<size_t>(frame->stride()) * frame->height();
+	std::lock_guard<std::mutex> lock(cache_lock);
+	if (cache.count(n) > 0) return;
+	lru.push_front(n);
+	cache[n] = cache_entry{ frame, bytes, lru.begin() };
+	cache_stats.bytes += bytes;
+	trim_locked();
+}
+
+void OpenCVFrameSource::implementation::trim_locked()
+{
+	while (cache_stats.bytes > cache_budget && lru.size() > 1){
+		auto last = cache.find(lru.back());
+		cache_stats.bytes -= last->second.bytes;
+		cache.erase(last);
+		lru.pop_back();
+		cache_stats.evictions++;
+	}
+}
+
+OpenCVFrameSource::cache_statistics OpenCVFrameSource::implementation::getCacheStatistics() const
+{
+	std::lock_guard<std::mutex> lock(cache_lock);
+	cache_statistics result = cache_stats;
+	result.frames = static_cast<int>(cache.size());
+	return result;
+}
+
+void OpenCVFrameSource::implementation::setCacheBytes(size_t cache_bytes)
+{
+	std::lock_guard<std::mutex> lock(cache_lock);
+	cache_budget = cache_bytes;
+	trim_locked();
 }
 
 std::future<Image> OpenCVFrameSource::implementation::post(int n){
-	if (status() == concurrency::agent_status::agent_created) start();
-	auto msg = std::make_shared<msg_type>(n, std::promise<Image>());
-	auto future = msg->second.get_future();
+	std::lock_guard<std::mutex> lock(route_lock);
+	return route(n, n + 1).post(n);
+}
+
+std::future<Image> OpenCVFrameSource::implementation::post(int first, int last, const FrameHandler& handler){
+	std::lock_guard<std::mutex> lock(route_lock);
+	return route(first, last).post(first, last, &handler);
+}
+
+void OpenCVFrameSource::implementation::getFrames(int first, int last, const FrameHandler& handler){
+	bool more = true;
+	FrameHandler chunk_handler = [&handler, &more](int n, Image frame){ return more = handler(n, frame); };
+	for (int n = first; n < last && more; n += max_range_frames)
+		post(n, last - n > max_range_frames ? n + max_range_frames : last, chunk_handler).get();
+}
+
+OpenCVFrameSource::implementation::decoder& OpenCVFrameSource::implementation::route(int n, int next){
+	if (decoders.empty()) throw std::exception("invalid operation on OpenCV video capture");
+	// the decoder that reads on to the frame with the fewest frames in between
+	decoder* best = nullptr;
+	for (auto& d : decoders){
+		if (reads_on(d->planned, n) && (best == nullptr || d->planned > best->planned)) best = d.get();
+	}
+	if (best == nullptr){
+		// a seek, by the decoder of the range of the frame unless another one has fewer requests queued
+		for (auto& d : decoders)
+			if (d->range_start <= n) best = d.get();
+		if (best == nullptr) best = decoders[0].get();
+		for (auto& d : decoders)
+			if (d->queued < best->queued) best = d.get();
+	}
+	best->planned = next;
+	best->queued++;
+	return *best;
+}
+
+int OpenCVFrameSource::implementation::numDecoders() const
+{
+	return static_cast<int>(decoders.size());
+}
+
+OpenCVFrameSource::implementation::decoder::~decoder(){
+	if (status() == concurrency::agent_status::agent_created) return;
+	concurrency::send(mqueue, std::shared_ptr<msg_type>());
+	agent::wait(this);
+}
+
+std::future<Image> OpenCVFrameSource::implementation::decoder::post(int n){
+	return post(n, n + 1, nullptr);
+}
+
+std::future<Image> OpenCVFrameSource::implementation::decoder::post(int first, int last, const FrameHandler* handler){
+	if (status() == concurrency::agent_status::agent_created){
+		position = unknown_position;
+		start();
+	}
+	auto msg = std::make_shared<msg_type>();
+	msg->first = first;
+	msg->last = last;
+	msg->handler = handler;
+	auto future = msg->frame.get_future();
 	concurrency::send(mqueue, msg);
 	return future;
 }
 
-void OpenCVFrameSource::implementation::run(){
+void OpenCVFrameSource::implementation::decoder::serve(msg_type& msg){
+	try{
+		if (msg.handler == nullptr) msg.frame.set_value(getFrame(msg.first));
+		else{
+			// read on through the range; the next frame is decoded once the handler takes this one, which
+			// may wait, as for a queue of frames to build trees of
+			for (int n = msg.first; n < msg.last; n++){
+				if (n > msg.first) serve_waiting();
+				if (!(*msg.handler)(n, getFrame(n))) break;
+			}
+			msg.frame.set_value(Image{});
+		}
+	}
+	catch (...){
+		msg.frame.set_exception(std::current_exception());
+	}
+	std::lock_guard<std::mutex> lock(owner.route_lock);
+	queued--;
+}
+
+void OpenCVFrameSource::implementation::decoder::serve_waiting(){
+	std::shared_ptr<msg_type> msg;
+	while (concurrency::try_receive(mqueue, msg)){
+		if (msg && msg->handler == nullptr) serve(*msg);
+		else deferred.push_back(msg);
+	}
+}
+
+void OpenCVFrameSource::implementation::decoder::run(){
 	while (true)
 	{
-		std::shared_ptr<msg_type> msg = concurrency::receive(mqueue);
-		try{
-			msg->second.set_value(getFrame(msg->first));
-		}
-		catch (...){
-			msg->second.set_exception(std::current_exception());
+		std::shared_ptr<msg_type> msg;
+		if (deferred.empty()) msg = concurrency::receive(mqueue);
+		else{
+			msg = deferred.front();
+			deferred.pop_front();
 		}
+		if (!msg) break;
+		serve(*msg);
 	}
+	done();
 }
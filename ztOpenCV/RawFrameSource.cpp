@@ -0,0 +1,163 @@
+#include <ztFrameSource.h>
+#include "OpenCVImage.h"
+
+#include <windows.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using namespace zt;
+
+namespace{
+
+	const char raw_magic[16] = "zt_raw_frames";
+	const int raw_version = 1;
+
+	// at the start of the file, padded with zeros to raw_header_bytes
+	struct raw_header{
+		char magic[16];
+		int version;
+		int width;
+		int height;
+		int channels;	// of 8 bits
+		int frames;
+		int reserved;
+		double fps;
+	};
+
+	struct file_closer{ void operator()(FILE* f) const { fclose(f); } };
+	using file_ptr = std::unique_ptr<FILE, file_closer>;
+
+	// The whole file mapped read only.
+	class mapping{
+	public:
+		explicit mapping(const std::string& fileName)
+		: _file(INVALID_HANDLE_VALUE), _mapping(nullptr), _view(nullptr), _size(0)
+		{
+			_file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+			if (_file == INVALID_HANDLE_VALUE) throw std::runtime_error("cannot open " + fileName);
+			LARGE_INTEGER size;
+			if (GetFileSizeEx(_file, &size) && size.QuadPart > 0 && static_cast<unsigned long long>(size.QuadPart) <= SIZE_MAX){
+				_size = static_cast<size_t>(size.QuadPart);
+				_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (_mapping != nullptr)
+					_view = static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+			}
+			if (_view == nullptr){
+				if (_mapping != nullptr) CloseHandle(_mapping);
+				CloseHandle(_file);
+				throw std::runtime_error("cannot map " + fileName);
+			}
+		}
+		~mapping()
+		{
+			UnmapViewOfFile(_view);
+			CloseHandle(_mapping);
+			CloseHandle(_file);
+		}
+		mapping(const mapping&) = delete;
+		mapping& operator = (const mapping&) = delete;
+
+		const char* data() const { return _view; }
+		size_t size() const { return _size; }
+	private:
+		HANDLE _file;
+		HANDLE _mapping;
+		const char* _view;
+		size_t _size;
+	};
+
+	// An image of the mapped pixels that keeps the mapping open, as its sub-images do.
+	class MappedImage : public OpenCVImage{
+	public:
+		MappedImage(const cv::Mat& pixels, std::shared_ptr<const mapping> file) : OpenCVImage(pixels), _file(std::move(file)) {}
+
+		Image subImage(int x, int y, int width, int height) const override {
+			if (x < 0 || y < 0 || width < 0 || height < 0 || x + width > this->width() || y + height > this->height())
+				throw std::out_of_range("sub-image outside the image");
+			uchar* pixels = const_cast<uchar*>(data(y)) + x * pixel_size();
+			return std::make_shared<MappedImage>(cv::Mat(height, width, CV_8UC(num_channels()), pixels, stride()), _file);
+		}
+	private:
+		std::shared_ptr<const mapping> _file;
+	};
+}
+
+class RawFrameSource::implementation{
+public:
+	explicit implementation(const std::string& fileName);
+
+	std::string fileName;
+	std::shared_ptr<const mapping> file;
+	raw_header header;
+	size_t frame_bytes;
+};
+
+RawFrameSource::implementation::implementation(const std::string& fileName)
+: fileName(fileName), file(std::make_shared<mapping>(fileName))
+{
+	if (file->size() < raw_header_bytes) throw std::runtime_error("not a raw frame file " + fileName);
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, raw_magic, sizeof(raw_magic)) != 0 || header.version != raw_version)
+		throw std::runtime_error("not a raw frame file " + fileName);
+	if (header.width <= 0 || header.height <= 0 || header.channels < 1 || header.channels > 4 || header.frames < 0)
+		throw std::runtime_error("corrupt raw frame file " + fileName);
+	frame_bytes = static_cast<size_t>(header.width) * header.channels * header.height;
+	// a file cut short by a write that failed has the frames it holds in full
+	size_t frames = (file->size() - raw_header_bytes) / frame_bytes;
+	if (frames < static_cast<size_t>(header.frames)) header.frames = static_cast<int>(frames);
+}
+
+RawFrameSource::RawFrameSource(const std::string& fileName) : impl(new implementation(fileName)) {}
+RawFrameSource::~RawFrameSource() {}
+int RawFrameSource::frameWidth() const { return impl->header.width; }
+int RawFrameSource::frameHeight() const { return impl->header.height; }
+int RawFrameSource::numFrames() const { return impl->header.frames; }
+double RawFrameSource::framesPerSecond() const { return impl->header.fps; }
+int RawFrameSource::numChannels() const { return impl->header.channels; }
+unsigned long long RawFrameSource::fingerprint() const { return fileFingerprint(impl->fileName); }
+
+Image RawFrameSource::getFrame(int frameNo) const
+{
+	if (frameNo < 0 || frameNo >= impl->header.frames) throw std::out_of_range("no such frame in the raw frame file");
+	uchar* pixels = reinterpret_cast<uchar*>(const_cast<char*>(impl->file->data() + raw_header_bytes + impl->frame_bytes * frameNo));
+	const raw_header& h = impl->header;
+	return std::make_shared<MappedImage>(cv::Mat(h.height, h.width, CV_8UC(h.channels), pixels, static_cast<size_t>(h.width) * h.channels), impl->file);
+}
+
+bool RawFrameSource::isRawFile(const std::string& fileName)
+{
+	FILE* f = nullptr;
+	if (fopen_s(&f, fileName.c_str(), "rb") != 0) return false;
+	file_ptr closer(f);
+	char magic[sizeof(raw_magic)];
+	return fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, raw_magic, sizeof(magic)) == 0;
+}
+
+void RawFrameSource::write(const FrameSource& source, const std::string& fileName)
+{
+	FILE* f = nullptr;
+	if (fopen_s(&f, fileName.c_str(), "wb") != 0) throw std::runtime_error("cannot write " + fileName);
+	file_ptr closer(f);
+	raw_header h = {};
+	memcpy(h.magic, raw_magic, sizeof(raw_magic));
+	h.version = raw_version;
+	h.width = source.frameWidth();
+	h.height = source.frameHeight();
+	h.frames = source.verifiedNumFrames();
+	h.fps = source.framesPerSecond();
+	h.channels = h.frames > 0 ? source.getFrame(0)->num_channels() : 3;
+	std::vector<char> header(raw_header_bytes);
+	memcpy(header.data(), &h, sizeof(h));
+	if (fwrite(header.data(), 1, header.size(), f) != header.size()) throw std::runtime_error("cannot write " + fileName);
+	size_t row_bytes = static_cast<size_t>(h.width) * h.channels;
+	for (int n = 0; n < h.frames; n++){
+		Image frame = source.getFrame(n);
+		if (frame->width() != h.width || frame->height() != h.height || frame->num_channels() != h.channels || frame->pixel_size() != static_cast<size_t>(h.channels))
+			throw std::runtime_error("frames of another size or format than the first one");
+		for (int row = 0; row < h.height; row++)
+			if (fwrite(frame->data(row), 1, row_bytes, f) != row_bytes) throw std::runtime_error("cannot write " + fileName);
+	}
+}
@@ -0,0 +1,108 @@
+#include <ztFrameSource.h>
+#include "frame_pool.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace zt;
+
+class ReducedFrameSource::implementation{
+public:
+	implementation(std::unique_ptr<FrameSource> source, int x, int y, int width, int height, int factor);
+
+	std::unique_ptr<FrameSource> source;
+	int x, y;			// of the region in the frames of the source
+	int width, height;	// of the reduced frames
+	int factor;
+	std::shared_ptr<frame_pool> buffers;
+
+	Image reduce(const Image& frame) const;
+};
+
+ReducedFrameSource::implementation::implementation(std::unique_ptr<FrameSource> source, int x, int y, int width, int height, int factor)
+: source(std::move(source)), factor(factor), buffers(std::make_shared<frame_pool>(2))
+{
+	if (factor < 1) throw std::invalid_argument("the scale factor must be at least 1");
+	int frame_width = this->source->frameWidth(), frame_height = this->source->frameHeight();
+	this->x = std::max(0, std::min(x, frame_width));
+	this->y = std::max(0, std::min(y, frame_height));
+	int region_width = width > 0 ? std::min(width, frame_width - this->x) : frame_width - this->x;
+	int region_height = height > 0 ? std::min(height, frame_height - this->y) : frame_height - this->y;
+	this->width = region_width / factor;
+	this->height = region_height / factor;
+	if (this->width <= 0 || this->height <= 0) throw std::invalid_argument("the region is smaller than the scale factor");
+}
+
+Image ReducedFrameSource::implementation::reduce(const Image& frame) const
+{
+	int region_width = width * factor, region_height = height * factor;
+	if (frame->width() == region_width && frame->height() == region_height && factor == 1) return frame;
+	if (frame->width() < x + region_width || frame->height() < y + region_height) throw std::runtime_error("frame smaller than the region");
+	Image region = frame->subImage(x, y, region_width, region_height);
+	if (factor == 1) return region;
+	if (region->pixel_size() != static_cast<size_t>(region->num_channels())) throw std::runtime_error("only frames of 8 bit channels are scaled down");
+	cv::Mat pixels(region_height, region_width, CV_8UC(region->num_channels()), const_cast<uchar*>(region->data()), region->stride());
+	cv::Mat scaled = buffers->acquire(height, width, pixels.type());
+	// the mean of each block; OpenCV has a vectorised path for area resampling by an integer factor
+	cv::resize(pixels, scaled, scaled.size(), 0, 0, cv::INTER_AREA);
+	return buffers->make_image(scaled);
+}
+
+ReducedFrameSource::ReducedFrameSource(std::unique_ptr<FrameSource> source, int x, int y, int width, int height, int factor)
+: impl(new implementation(std::move(source), x, y, width, height, factor)) {}
+ReducedFrameSource::~ReducedFrameSource() {}
+int ReducedFrameSource::frameWidth() const { return impl->width; }
+int ReducedFrameSource::frameHeight() const { return impl->height; }
+int ReducedFrameSource::numFrames() const { return impl->source->numFrames(); }
+double ReducedFrameSource::framesPerSecond() const { return impl->source->framesPerSecond(); }
+std::string ReducedFrameSource::fourCC() const { return impl->source->fourCC(); }
+bool ReducedFrameSource::frameCountVerified() const { return impl->source->frameCountVerified(); }
+int ReducedFrameSource::verifiedNumFrames() const { return impl->source->verifiedNumFrames(); }
+void ReducedFrameSource::subscribeFrameCount(FrameCountHandler handler) { impl->source->subscribeFrameCount(handler); }
+Image ReducedFrameSource::getFrame(int frameNo) const { return impl->reduce(impl->source->getFrame(frameNo)); }
+int ReducedFrameSource::numDecoders() const { return impl->source->numDecoders(); }
+bool ReducedFrameSource::randomAccess() const { return impl->source->randomAccess(); }
+ReducedFrameSource::decode_statistics ReducedFrameSource::statistics() const { return impl->source->statistics(); }
+int ReducedFrameSource::videoScale() const { return impl->source->videoScale() * impl->factor; }
+
+std::future<Image> ReducedFrameSource::requestFrame(int frameNo) const
+{
+	std::shared_future<Image> frame = impl->source->requestFrame(frameNo).share();
+	implementation* reducer = impl.get();
+	return std::async(std::launch::deferred, [reducer, frame]{ return reducer->reduce(frame.get()); });
+}
+
+void ReducedFrameSource::getFrames(int first, int last, const FrameHandler& handler) const
+{
+	implementation* reducer = impl.get();
+	impl->source->getFrames(first, last, [reducer, &handler](int frameNo, Image frame){ return handler(frameNo, reducer->reduce(frame)); });
+}
+
+void ReducedFrameSource::reserveFrameBuffers(int buffers)
+{
+	// the frames of the source are released once they are reduced
+	impl->source->reserveFrameBuffers(buffers);
+	impl->buffers->reserve(buffers);
+}
+
+Patch ReducedFrameSource::videoOffset() const
+{
+	Patch offset = impl->source->videoOffset();
+	int scale = impl->source->videoScale();
+	return Patch(offset.x() + impl->x * scale, offset.y() + impl->y * scale);
+}
+
+unsigned long long ReducedFrameSource::fingerprint() const
+{
+	// 64 bit FNV-1a of the fingerprint of the other source and the reduction
+	unsigned long long words[] = { impl->source->fingerprint(), static_cast<unsigned long long>(impl->x), static_cast<unsigned long long>(impl->y),
+		static_cast<unsigned long long>(impl->width), static_cast<unsigned long long>(impl->height), static_cast<unsigned long long>(impl->factor) };
+	unsigned long long h = 14695981039346656037ULL;
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(words);
+	for (size_t i = 0; i < sizeof(words); i++){
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
@@ -0,0 +1,57 @@
+#include "frame_pool.h"
+#include "OpenCVImage.h"
+
+using namespace zt;
+
+cv::Mat frame_pool::acquire(int rows, int cols, int type)
+{
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		for (auto it = _free.begin(); it != _free.end(); ++it){
+			if (it->rows == rows && it->cols == cols && it->type() == type){
+				cv::Mat buffer = *it;
+				_free.erase(it);
+				_reused++;
+				return buffer;
+			}
+		}
+		_allocated++;
+	}
+	return cv::Mat(rows, cols, type);
+}
+
+Image frame_pool::make_image(const cv::Mat& frame)
+{
+	std::weak_ptr<frame_pool> owner = shared_from_this();
+	cv::Mat buffer = frame;
+	return std::shared_ptr<OpenCVImage>(new OpenCVImage(frame), [owner, buffer](OpenCVImage* image){
+		delete image;
+		// sub-images still use the pixels unless the buffer is only referred to here
+		auto pool = owner.lock();
+		if (pool && buffer.refcount != nullptr && *buffer.refcount == 1) pool->recycle(buffer);
+	});
+}
+
+void frame_pool::recycle(const cv::Mat& buffer)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	if (static_cast<int>(_free.size()) < _max_buffers) _free.push_back(buffer);
+}
+
+void frame_pool::reserve(int max_buffers)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	if (max_buffers > _max_buffers) _max_buffers = max_buffers;
+}
+
+long long frame_pool::allocated() const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return _allocated;
+}
+
+long long frame_pool::reused() const
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	return _reused;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <ztImage.h>
+#include <opencv2/core/core.hpp>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace zt{
+
+	// Buffers of released frames kept for new frames of the same size and type, so that decoding neither
+	// allocates nor faults in fresh pages for every frame. A buffer comes back when the image made of it and
+	// all its sub-images are released; images that outlive the pool free their buffers as usual.
+	class frame_pool : public std::enable_shared_from_this<frame_pool>{
+	public:
+		explicit frame_pool(int max_buffers) : _max_buffers(max_buffers), _allocated(0), _reused(0) {}
+
+		// A buffer for a frame, one of a released frame if there is one of the size and type.
+		cv::Mat acquire(int rows, int cols, int type);
+		// An image of the frame that gives its buffer back once it is released.
+		Image make_image(const cv::Mat& frame);
+
+		// Keeps at least this many released buffers.
+		void reserve(int max_buffers);
+		long long allocated() const;	// buffers acquired that were not released before
+		long long reused() const;
+
+	private:
+		void recycle(const cv::Mat& buffer);
+
+		std::vector<cv::Mat> _free;
+		int _max_buffers;
+		long long _allocated, _reused;
+		mutable std::mutex _lock;
+	};
+}
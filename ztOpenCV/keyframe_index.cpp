@@ -0,0 +1,254 @@
+#include "keyframe_index.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+using namespace zt;
+
+namespace{
+
+	const char side_file_word[] = "zt_keyframes";
+	const int side_file_version = 2;
+
+	struct file_closer{ void operator()(FILE* f) const { fclose(f); } };
+	using file_ptr = std::unique_ptr<FILE, file_closer>;
+
+	file_ptr open_file(const std::string& path, const char* mode)
+	{
+		FILE* f = nullptr;
+		if (fopen_s(&f, path.c_str(), mode) != 0) f = nullptr;
+		return file_ptr(f);
+	}
+
+	unsigned int be32(const unsigned char* p){ return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3]; }
+	unsigned long long be64(const unsigned char* p){ return (unsigned long long)be32(p) << 32 | be32(p + 4); }
+	unsigned int le32(const unsigned char* p){ return (unsigned int)p[3] << 24 | (unsigned int)p[2] << 16 | (unsigned int)p[1] << 8 | p[0]; }
+
+	bool read_at(FILE* f, long long offset, void* data, size_t size)
+	{
+		return _fseeki64(f, offset, SEEK_SET) == 0 && fread(data, 1, size, f) == size;
+	}
+
+	// MP4 and QuickTime files are trees of boxes: a 32 bit big endian size, which is 1 if a 64 bit size
+	// follows and 0 for a box that runs to the end of its parent, and a type.
+	struct box{
+		long long body;	// where the content starts
+		long long end;
+	};
+
+	// Finds the first box of the type among the boxes from start to end.
+	bool find_box(FILE* f, long long start, long long end, const char* type, box& found)
+	{
+		while (start + 8 <= end){
+			unsigned char h[16];
+			if (!read_at(f, start, h, 8)) return false;
+			unsigned long long size = be32(h);
+			long long body = start + 8;
+			if (size == 1){
+				if (!read_at(f, start + 8, h + 8, 8)) return false;
+				size = be64(h + 8);
+				body += 8;
+			}
+			else if (size == 0) size = end - start;
+			if (size < static_cast<unsigned long long>(body - start) || size > static_cast<unsigned long long>(end - start)) return false;
+			if (memcmp(h + 4, type, 4) == 0){
+				found = box{ body, start + static_cast<long long>(size) };
+				return true;
+			}
+			start += static_cast<long long>(size);
+		}
+		return false;
+	}
+
+	bool find_path(FILE* f, box parent, const char* const* types, int count, box& found)
+	{
+		for (int i = 0; i < count; i++)
+			if (!find_box(f, parent.body, parent.end, types[i], parent)) return false;
+		found = parent;
+		return true;
+	}
+
+	// The sync samples of the first video track, as 0 based frames. A track without a sync sample table
+	// has only key frames.
+	bool scan_mp4(FILE* f, long long file_size, std::vector<int>& frames, int& indexed)
+	{
+		box moov;
+		if (!find_box(f, 0, file_size, "moov", moov)) return false;
+		for (long long start = moov.body; start < moov.end;){
+			box trak;
+			if (!find_box(f, start, moov.end, "trak", trak)) return false;
+			start = trak.end;
+
+			static const char* const handler_path[] = { "mdia", "hdlr" };
+			box hdlr;
+			unsigned char handler[12];
+			if (!find_path(f, trak, handler_path, 2, hdlr) || !read_at(f, hdlr.body, handler, 12) || memcmp(handler + 8, "vide", 4) != 0)
+				continue;
+
+			static const char* const table_path[] = { "mdia", "minf", "stbl" };
+			box stbl, stsz, stss;
+			unsigned char h[12];
+			if (!find_path(f, trak, table_path, 3, stbl)
+				|| !find_box(f, stbl.body, stbl.end, "stsz", stsz) || !read_at(f, stsz.body, h, 12)) return false;
+			unsigned int sample_size = be32(h + 4), samples = be32(h + 8);
+			// a table of sizes follows unless all samples have the same size
+			if (samples > 0x7fffffff || (sample_size == 0 ? stsz.body + 12 + 4LL * samples > stsz.end : static_cast<long long>(samples) * sample_size > file_size))
+				return false;
+			frames.clear();
+			if (!find_box(f, stbl.body, stbl.end, "stss", stss)){
+				for (unsigned int s = 0; s < samples; s++) frames.push_back(static_cast<int>(s));
+			}
+			else{
+				if (!read_at(f, stss.body, h, 8)) return false;
+				unsigned int count = be32(h + 4);
+				if (stss.body + 8 + 4LL * count > stss.end) return false;
+				std::vector<unsigned char> table(4 * static_cast<size_t>(count));
+				if (count > 0 && !read_at(f, stss.body + 8, table.data(), table.size())) return false;
+				for (unsigned int i = 0; i < count; i++){
+					unsigned int sample = be32(&table[4 * i]); // 1 based
+					if (sample >= 1 && sample <= samples && (frames.empty() || static_cast<int>(sample - 1) > frames.back()))
+						frames.push_back(static_cast<int>(sample - 1));
+				}
+			}
+			indexed = static_cast<int>(samples);
+			return true;
+		}
+		return false;
+	}
+
+	// AVI files are RIFF chunks: a four character code, a 32 bit little endian size and the content padded
+	// to an even size. The idx1 chunk lists the chunks of all streams in order with a key frame flag.
+	bool scan_avi(FILE* f, long long file_size, std::vector<int>& frames, int& indexed)
+	{
+		unsigned char h[12];
+		if (!read_at(f, 0, h, 12) || memcmp(h, "RIFF", 4) != 0 || memcmp(h + 8, "AVI ", 4) != 0) return false;
+		long long end = std::min(file_size, 8 + static_cast<long long>(le32(h + 4)));
+		int video_stream = -1;
+		long long idx1 = -1, idx1_size = 0;
+		for (long long pos = 12; pos + 8 <= end;){
+			if (!read_at(f, pos, h, 12)) break;
+			long long size = le32(h + 4);
+			if (memcmp(h, "LIST", 4) == 0 && memcmp(h + 8, "hdrl", 4) == 0){
+				// the stream headers, LIST strl chunks with a strh chunk that starts with the stream type
+				int stream = 0;
+				for (long long s = pos + 12; s + 8 <= pos + 8 + size && video_stream < 0;){
+					unsigned char sh[20];
+					if (!read_at(f, s, sh, 20)) break;
+					long long ssize = le32(sh + 4);
+					if (memcmp(sh, "LIST", 4) == 0 && memcmp(sh + 8, "strl", 4) == 0){
+						if (memcmp(sh + 12, "strh", 4) == 0){
+							unsigned char type[4];
+							if (read_at(f, s + 20, type, 4) && memcmp(type, "vids", 4) == 0) video_stream = stream;
+						}
+						stream++;
+					}
+					s += 8 + ssize + (ssize & 1);
+				}
+			}
+			else if (memcmp(h, "idx1", 4) == 0){
+				idx1 = pos + 8;
+				idx1_size = size;
+			}
+			pos += 8 + size + (size & 1);
+		}
+		if (video_stream < 0 || video_stream > 99 || idx1 < 0) return false;
+
+		char id[2] = { static_cast<char>('0' + video_stream / 10), static_cast<char>('0' + video_stream % 10) };
+		const long long entry_size = 16, entries_per_read = 4096;
+		std::vector<unsigned char> entries(static_cast<size_t>(entry_size * entries_per_read));
+		int frame = 0;
+		frames.clear();
+		for (long long e = 0; e < idx1_size / entry_size; e += entries_per_read){
+			long long count = std::min(entries_per_read, idx1_size / entry_size - e);
+			if (!read_at(f, idx1 + e * entry_size, entries.data(), static_cast<size_t>(count * entry_size))) return false;
+			for (long long i = 0; i < count; i++){
+				const unsigned char* entry = &entries[static_cast<size_t>(i * entry_size)];
+				if (entry[0] != id[0] || entry[1] != id[1] || !(memcmp(entry + 2, "dc", 2) == 0 || memcmp(entry + 2, "db", 2) == 0))
+					continue;
+				const unsigned int keyframe_flag = 0x10; // AVIIF_KEYFRAME
+				if (le32(entry + 4) & keyframe_flag) frames.push_back(frame);
+				frame++;
+			}
+		}
+		indexed = frame;
+		return true;
+	}
+
+	bool file_status(const std::string& path, long long& size, long long& time)
+	{
+		struct _stat64 st;
+		if (_stat64(path.c_str(), &st) != 0) return false;
+		size = st.st_size;
+		time = st.st_mtime;
+		return true;
+	}
+}
+
+int keyframe_index::key_frame_before(int frame) const
+{
+	if (frame < 0 || frame >= _indexed) return -1;
+	auto next = std::upper_bound(_frames.begin(), _frames.end(), frame);
+	return next == _frames.begin() ? -1 : *(next - 1);
+}
+
+keyframe_index keyframe_index::scan(const std::string& video_file)
+{
+	keyframe_index result;
+	file_ptr f = open_file(video_file, "rb");
+	if (!f || !file_status(video_file, result._video_size, result._video_time)) return result;
+	long long size = result._video_size;
+	if (!scan_mp4(f.get(), size, result._frames, result._indexed) && !scan_avi(f.get(), size, result._frames, result._indexed)){
+		result._frames.clear();
+		result._indexed = 0;
+	}
+	return result;
+}
+
+keyframe_index keyframe_index::open(const std::string& video_file)
+{
+	keyframe_index result;
+	if (!file_status(video_file, result._video_size, result._video_time)) return result;
+	std::string path = video_file + ".keyframes";
+	if (result.load(path)) return result;
+	result = scan(video_file);
+	result.save(path);
+	return result;
+}
+
+void keyframe_index::set_counted_frames(const std::string& video_file, int count)
+{
+	_counted = count;
+	save(video_file + ".keyframes");
+}
+
+bool keyframe_index::load(const std::string& path)
+{
+	file_ptr f = open_file(path, "r");
+	if (!f) return false;
+	char word[32];
+	int version, count;
+	long long size, time;
+	if (fscanf_s(f.get(), "%31s %d %lld %lld %d %d %d", word, static_cast<unsigned>(sizeof(word)), &version, &size, &time, &_indexed, &_counted, &count) != 7
+		|| strcmp(word, side_file_word) != 0 || version != side_file_version || size != _video_size || time != _video_time
+		|| _indexed < 0 || count < 0 || count > _indexed)
+		return false;
+	_frames.resize(count);
+	for (auto& k : _frames)
+		if (fscanf_s(f.get(), "%d", &k) != 1) return false;
+	return std::is_sorted(_frames.begin(), _frames.end());
+}
+
+void keyframe_index::save(const std::string& path) const
+{
+	// a folder that cannot be written to only costs a scan at every opening
+	if (_video_size == 0) return;
+	file_ptr f = open_file(path, "w");
+	if (!f) return;
+	fprintf(f.get(), "%s %d\n%lld %lld %d %d %d\n", side_file_word, side_file_version, _video_size, _video_time, _indexed, _counted, static_cast<int>(_frames.size()));
+	for (size_t i = 0; i < _frames.size(); i++)
+		fprintf(f.get(), (i + 1) % 16 == 0 || i + 1 == _frames.size() ? "%d\n" : "%d ", _frames[i]);
+}
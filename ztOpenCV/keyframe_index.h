@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace zt{
+
+	// The key frames of a video, where a decoder can start without earlier frames. They are read from the
+	// index of the container, the sync sample table of MP4 and QuickTime files or the idx1 chunk of AVI files,
+	// and kept next to the video in "<video>.keyframes" so that the container is scanned once. The side file
+	// also keeps the frame count found by decoding the whole video, which takes long for large files.
+	// Seeking to a key frame and decoding a known number of frames from it is exact, and a frame after
+	// the key frame before the wanted frame is better read on from than sought from.
+	class keyframe_index{
+	public:
+		keyframe_index() : _indexed(0), _counted(-1), _video_size(0), _video_time(0) {}
+
+		// Reads the side file of the video, or scans the video and writes the side file if it is missing or
+		// older than the video. The index is empty for other containers or containers without an index.
+		static keyframe_index open(const std::string& video_file);
+
+		// Reads the key frames from the container without decoding.
+		static keyframe_index scan(const std::string& video_file);
+
+		bool empty() const { return _frames.empty(); }
+		// The frames the index covers, from the first.
+		int indexed_frames() const { return _indexed; }
+		// The last key frame at or before the frame, -1 if the index does not tell.
+		int key_frame_before(int frame) const;
+		const std::vector<int>& key_frames() const { return _frames; }
+
+		// The frame count found by decoding, -1 if not known yet.
+		int counted_frames() const { return _counted; }
+		// Records the frame count in the side file of the video.
+		void set_counted_frames(const std::string& video_file, int count);
+
+	private:
+		std::vector<int> _frames; // ascending
+		int _indexed;
+		int _counted;
+		long long _video_size, _video_time; // when the index was made
+
+		bool load(const std::string& path);
+		void save(const std::string& path) const;
+	};
+}
@@ -211,6 +211,32 @@ Image Projector::reconstruct(const std::vector<float>& descr) const{
 	return make_image(patch_width, patch_height, pixel_size, img);
 }
 
+// 64 bit FNV-1a
+static unsigned long long hash_bytes(const void* data, size_t size, unsigned long long h)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++){
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+template<class T> static unsigned long long hash_vector(const std::vector<T>& v, unsigned long long h)
+{
+	return v.empty() ? h : hash_bytes(v.data(), v.size() * sizeof(T), h);
+}
+
+unsigned long long Projector::fingerprint() const
+{
+	int dims[] = { patch_width, patch_height, static_cast<int>(pixel_size), output_dim, data_count };
+	unsigned long long h = hash_bytes(dims, sizeof(dims), 14695981039346656037ULL);
+	h = hash_vector(mean, h);
+	h = hash_vector(proj, h);
+	h = hash_vector(weighting, h);
+	return hash_vector(eigenvalues, h); // quantised trees depend on them
+}
+
 Projector::Projector(std::string fileName)
 {
 	loadFromFile(fileName);
@@ -1,11 +1,33 @@
 #include <ztSaveable.h>
 #include <ztLog.h>
 
+#include <io.h>
+#include <cstring>
+#include <stdexcept>
+#include <windows.h>
+
 using namespace zt;
 
+namespace{
+	// The buffer of the files saveToFile and loadFromFile open. Most of the data go in bulk, this saves system calls on the rest.
+	const size_t file_buffer_size = 1 << 20;
+
+	const char file_header[] = "zt_saveable";
+}
+
+void zt::file_read_bytes(void * data, size_t element_size, size_t count, FILE * f)
+{
+	if (fread(data, element_size, count, f) != count) throw std::runtime_error("Unexpected end of file.");
+}
+
+void zt::file_write_bytes(void const * data, size_t element_size, size_t count, FILE * f)
+{
+	fwrite(data, element_size, count, f);
+}
+
 #define DEFINE_READ_WRITE_FUNCTIONS(T)                                                  \
 	std::string zt::get_name_of(T const &) { return #T; }                        \
-	void zt::file_read(T & d, FILE * f) { fread(&d, sizeof(T), 1, f); }         \
+	void zt::file_read(T & d, FILE * f) { file_read_bytes(&d, sizeof(T), 1, f); } \
 	void zt::file_write(T const & d, FILE * f) { fwrite(&d, sizeof(T), 1, f); }
 
 DEFINE_READ_WRITE_FUNCTIONS(bool)
@@ -15,6 +37,7 @@ DEFINE_READ_WRITE_FUNCTIONS(int)
 //DEFINE_READ_WRITE_FUNCTIONS(uint)
 DEFINE_READ_WRITE_FUNCTIONS(float)
 DEFINE_READ_WRITE_FUNCTIONS(double)
+DEFINE_READ_WRITE_FUNCTIONS(size_t)
 // std::vector<bool> non-comformity strikes again!
 //std::string zt::get_name_of(std::_Vb_reference<std::allocator<bool>> const &) { return "bool"; }
 
@@ -28,8 +51,9 @@ void zt::file_write(std::string const & s, FILE * f)
 void zt::file_read(std::string & s, FILE * f)
 {
 	char buffer[1024];
-	fgets(buffer, 1024, f);
-	buffer[strlen(buffer) - 1] = 0; // erase newline charater
+	if (fgets(buffer, 1024, f) == nullptr) throw std::runtime_error("Unexpected end of file.");
+	size_t length = strlen(buffer);
+	if (length > 0 && buffer[length - 1] == '\n') buffer[length - 1] = 0; // erase newline charater
 	s.assign(buffer);
 }
 
@@ -47,6 +71,26 @@ void zt::checkName(std::string const & this_name, FILE * source)
 		throw std::exception(("Wrong name in file:  expected '" + this_name + "', found '" + read_name + "'").c_str());
 }
 
+void zt::saveFileHeader(FILE * target)
+{
+	fprintf(target, "%s %d\n", file_header, file_format_version);
+}
+
+int zt::readFileHeader(FILE * source)
+{
+	long long start = _ftelli64(source);
+	char buffer[64];
+	int version = 0;
+	if (fgets(buffer, sizeof(buffer), source) == nullptr || strncmp(buffer, file_header, sizeof(file_header) - 1) != 0
+		|| sscanf_s(buffer + sizeof(file_header) - 1, "%d", &version) != 1){
+		_fseeki64(source, start, SEEK_SET); // no header, the file starts with the name
+		return 0;
+	}
+	if (version > file_format_version)
+		throw std::runtime_error("The file was written by a newer version of the program.");
+	return version;
+}
+
 void Saveable::saveName(FILE * target) const
 {
 	zt::saveName(name(), target);
@@ -54,20 +98,39 @@ void Saveable::saveName(FILE * target) const
 
 void Saveable::checkName(FILE * source)
 {
-	try { zt::checkName(name(), source); }
-	catch (std::exception e) { printf("%s\n", e.what()); abort(); } // DEBUG // TODO!: remove!
-	catch (...) { throw; }
+	// a truncated or foreign file is an error for the caller to handle, e.g. by building the object again
+	zt::checkName(name(), source);
 }
 
 void Saveable::saveToFile(std::string const & filename) const
 {
+	// written next to the file and renamed over it, so that a crash leaves either the old or the new content
+	std::string temporary = filename + ".tmp";
 	FILE * target;
-	errno_t err = fopen_s(&target, filename.c_str(), "wb");
-	if (err) throw std::exception(("Couldn't open '" + filename + "' for writing.").c_str());
-	// this will double up in many situations, but this is fine
-	this->saveName(target);
-	this->saveTo(target);
-	fclose(target);
+	errno_t err = fopen_s(&target, temporary.c_str(), "wb");
+	if (err) throw std::exception(("Couldn't open '" + temporary + "' for writing.").c_str());
+	setvbuf(target, nullptr, _IOFBF, file_buffer_size);
+	bool failed;
+	try
+	{
+		saveFileHeader(target);
+		// this will double up in many situations, but this is fine
+		this->saveName(target);
+		this->saveTo(target);
+		failed = fflush(target) != 0 || ferror(target) != 0 || _commit(_fileno(target)) != 0;
+	}
+	catch (...)
+	{
+		fclose(target);
+		remove(temporary.c_str());
+		throw;
+	}
+	failed = fclose(target) != 0 || failed;
+	if (failed || !MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		remove(temporary.c_str());
+		throw std::exception(("Couldn't write '" + filename + "'.").c_str());
+	}
 }
 
 void Saveable::loadFromFile(std::string const & filename)
@@ -75,13 +138,16 @@ void Saveable::loadFromFile(std::string const & filename)
 	FILE * source;
 	errno_t err = fopen_s(&source, filename.c_str(), "rb");
 	if (err) throw std::exception(("Couldn't open '" + filename + "' for reading.").c_str());
+	setvbuf(source, nullptr, _IOFBF, file_buffer_size);
 	try
 	{
+		readFileHeader(source);
 		this->checkName(source);
 		this->loadFrom(source); // IGD moved - makes more sense here.
 	}
 	catch (std::exception e) { 
 		Log::write(e.what());
+		fclose(source);
 		throw;
 	}
 	fclose(source);
@@ -1,6 +1,8 @@
 #include <ztTrace.h>
 #include <ztLog.h>
 #include <sstream>
+#include <algorithm>
+#include <cstdlib>
 
 #include "TracePoint.h"
 
@@ -17,6 +19,11 @@ using std::tuple;
 using std::get;
 using std::pair;
 
+namespace{
+	// The trees hinted after a changed trace point, about as many as the viewer's own hint.
+	const FrameIndex trace_prefetch_frames = 30;
+}
+
 // Builds and holds one trace.
 class zt::Trace::Implementation : concurrency::agent{
 public:
@@ -45,6 +52,7 @@ private:
 	static Msg make_msg(FrameIndex i, TracePoint* tp){ return std::make_tuple(i, shared_ptr<TracePoint>(tp)); }
 	concurrency::unbounded_buffer<Msg> _jobs;  // accepts jobs from 'fix', 'occlude' and 'reset' .
 	void change_the_trace(FrameIndex, shared_ptr<TracePoint>); // make changes to the trace according to user input.
+	vector<pair<Patch, Descriptor>> find_matches(const KDTree&, FrameIndex, FrameIndex key_frame, const TracePointKeyFrame&) const; // key frame matches in a frame.
 	shared_ptr<TracePointAuto> _occlusion{ new TracePointAuto() };
 	shared_ptr<TracePointOccluded> _trace_end{ new TracePointOccluded() };
 	bool is_keyframe(FrameIndex frame){ return TracePoint::is_keyframe(*_trace[frame]); }
@@ -155,22 +163,24 @@ void Trace::Implementation::change_the_trace(FrameIndex frame, shared_ptr<TraceP
 		_trace[frame] = make_shared<TracePointKeyFrame>(std::move(dynamic_cast<TracePointKeyFrame&>(*tp.get())));
 	}
 	else throw std::exception("internal error");
+	// The loops below ask for every tree. Only the frames after a changed point are hinted: the viewer is
+	// there, and a hint of the whole video would replace the viewer's own and start over from frame 0.
+	if (add && tp != nullptr && !_trace.empty())
+		_kdtree_source.prefetch(frame, std::min(frame + trace_prefetch_frames, static_cast<FrameIndex>(_trace.size()) - 1));
 	if (add && all){
 		// full trace preparation
 		for (size_t i = 0; i < _trace.size(); i++){
 			if (is_auto(i)){
 				auto p = make_shared<TracePointAuto>(); // reset the point
-				if (_kdtree_source.is_ready(i)){
-					auto kdt = _kdtree_source[i];
+				// a tree that failed to load is being built again
+				auto kdt = _kdtree_source.is_ready(i) ? _kdtree_source[i] : nullptr;
+				if (kdt){
 					vector<pair<FrameIndex, shared_ptr<TracePointKeyFrame>>> kfs;
 					for (size_t k = 0; k < _trace.size(); k++){
 						if (is_keyframe(k)){
 							int key_frame = static_cast<int>(kfs.size());
 							kfs.push_back(pair<FrameIndex, shared_ptr<TracePointKeyFrame>>(k, dynamic_pointer_cast<TracePointKeyFrame>(_trace[k])));
-							auto kd_matches = kdt->getMatches(kfs[key_frame].second->descriptor(), _pars.num_matches(), _pars.match_ratio());
-							vector<pair<Patch, Descriptor>> tp_matches;
-							for (auto& m : kd_matches)
-								tp_matches.push_back(pair<Patch, Descriptor>(Patch(get<0>(m), get<1>(m)), get<3>(m)));
+							auto tp_matches = find_matches(*kdt, i, k, *kfs[key_frame].second);
 							p->add_matches(kfs, key_frame, tp_matches, _pars.max_matches_per_frame(), _pars.appearance_threshold());
 						}
 					}
@@ -183,8 +193,9 @@ void Trace::Implementation::change_the_trace(FrameIndex frame, shared_ptr<TraceP
 		// incremental trace preparation
 		for (size_t i = 0; i < _trace.size(); i++){
 			if (is_auto(i)){
-				if (_kdtree_source.is_ready(i)){
-					auto kdt = _kdtree_source[i];
+				// a tree that failed to load is being built again
+				auto kdt = _kdtree_source.is_ready(i) ? _kdtree_source[i] : nullptr;
+				if (kdt){
 					vector<pair<FrameIndex, shared_ptr<TracePointKeyFrame>>> kfs;
 					int key_frame = -1;
 					for (size_t k = 0; k < _trace.size(); k++){
@@ -194,10 +205,7 @@ void Trace::Implementation::change_the_trace(FrameIndex frame, shared_ptr<TraceP
 						}
 					}
 					assert(key_frame >= 0);
-					auto kd_matches = kdt->getMatches(kfs[key_frame].second->descriptor(), _pars.num_matches(), _pars.match_ratio());
-					vector<pair<Patch, Descriptor>> tp_matches;
-					for (auto& m : kd_matches)
-						tp_matches.push_back(pair<Patch, Descriptor>(Patch(get<0>(m), get<1>(m)), get<3>(m)));
+					auto tp_matches = find_matches(*kdt, i, frame, *kfs[key_frame].second);
 					dynamic_pointer_cast<TracePointAuto>(_trace[i])->add_matches(kfs, key_frame, tp_matches, _pars.max_matches_per_frame(), _pars.appearance_threshold());
 				}
 			}
@@ -205,6 +213,21 @@ void Trace::Implementation::change_the_trace(FrameIndex frame, shared_ptr<TraceP
 	}
 }
 
+// Matches of the key frame appearance in the frame. With bounded motion only the neighbourhood of the key frame location is searched.
+vector<pair<Patch, Descriptor>> Trace::Implementation::find_matches(const KDTree& kdt, FrameIndex frame, FrameIndex key_frame, const TracePointKeyFrame& kf) const{
+	vector<Match> kd_matches;
+	if (_pars.max_speed() > 0){
+		double radius = _pars.max_speed() * std::abs(frame - key_frame);
+		kd_matches = kdt.getMatches(kf.descriptor(), _pars.num_matches(), _pars.match_ratio(), *kf.location(), radius);
+	}
+	else
+		kd_matches = kdt.getMatches(kf.descriptor(), _pars.num_matches(), _pars.match_ratio());
+	vector<pair<Patch, Descriptor>> tp_matches;
+	for (auto& m : kd_matches)
+		tp_matches.push_back(pair<Patch, Descriptor>(Patch(get<0>(m), get<1>(m)), get<3>(m)));
+	return tp_matches;
+}
+
 // function object
 class BuildTask{
 public:
@@ -24,10 +24,24 @@ using namespace ztWpf;
 using namespace msclr::interop;
 
 FrameSource::FrameSource(String^ fileName)
-: video{ *(new OpenCVFrameSource(marshal_as<std::string>(fileName))) }
+: video{ *zt::FrameSource::open(marshal_as<std::string>(fileName)).release() }, readAhead{ new zt::FrameReadAhead(video) }
+{}
+
+FrameSource::FrameSource(String^ fileName, int decoders)
+: video{ *zt::FrameSource::open(marshal_as<std::string>(fileName), decoders).release() }, readAhead{ new zt::FrameReadAhead(video) }
+{}
+
+FrameSource::FrameSource(String^ fileName, int decoders, bool fastOpen)
+: video{ *zt::FrameSource::open(marshal_as<std::string>(fileName), decoders, fastOpen).release() }, readAhead{ new zt::FrameReadAhead(video) }
+{}
+
+FrameSource::FrameSource(String^ fileName, int decoders, bool fastOpen, Int32Rect region, int factor)
+: video{ *(new zt::ReducedFrameSource(zt::FrameSource::open(marshal_as<std::string>(fileName), decoders, fastOpen), region.X, region.Y, region.Width, region.Height, factor)) }, readAhead{ new zt::FrameReadAhead(video) }
 {}
 
 FrameSource::~FrameSource(){
+	delete readAhead; // stops reading from the video
+	video.subscribeFrameCount(nullptr);
 	delete &video;
 }
 
@@ -41,6 +55,29 @@ int FrameSource::frameWidth::get(){ return video.frameWidth(); }
 int FrameSource::frameHeight::get(){ return video.frameHeight(); }
 double FrameSource::framesPerSecond::get(){ return video.framesPerSecond(); }
 String^ FrameSource::fourCC::get(){ return marshal_as<String^>(video.fourCC()); }
+bool FrameSource::frameCountVerified::get(){ return video.frameCountVerified(); }
+
+Point FrameSource::ToVideo(Point framePoint){
+	double scale = video.videoScale();
+	zt::Patch offset = video.videoOffset();
+	return Point(framePoint.X * scale + offset.x(), framePoint.Y * scale + offset.y());
+}
+
+Point FrameSource::ToFrame(Point videoPoint){
+	double scale = video.videoScale();
+	zt::Patch offset = video.videoOffset();
+	return Point((videoPoint.X - offset.x()) / scale, (videoPoint.Y - offset.y()) / scale);
+}
+
+void FrameSource::SubscribeFrameCount(FrameCountHandler^ handler){
+	if (handler == nullptr)
+		video.subscribeFrameCount(nullptr);
+	else{
+		auto ptr = System::Runtime::InteropServices::Marshal::GetFunctionPointerForDelegate(handler);
+		video.subscribeFrameCount(static_cast<zt::FrameSource::FrameCountHandler>(ptr.ToPointer()));
+	}
+	countHandler = handler; // keep the delegate from garbage collection
+}
 
 WriteableBitmap^ FrameSource::getBitmap(){
 	// Format24bppRgb Specifies that the format is 24 bits per pixel; 8 bits each are used for the red, green, and blue components
@@ -52,7 +89,7 @@ bool FrameSource::writeFrame(WriteableBitmap^ bm, int frameNo){
 	if (frameNo >= video.numFrames()) return false;
 	Image frame;
 	try {
-		frame = video.getFrame(frameNo);
+		frame = readAhead->getFrame(frameNo);
 	}
 	catch (std::exception e){
 		throw gcnew System::Exception(marshal_as<String^>(e.what()));
@@ -73,7 +110,13 @@ bool FrameSource::writeFrame(WriteableBitmap^ bm, int frameNo){
 // Writes a sub-image at the supplied offset. Actual offset may be different;
 System::Tuple<int,int>^ FrameSource::writeFrame(WriteableBitmap^ bm, int frameNo, int x, int y){
 	if (frameNo > video.numFrames()) return Tuple::Create(-1,-1);
-	auto frame = video.getFrame(frameNo);
+	Image frame;
+	try {
+		frame = readAhead->getFrame(frameNo);
+	}
+	catch (std::exception){
+		return Tuple::Create(-1, -1); // as for a frame that does not fit
+	}
 	if (frame->width() < bm->PixelWidth
 		|| frame->height() < bm->PixelHeight
 		|| frame->num_channels() != 3
@@ -93,7 +136,14 @@ System::Tuple<int,int>^ FrameSource::writeFrame(WriteableBitmap^ bm, int frameNo
 }
 
 ImageSource^ FrameSource::getPatch(int frameNo, Int32Rect^ patch){
-	Image frame = video.getFrame(frameNo);
+	// patches are taken of any frame, as of the key points of a trace; they do not move the viewer
+	Image frame;
+	try {
+		frame = video.getFrame(frameNo);
+	}
+	catch (std::exception e){
+		throw gcnew System::Exception(marshal_as<String^>(e.what()));
+	}
 	Image p = frame->subImage(patch->X, patch->Y, patch->Width, patch->Height);
 	return BitmapSource::Create(p->width(), p->height(), 96, 96, PixelFormats::Bgr24, nullptr,
 		IntPtr((void*)p->data()), p->stride()*p->height(), p->stride());
@@ -1,23 +1,34 @@
 // ztWpf.h
 
 #pragma once
-#include <OpenCVFrameSource.h>
+#include <ztFrameSource.h>
 
 namespace ztWpf{
-	using zt::OpenCVFrameSource;
 	using zt::Image;
 	using System::Windows::Media::Imaging::WriteableBitmap;
 	using System::Windows::Media::ImageSource;
 	using System::Windows::Int32Rect;
+	using System::Windows::Point;
 
 	public ref class FrameSource
 	{
 	private:
-		OpenCVFrameSource& video;
+		zt::FrameSource& video;
+		// the frames shown, with those stepped to next decoded in the background
+		zt::FrameReadAhead* readAhead;
 	public:
+		// Opens a video file, a folder of images or a raw frame file, see zt::FrameSource::open.
 		FrameSource(System::String^ fileName);
+		// Opens the video with a pool of decoders, so that trees are built from several parts of it at once.
+		FrameSource(System::String^ fileName, int decoders);
+		// With fastOpen the video opens without counting its frames first; numFrames may change once when
+		// the count is verified, see SubscribeFrameCount.
+		FrameSource(System::String^ fileName, int decoders, bool fastOpen);
+		// Crops the frames to a region and scales them down by an integer factor, see zt::ReducedFrameSource.
+		// Frame numbers stay, frame locations are mapped to the video with ToVideo.
+		FrameSource(System::String^ fileName, int decoders, bool fastOpen, Int32Rect region, int factor);
 		~FrameSource();
-		OpenCVFrameSource& GetFrameSource(){ return video; }
+		zt::FrameSource& GetFrameSource(){ return video; }
 
 		System::Windows::Size getFrameSize();
 		property int numFrames {int get(); }
@@ -25,7 +36,14 @@ namespace ztWpf{
 		property int frameHeight{int get(); }
 		property double framesPerSecond{double get(); }
 		property System::String^ fourCC{System::String^ get(); }
+
+		// The point of the original video at a point of the frames, and the other way round. They differ if the
+		// frames are cropped or scaled down; traces are saved in video coordinates.
+		Point ToVideo(Point framePoint);
+		Point ToFrame(Point videoPoint);
 		WriteableBitmap^ getBitmap();
+		// The frames written are those of a viewer: the frames it is predicted to step to next are read ahead,
+		// see zt::FrameReadAhead.
 		bool writeFrame(WriteableBitmap^ bm, int frameNo);
 
 		// Writes a sub-image at the supplied offset. Actual offset may be different.
@@ -34,6 +52,13 @@ namespace ztWpf{
 		ImageSource^ getPatch(int frameNo, Int32Rect^ patch);
 
 		Image getFrame(int frameNo){ return video.getFrame(frameNo); }
+
+		property bool frameCountVerified{bool get(); }
+		delegate void FrameCountHandler(int);
+		// The handler is called from a background thread.
+		void SubscribeFrameCount(FrameCountHandler^ handler);
+	private:
+		FrameCountHandler^ countHandler;
 	};
 
 }
@@ -7,10 +7,21 @@ using System::Runtime::InteropServices::Marshal;
 
 Matches^ KDTreeSource::getMatches(FrameIndex frameNumber, array<float>^ features, int count, Projector^ projector){
 	auto result = gcnew Matches();
-	if (impl.is_ready(frameNumber)){
+	// no tree if it failed to load and is being built again
+	std::shared_ptr<zt::KDTree> tree;
+	if (impl.is_ready(frameNumber)) tree = impl[frameNumber];
+	if (tree){
 		pin_ptr<float> ptr = &features[0];
 		std::vector<float> desc((float*)ptr, (float*)ptr + features->Length);
-		auto matches = impl[frameNumber].get()->getMatches(desc, count);
+		std::vector<zt::Match> matches;
+		if (tree->indexType() == zt::IndexType::ProductQuantised){
+			// product-quantised distances are approximate: rerank a wider candidate set on the frame pixels
+			const int rerank_factor = 4;
+			matches = tree->getMatches(desc, count * rerank_factor);
+			zt::KDTree::rerank(matches, desc, video->getFrame(frameNumber), projector->GetProjector(), count);
+		}
+		else
+			matches = tree->getMatches(desc, count);
 		for (auto match : matches)
 			result->Add(System::Tuple::Create(std::get<0>(match), std::get<1>(match), std::get<2>(match)));
 	}
@@ -12,18 +12,29 @@ namespace ztWpf{
 	using System::String;
 	using msclr::interop::marshal_as;
 
+	// The search structure used for the frames, see zt::IndexType.
+	public enum class IndexType { Float, Quantised, ProductQuantised, Forest, BruteForce };
+
 	public ref class KDTreeSource{
 	public:
 		KDTreeSource(FrameSource^ video, Projector^ projector, int pixel_step, int number_of_workers, String^ folder_path)
-			: impl(*(new zt::FileKDTreeSource(video->GetFrameSource(), projector->GetProjector(), pixel_step, number_of_workers, marshal_as<std::string>(folder_path)))){}
+			: impl(*(new zt::FileKDTreeSource(video->GetFrameSource(), projector->GetProjector(), pixel_step, number_of_workers, marshal_as<std::string>(folder_path)))), video(video){}
+		KDTreeSource(FrameSource^ video, Projector^ projector, int pixel_step, int number_of_workers, String^ folder_path, IndexType index_type)
+			: impl(*(new zt::FileKDTreeSource(video->GetFrameSource(), projector->GetProjector(), pixel_step, number_of_workers, marshal_as<std::string>(folder_path), static_cast<zt::IndexType>(index_type)))), video(video){}
+		// Keeps at most memory_budget_mb megabytes of trees in memory, see zt::CachedKDTreeSource.
+		KDTreeSource(FrameSource^ video, Projector^ projector, int pixel_step, int number_of_workers, String^ folder_path, IndexType index_type, int memory_budget_mb)
+			: impl(*(new zt::CachedKDTreeSource(video->GetFrameSource(), projector->GetProjector(), pixel_step, number_of_workers, marshal_as<std::string>(folder_path), size_t(memory_budget_mb) << 20, static_cast<zt::IndexType>(index_type)))), video(video){}
 		~KDTreeSource(){ delete &impl; }
 		const zt::KDTreeSource& GetKDTreeSource(){ return impl; }
 		Matches^ getMatches(FrameIndex frameNumber, array<float>^ features, int count, Projector^ projector);
 		bool IsReady(FrameIndex frameNumber);
+		// Hint that the trees of frames first to last will be asked for soon, see zt::KDTreeSource::prefetch.
+		void Prefetch(FrameIndex first, FrameIndex last){ impl.prefetch(first, last); }
 		delegate void ProgressHandler(FrameIndex);
 		void Subscribe(ProgressHandler^ handler);
 	private:
 		zt::KDTreeSource& impl;
+		FrameSource^ video; // the frame source to rerank approximate matches
 		ProgressHandler^ handler;
 	};
 }
@@ -9,8 +9,8 @@ using System::Runtime::InteropServices::Marshal;
 
 Trace::Trace(KDTreeSource^ kdtree_source, 
 	double match_ratio, int num_matches, int max_matches_per_frame, double appearance_threshold,
-	double λ_d, double λ_u, double λ_o, int max_occlusion_duration)
-	: impl(*(new zt::Trace(kdtree_source->GetKDTreeSource(), zt::TraceParameters(num_matches, match_ratio, max_matches_per_frame, appearance_threshold, λ_d, λ_u, λ_o, max_occlusion_duration)))) {}
+	double λ_d, double λ_u, double λ_o, int max_occlusion_duration, double max_speed)
+	: impl(*(new zt::Trace(kdtree_source->GetKDTreeSource(), zt::TraceParameters(num_matches, match_ratio, max_matches_per_frame, appearance_threshold, λ_d, λ_u, λ_o, max_occlusion_duration, max_speed)))) {}
 
 Trace::~Trace() {
 	impl.subscribe(nullptr);
@@ -33,8 +33,8 @@ void Trace::Occlude(FrameIndex frameNumber){ impl.occlude(frameNumber); }
 bool Trace::IsForceOccluded(FrameIndex frameNumber){ return impl.is_forced_occluded(frameNumber); }
 void Trace::Clear(FrameIndex frameNumber){ impl.reset(frameNumber); }
 void Trace::Rerun(double match_ratio, int num_matches, int max_matches_per_frame, double appearance_threshold,
-	double λ_d, double λ_u, double λ_o, int max_occlusion_duration){
-	impl.rerun(zt::TraceParameters(num_matches, match_ratio, max_matches_per_frame, appearance_threshold, λ_d, λ_u, λ_o, max_occlusion_duration));
+	double λ_d, double λ_u, double λ_o, int max_occlusion_duration, double max_speed){
+	impl.rerun(zt::TraceParameters(num_matches, match_ratio, max_matches_per_frame, appearance_threshold, λ_d, λ_u, λ_o, max_occlusion_duration, max_speed));
 }
 
 void Trace::Subscribe(ProgressHandler^ handler){
@@ -16,7 +16,7 @@ namespace ztWpf{
 	public:
 		Trace(KDTreeSource^ kdtree_source,
 			double match_ratio, int num_matches, int max_matches_per_frame, double matches_appearance_threshold,
-			double λ_d, double λ_u, double λ_o, int max_occlusion_duration);
+			double λ_d, double λ_u, double λ_o, int max_occlusion_duration, double max_speed);
 		~Trace();
 
 		/// <summary>Get location of the traced object at the frame. Returns nullptr if the object is occluded.</summary>
@@ -34,8 +34,9 @@ namespace ztWpf{
 		void Clear(FrameIndex frameNumber);
 
 		///<summary>Rerun the whole trace optimization with current trace points.</summary>
+		///<summary>A max_speed above 0 (pixels per frame) restricts the matches to where the object can have moved from the key frames.</summary>
 		void Rerun(double match_ratio, int num_matches, int max_matches_per_frame, double matches_appearance_threshold,
-			double λ_d, double λ_u, double λ_o, int max_occlusion_duration);
+			double λ_d, double λ_u, double λ_o, int max_occlusion_duration, double max_speed);
 
 		delegate void ProgressHandler(int, int);
 